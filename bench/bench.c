@@ -0,0 +1,422 @@
+/*
+ * Copyright 2026 the io_png contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file bench.c
+ * @brief io_png throughput benchmark
+ *
+ * Every public read and write function is timed on every input
+ * file, for every data type and option, with repetitions. The read
+ * is also split in stages: the file opening and header decoding,
+ * then the decoding and conversion of the rows. Each line gives the
+ * mean time, its relative standard deviation, the throughput in MB/s
+ * of 8bit samples and the time per pixel. If io_png is compiled with
+ * -DIO_PNG_TIMING, the read and write lines are followed by the mean
+ * time of every stage, see io_png_timing(). If io_png is compiled with
+ * -DIO_PNG_MEMSTAT, they are followed by the peak memory and the
+ * number of allocations of the last call, see io_png_mem().
+ */
+
+#if (defined(__unix__) || defined(__unix)                       \
+     || (defined(__APPLE__) && defined(__MACH__)))
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define BENCH_POSIX
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "io_png.h"
+
+#define VERSION "0.20261018"
+
+/** @brief maximum number of repetitions */
+#define BENCH_MAXREP 100
+
+/** @brief data types */
+#define BENCH_FLT 0
+#define BENCH_UCHAR 1
+#define BENCH_USHRT 2
+
+static const char *bench_type_name[3] = { "flt", "uchar", "ushrt" };
+
+/** @brief named option */
+typedef struct bench_opt_s {
+    const char *name;
+    io_png_opt_t opt;
+} bench_opt_t;
+
+static const bench_opt_t bench_rd_opt[] = {
+    {"none", IO_PNG_OPT_NONE},
+    {"rgb", IO_PNG_OPT_RGB},
+    {"gray", IO_PNG_OPT_GRAY}
+};
+
+static const bench_opt_t bench_wr_opt[] = {
+    {"none", IO_PNG_OPT_NONE},
+    {"adam7", IO_PNG_OPT_ADAM7},
+    {"zmin", IO_PNG_OPT_ZMIN},
+    {"zmax", IO_PNG_OPT_ZMAX},
+    {"index", IO_PNG_OPT_INDEX},
+    {"fast", IO_PNG_OPT_FAST},
+    {"archive", IO_PNG_OPT_ARCHIVE},
+    {"auto", IO_PNG_OPT_AUTO},
+    {"deadline", IO_PNG_OPT_DEADLINE}
+};
+
+#define BENCH_NRDOPT (sizeof(bench_rd_opt) / sizeof(bench_opt_t))
+#define BENCH_NWROPT (sizeof(bench_wr_opt) / sizeof(bench_opt_t))
+
+/** @brief benchmark state, shared by the timed functions */
+typedef struct bench_s {
+    const char *fin;            /* input file */
+    const char *fout;           /* output file */
+    const char *dir;            /* scratch folder */
+    size_t nx, ny, nc;          /* input image size */
+    float *flt;                 /* input image, by data type */
+    unsigned char *uchar;
+    unsigned short *ushrt;
+    io_png_opt_t opt;           /* current option */
+    int type;                   /* current data type */
+    int nrep;                   /* maximum number of repetitions */
+    double budget;              /* time budget per line, in s */
+    const char *filter;         /* selected lines, or NULL */
+} bench_t;
+
+/** @brief timed function */
+typedef void (*bench_fn_t) (const bench_t *);
+
+/** @brief wall clock, in s */
+static double bench_now(void)
+{
+#ifdef BENCH_POSIX
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1E-9 * (double) ts.tv_nsec;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * timed functions
+ */
+
+static void bench_read(const bench_t * b)
+{
+    size_t nx, ny, nc;
+
+    switch (b->type) {
+    case BENCH_FLT:
+        free(io_png_read_flt_opt(b->fin, &nx, &ny, &nc, b->opt));
+        break;
+    case BENCH_UCHAR:
+        free(io_png_read_uchar_opt(b->fin, &nx, &ny, &nc, b->opt));
+        break;
+    default:
+        free(io_png_read_ushrt_opt(b->fin, &nx, &ny, &nc, b->opt));
+        break;
+    }
+}
+
+static void bench_read_mmap(const bench_t * b)
+{
+    size_t nx, ny, nc;
+    float *data;
+
+    data = io_png_read_flt_mmap(b->fin, b->dir, &nx, &ny, &nc);
+    io_png_munmap_flt(data, nx, ny, nc);
+}
+
+/* read stage: file opening and header decoding */
+static void bench_rows_open(const bench_t * b)
+{
+    io_png_rows_close(io_png_rows_open(b->fin, NULL, NULL, NULL, b->opt));
+}
+
+/* read stages: opening, then row decoding and conversion */
+static void bench_rows(const bench_t * b)
+{
+    io_png_rows_t *rows;
+    size_t nx, ny, nc, i;
+    void *row;
+
+    rows = io_png_rows_open(b->fin, &nx, &ny, &nc, b->opt);
+    row = malloc(nx * nc * sizeof(float));
+    for (i = 0; i < ny; i++)
+        switch (b->type) {
+        case BENCH_FLT:
+            io_png_rows_get_flt(rows, (float *) row, nx);
+            break;
+        case BENCH_UCHAR:
+            io_png_rows_get_uchar(rows, (unsigned char *) row, nx);
+            break;
+        default:
+            io_png_rows_get_ushrt(rows, (unsigned short *) row, nx);
+            break;
+        }
+    io_png_rows_close(rows);
+    free(row);
+}
+
+static void bench_write(const bench_t * b)
+{
+    switch (b->type) {
+    case BENCH_FLT:
+        io_png_write_flt_opt(b->fout, b->flt, b->nx, b->ny, b->nc, b->opt);
+        break;
+    case BENCH_UCHAR:
+        io_png_write_uchar_opt(b->fout, b->uchar, b->nx, b->ny, b->nc,
+                               b->opt);
+        break;
+    default:
+        io_png_write_ushrt_opt(b->fout, b->ushrt, b->nx, b->ny, b->nc,
+                               b->opt);
+        break;
+    }
+}
+
+/* tiled write, 64x64 tiles copied from the float image */
+static void bench_tiles(const bench_t * b)
+{
+    io_png_tiles_t *tiles;
+    float *tile;
+    size_t tx, ty, x0, y0, w, h, x, y, c;
+
+    tiles = io_png_tiles_open(b->fout, b->nx, b->ny, b->nc, 64, 64,
+                              b->opt);
+    tile = (float *) malloc(64 * 64 * b->nc * sizeof(float));
+    for (ty = 0; ty * 64 < b->ny; ty++)
+        for (tx = 0; tx * 64 < b->nx; tx++) {
+            x0 = tx * 64;
+            y0 = ty * 64;
+            w = (b->nx - x0 < 64 ? b->nx - x0 : 64);
+            h = (b->ny - y0 < 64 ? b->ny - y0 : 64);
+            for (c = 0; c < b->nc; c++)
+                for (y = 0; y < h; y++)
+                    for (x = 0; x < w; x++)
+                        tile[(c * h + y) * w + x] =
+                            b->flt[(c * b->ny + y0 + y) * b->nx + x0 + x];
+            io_png_tiles_put_flt(tiles, tile, tx, ty);
+        }
+    io_png_tiles_close(tiles);
+    free(tile);
+}
+
+static void bench_transcode(const bench_t * b)
+{
+    io_png_transcode(b->fin, b->fout, b->opt);
+}
+
+/*
+ * measure and report
+ */
+
+/**
+ * @brief time a function and print a line of results
+ *
+ * The function runs up to nrep times, and stops after the time
+ * budget; a second run is skipped only when the first one exceeds
+ * the budget.
+ *
+ * @param b benchmark state
+ * @param fn timed function
+ * @param func, type, opt line names, type and opt can be NULL
+ */
+static void bench_run(const bench_t * b, bench_fn_t fn, const char *func,
+                      const char *type, const char *opt)
+{
+    double t[BENCH_MAXREP];
+    double t0, total, mean, var;
+    io_png_timing_t rd, wr, *st;
+    io_png_mem_t mem;
+    char name[64];
+    int n, i;
+
+    sprintf(name, "%-16s %-6s %-9s", func, (NULL != type ? type : "-"),
+            (NULL != opt ? opt : "-"));
+    if (NULL != b->filter && NULL == strstr(name, b->filter))
+        return;
+
+    io_png_timing_reset();
+    io_png_mem_reset();
+    total = 0.;
+    for (n = 0; n < b->nrep && (0 == n || total < b->budget); n++) {
+        t0 = bench_now();
+        fn(b);
+        t[n] = bench_now() - t0;
+        total += t[n];
+    }
+    mean = total / n;
+    var = 0.;
+    for (i = 0; i < n; i++)
+        var += (t[i] - mean) * (t[i] - mean);
+    var = (1 < n ? var / (n - 1) : 0.);
+
+    printf("%s %10.3f ms %6.1f%% %9.2f MB/s %8.2f ns/px %3d\n", name,
+           1E3 * mean, 1E2 * sqrt(var) / mean,
+           1E-6 * (double) (b->nx * b->ny * b->nc) / mean,
+           1E9 * mean / (double) (b->nx * b->ny), n);
+    /* mean time by stage, if io_png is compiled with -DIO_PNG_TIMING */
+    if (io_png_timing(NULL, &rd, &wr) && 0 < rd.calls + wr.calls) {
+        st = (0 < rd.calls ? &rd : &wr);
+        printf("#   open %.3f io %.3f codec %.3f convert %.3f "
+               "close %.3f other %.3f ms\n",
+               1E3 * st->open / st->calls, 1E3 * st->io / st->calls,
+               1E3 * st->codec / st->calls, 1E3 * st->convert / st->calls,
+               1E3 * st->close / st->calls, 1E3 * st->other / st->calls);
+    }
+    /* memory of the last call, if io_png is compiled with -DIO_PNG_MEMSTAT */
+    if (io_png_mem(&mem, NULL) && 0 < mem.allocs)
+        printf("#   peak %.1f KB, %lu allocations, %lu by libpng and zlib\n",
+               (double) mem.peak / 1024., mem.allocs, mem.lib_allocs);
+    fflush(stdout);
+}
+
+/**
+ * @brief benchmark every function on a file
+ */
+static void bench_file(bench_t * b)
+{
+    size_t i;
+    int t;
+
+    b->flt = io_png_read_flt(b->fin, &b->nx, &b->ny, &b->nc);
+    b->uchar = io_png_read_uchar(b->fin, NULL, NULL, NULL);
+    b->ushrt = io_png_read_ushrt(b->fin, NULL, NULL, NULL);
+    printf("# %s, %lux%lux%lu\n", b->fin, (unsigned long) b->nx,
+           (unsigned long) b->ny, (unsigned long) b->nc);
+
+    /* read, whole image and by stages */
+    for (t = 0; t < 3; t++)
+        for (i = 0; i < BENCH_NRDOPT; i++) {
+            b->type = t;
+            b->opt = bench_rd_opt[i].opt;
+            bench_run(b, &bench_read, "read", bench_type_name[t],
+                      bench_rd_opt[i].name);
+        }
+    b->opt = IO_PNG_OPT_NONE;
+    bench_run(b, &bench_read_mmap, "read_flt_mmap", "flt", NULL);
+    for (i = 0; i < BENCH_NRDOPT; i++) {
+        b->opt = bench_rd_opt[i].opt;
+        bench_run(b, &bench_rows_open, "rows_open", NULL,
+                  bench_rd_opt[i].name);
+    }
+    for (t = 0; t < 3; t++)
+        for (i = 0; i < BENCH_NRDOPT; i++) {
+            b->type = t;
+            b->opt = bench_rd_opt[i].opt;
+            bench_run(b, &bench_rows, "rows_get", bench_type_name[t],
+                      bench_rd_opt[i].name);
+        }
+
+    /* write and re-encode */
+    for (t = 0; t < 3; t++)
+        for (i = 0; i < BENCH_NWROPT; i++) {
+            b->type = t;
+            b->opt = bench_wr_opt[i].opt;
+            bench_run(b, &bench_write, "write", bench_type_name[t],
+                      bench_wr_opt[i].name);
+        }
+    for (i = 0; i < BENCH_NWROPT; i++) {
+        /* the tiled writer has no whole-image encoder */
+        if (bench_wr_opt[i].opt & ~(IO_PNG_OPT_ZMIN | IO_PNG_OPT_ZMAX))
+            continue;
+        b->opt = bench_wr_opt[i].opt;
+        bench_run(b, &bench_tiles, "tiles_put", "flt", bench_wr_opt[i].name);
+    }
+    for (i = 0; i < BENCH_NWROPT; i++) {
+        b->opt = bench_wr_opt[i].opt;
+        bench_run(b, &bench_transcode, "transcode", NULL,
+                  bench_wr_opt[i].name);
+    }
+
+    free(b->flt);
+    free(b->uchar);
+    free(b->ushrt);
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    bench_t b;
+    char *fout;
+    int i;
+
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == strcmp("-v", argv[1])) {
+        fprintf(stdout, "%s version " VERSION
+                ", compiled " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+
+    b.dir = ".";
+    b.nrep = 10;
+    b.budget = 1.;
+    b.filter = NULL;
+    for (i = 1; i + 1 < argc && '-' == argv[i][0]; i += 2) {
+        if (0 == strcmp("-n", argv[i]))
+            b.nrep = atoi(argv[i + 1]);
+        else if (0 == strcmp("-t", argv[i]))
+            b.budget = atof(argv[i + 1]);
+        else if (0 == strcmp("-d", argv[i]))
+            b.dir = argv[i + 1];
+        else if (0 == strcmp("-f", argv[i]))
+            b.filter = argv[i + 1];
+        else
+            break;
+    }
+    /* wrong number of parameters : simple help info */
+    if (i >= argc || 1 > b.nrep) {
+        fprintf(stderr, "usage  : %s [options] in.png [in.png ...]\n",
+                argv[0]);
+        fprintf(stderr, "         -n N   : at most N repetitions (10)\n");
+        fprintf(stderr, "         -t S   : about S seconds per line (1)\n");
+        fprintf(stderr, "         -d DIR : scratch folder (.)\n");
+        fprintf(stderr, "         -f STR : only the lines containing "
+                "STR\n");
+        fprintf(stderr, "result : function type option, mean time, "
+                "deviation, MB/s, ns/pixel, repetitions\n");
+        return EXIT_FAILURE;
+    }
+    b.nrep = (b.nrep < BENCH_MAXREP ? b.nrep : BENCH_MAXREP);
+
+    fout = (char *) malloc(strlen(b.dir) + sizeof("/bench_out.png"));
+    strcpy(fout, b.dir);
+    strcat(fout, "/bench_out.png");
+    b.fout = fout;
+
+    printf("# %s\n", io_png_info());
+    printf("# function         type   option          time    dev"
+           "   throughput      per pixel   n\n");
+    for (; i < argc; i++) {
+        b.fin = argv[i];
+        bench_file(&b);
+    }
+
+    (void) remove(fout);
+    free(fout);
+    return EXIT_SUCCESS;
+}
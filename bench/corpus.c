@@ -0,0 +1,451 @@
+/*
+ * Copyright 2026 the io_png contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file corpus.c
+ * @brief synthetic PNG corpus, for the benchmarks and the regression
+ * comparisons
+ *
+ * Every PNG color type and bit depth is written, non-interlaced and
+ * Adam7 interlaced, for every content type and image size. The files
+ * are written with libpng, because io_png only writes 8bit
+ * non-palette images. The content is made by a pseudo-random
+ * generator seeded from the seed option and the file parameters, so
+ * a file is the same for a given seed, whatever the other files
+ * generated.
+ *
+ * The file names are content_NXxNY_typeDEPTH[_i].png, with the
+ * types gray, graya, rgb, rgba and pal, and _i for Adam7. The file
+ * names are printed on stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <png.h>
+
+#define VERSION "0.20261018"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/** @brief color type and bit depth */
+typedef struct corpus_fmt_s {
+    const char *name;
+    int color_type;
+    int depth;
+} corpus_fmt_t;
+
+static const corpus_fmt_t corpus_fmt[] = {
+    {"gray", PNG_COLOR_TYPE_GRAY, 1},
+    {"gray", PNG_COLOR_TYPE_GRAY, 2},
+    {"gray", PNG_COLOR_TYPE_GRAY, 4},
+    {"gray", PNG_COLOR_TYPE_GRAY, 8},
+    {"gray", PNG_COLOR_TYPE_GRAY, 16},
+    {"graya", PNG_COLOR_TYPE_GRAY_ALPHA, 8},
+    {"graya", PNG_COLOR_TYPE_GRAY_ALPHA, 16},
+    {"rgb", PNG_COLOR_TYPE_RGB, 8},
+    {"rgb", PNG_COLOR_TYPE_RGB, 16},
+    {"rgba", PNG_COLOR_TYPE_RGB_ALPHA, 8},
+    {"rgba", PNG_COLOR_TYPE_RGB_ALPHA, 16},
+    {"pal", PNG_COLOR_TYPE_PALETTE, 1},
+    {"pal", PNG_COLOR_TYPE_PALETTE, 2},
+    {"pal", PNG_COLOR_TYPE_PALETTE, 4},
+    {"pal", PNG_COLOR_TYPE_PALETTE, 8}
+};
+
+#define CORPUS_NFMT (sizeof(corpus_fmt) / sizeof(corpus_fmt_t))
+
+/** @brief content types */
+#define CORPUS_NOISE 0
+#define CORPUS_GRADIENT 1
+#define CORPUS_PHOTO 2
+#define CORPUS_FLAT 3
+
+static const char *corpus_content[] = { "noise", "gradient", "photo",
+    "flat"
+};
+
+#define CORPUS_NCONTENT 4
+
+/** @brief image sizes, the last one with the -l option */
+static const size_t corpus_size[][2] = {
+    {64, 64},
+    {640, 480},
+    {30000, 8},
+    {4000, 3000}
+};
+
+#define CORPUS_NSIZE 4
+
+/*
+ * pseudo-random generator
+ */
+
+/** @brief xorshift generator, 32bit state in an unsigned long */
+typedef struct corpus_rng_s {
+    unsigned long s;
+} corpus_rng_t;
+
+/** @brief seed the generator from a seed and a few parameters */
+static void corpus_seed(corpus_rng_t * r, unsigned long seed,
+                        unsigned long a, unsigned long b, unsigned long c)
+{
+    r->s = (seed * 2654435761UL + a * 40503UL + b * 97UL + c + 1)
+        & 0xffffffffUL;
+    if (0 == r->s)
+        r->s = 1;
+}
+
+/** @brief next 32bit value */
+static unsigned long corpus_next(corpus_rng_t * r)
+{
+    unsigned long x = r->s;
+
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    r->s = x;
+    return x;
+}
+
+/** @brief uniform value in [0,1) */
+static double corpus_unif(corpus_rng_t * r)
+{
+    return (double) corpus_next(r) / 4294967296.;
+}
+
+/*
+ * content
+ */
+
+/** @brief content parameters, drawn once per image */
+typedef struct corpus_scene_s {
+    int content;
+    size_t nx, ny;
+    corpus_rng_t rng;           /* noise and grain */
+    double wave[6][4];          /* photo: frequencies, phase, amplitude */
+    double shape[16][8];        /* flat: boxes and disks, and colors */
+    double bg[4];               /* flat: background color */
+} corpus_scene_t;
+
+/** @brief draw the content parameters */
+static void corpus_scene(corpus_scene_t * sc, int content,
+                         size_t nx, size_t ny, corpus_rng_t * r)
+{
+    int k, c;
+
+    sc->content = content;
+    sc->nx = nx;
+    sc->ny = ny;
+    for (k = 0; k < 6; k++) {
+        /* low frequencies, a few periods on the image */
+        sc->wave[k][0] = 2. * M_PI * (0.5 + 4. * corpus_unif(r)) / 512.;
+        sc->wave[k][1] = 2. * M_PI * (0.5 + 4. * corpus_unif(r)) / 512.;
+        sc->wave[k][2] = 2. * M_PI * corpus_unif(r);
+        sc->wave[k][3] = 0.25 / (k + 1);
+    }
+    for (k = 0; k < 16; k++) {
+        /* type, center, half size, then a color */
+        sc->shape[k][0] = corpus_unif(r);
+        sc->shape[k][1] = corpus_unif(r) * nx;
+        sc->shape[k][2] = corpus_unif(r) * ny;
+        sc->shape[k][3] = (0.05 + 0.2 * corpus_unif(r)) * (nx < ny ? nx : ny)
+            + 1.;
+        for (c = 0; c < 4; c++)
+            sc->shape[k][4 + c] = floor(4. * corpus_unif(r)) / 3.;
+    }
+    for (c = 0; c < 4; c++)
+        sc->bg[c] = floor(4. * corpus_unif(r)) / 3.;
+    sc->rng = *r;
+}
+
+/**
+ * @brief sample value in [0,1]
+ *
+ * @param sc content
+ * @param x, y pixel
+ * @param c channel, 3 for the alpha channel
+ */
+static double corpus_value(corpus_scene_t * sc, size_t x, size_t y, int c)
+{
+    double v, dx, dy, fx, fy;
+    int k;
+
+    fx = (double) x / (sc->nx > 1 ? sc->nx - 1 : 1);
+    fy = (double) y / (sc->ny > 1 ? sc->ny - 1 : 1);
+    switch (sc->content) {
+    case CORPUS_NOISE:
+        return corpus_unif(&sc->rng);
+    case CORPUS_GRADIENT:
+        /* horizontal, vertical and diagonal ramps */
+        if (3 == c)
+            return 1. - 0.5 * fy;
+        return (0 == c ? fx : (1 == c ? fy : 0.5 * (fx + 1. - fy)));
+    case CORPUS_PHOTO:
+        /* smooth waves, shifted by channel, and some grain */
+        if (3 == c) {
+            dx = fx - 0.5;
+            dy = fy - 0.5;
+            return 1. - (dx * dx + dy * dy);
+        }
+        v = 0.5;
+        for (k = 0; k < 6; k++)
+            v += sc->wave[k][3] * sin(sc->wave[k][0] * x
+                                      + sc->wave[k][1] * y
+                                      + sc->wave[k][2] + 0.7 * c);
+        v += 0.03 * (corpus_unif(&sc->rng) - 0.5);
+        return (v < 0. ? 0. : (v > 1. ? 1. : v));
+    default:
+        /* flat boxes and disks, the last one on top */
+        for (k = 15; k >= 0; k--) {
+            dx = (double) x - sc->shape[k][1];
+            dy = (double) y - sc->shape[k][2];
+            if (sc->shape[k][0] < 0.5
+                ? (fabs(dx) < sc->shape[k][3] && fabs(dy) < sc->shape[k][3])
+                : (dx * dx + dy * dy < sc->shape[k][3] * sc->shape[k][3]))
+                return sc->shape[k][4 + c];
+        }
+        return sc->bg[c];
+    }
+}
+
+/*
+ * PNG output
+ */
+
+/** @brief number of channels of a PNG color type */
+static int corpus_nc(int color_type)
+{
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        return 2;
+    case PNG_COLOR_TYPE_RGB:
+        return 3;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * @brief compute a PNG row
+ *
+ * @param row PNG row, big-endian for 16bit, one byte per sample for
+ *        the depths below 8
+ * @param sc content
+ * @param y row index
+ * @param fmt color type and bit depth, the alpha channel is the last
+ *        one
+ */
+static void corpus_row(png_bytep row, corpus_scene_t * sc, size_t y,
+                       const corpus_fmt_t * fmt)
+{
+    size_t x;
+    int nc, c;
+    double v;
+    unsigned long q, qmax;
+
+    nc = corpus_nc(fmt->color_type);
+    qmax = (1UL << fmt->depth) - 1;
+    for (x = 0; x < sc->nx; x++)
+        for (c = 0; c < nc; c++) {
+            v = corpus_value(sc, x, y,
+                             ((2 == nc || 4 == nc) && c == nc - 1 ? 3 : c));
+            q = (unsigned long) (v * qmax + 0.5);
+            q = (q > qmax ? qmax : q);
+            if (16 == fmt->depth) {
+                row[2 * (x * nc + c)] = (png_byte) (q >> 8);
+                row[2 * (x * nc + c) + 1] = (png_byte) (q & 0xff);
+            }
+            else
+                row[x * nc + c] = (png_byte) q;
+        }
+    return;
+}
+
+/**
+ * @brief write a PNG file
+ *
+ * @param fname file name
+ * @param fmt color type and bit depth
+ * @param interlace PNG_INTERLACE_NONE or PNG_INTERLACE_ADAM7
+ * @param sc content
+ * @param r generator, for the palette
+ * @return 0 on success, -1 on error
+ */
+static int corpus_write(const char *fname, const corpus_fmt_t * fmt,
+                        int interlace, corpus_scene_t * sc,
+                        corpus_rng_t * r)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_color pal[256];
+    png_byte trns[256];
+    png_bytep row;
+    FILE *fp;
+    size_t nx, ny, y;
+    int npal, k, bps;
+    double l;
+
+    nx = sc->nx;
+    ny = sc->ny;
+    /* bytes per sample, the packed depths use one byte per sample */
+    bps = (16 == fmt->depth ? 2 : 1);
+
+    if (NULL == (fp = fopen(fname, "wb")))
+        return -1;
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+                                      NULL);
+    info_ptr = (NULL != png_ptr ? png_create_info_struct(png_ptr) : NULL);
+    row = (png_bytep) malloc(nx * corpus_nc(fmt->color_type) * bps);
+    if (NULL == info_ptr || NULL == row) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(row);
+        fclose(fp);
+        return -1;
+    }
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(row);
+        fclose(fp);
+        return -1;
+    }
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
+                 fmt->depth, fmt->color_type, interlace,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+    /* random palette, sorted by luminance, with transparency */
+    if (PNG_COLOR_TYPE_PALETTE == fmt->color_type) {
+        npal = 1 << fmt->depth;
+        for (k = 0; k < npal; k++) {
+            l = (npal > 1 ? (double) k / (npal - 1) : 0.);
+            pal[k].red = (png_byte) (255. * l);
+            pal[k].green = (png_byte) (255. * l * corpus_unif(r));
+            pal[k].blue = (png_byte) (255. * corpus_unif(r));
+            trns[k] = (png_byte) (255 - 255 * k / (2 * npal));
+        }
+        png_set_PLTE(png_ptr, info_ptr, pal, npal);
+        png_set_tRNS(png_ptr, info_ptr, trns, npal, NULL);
+    }
+    png_write_info(png_ptr, info_ptr);
+    /* one byte per sample for the depths below 8 */
+    if (8 > fmt->depth)
+        png_set_packing(png_ptr);
+
+    /* the rows are computed again for every Adam7 pass */
+    k = png_set_interlace_handling(png_ptr);
+    for (; k > 0; k--) {
+        /* same content for every pass */
+        corpus_rng_t save = sc->rng;
+
+        for (y = 0; y < ny; y++) {
+            corpus_row(row, sc, y, fmt);
+            png_write_row(png_ptr, row);
+        }
+        sc->rng = save;
+    }
+    png_write_end(png_ptr, info_ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(row);
+    return (0 == fclose(fp) ? 0 : -1);
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    const corpus_fmt_t *fmt;
+    corpus_scene_t sc;
+    corpus_rng_t rng;
+    unsigned long seed;
+    size_t f, nsize, s, nx, ny;
+    int large, content, interlace;
+    const char *dir;
+    char *fname;
+
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == strcmp("-v", argv[1])) {
+        fprintf(stdout, "%s version " VERSION
+                ", compiled " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+    /* "-s" option : seed, "-l" option : large images */
+    seed = 1;
+    large = 0;
+    while (2 <= argc && '-' == argv[1][0] && '\0' != argv[1][1]) {
+        if (0 == strcmp("-s", argv[1]) && 3 <= argc) {
+            seed = strtoul(argv[2], NULL, 10);
+            argc--;
+            argv++;
+        }
+        else if (0 == strcmp("-l", argv[1]))
+            large = 1;
+        else
+            break;
+        argc--;
+        argv++;
+    }
+    /* wrong number of parameters : simple help info */
+    if (2 != argc) {
+        fprintf(stderr, "usage  : %s [-s seed] [-l] dir\n", argv[0]);
+        fprintf(stderr, "result : PNG files in dir, for every color type, "
+                "depth, interlace,\n"
+                "         content and size, file names on stdout\n");
+        fprintf(stderr, "         -s N  pseudo-random seed (1)\n");
+        fprintf(stderr, "         -l    also 4000x3000 images\n");
+        return EXIT_FAILURE;
+    }
+    dir = argv[1];
+    nsize = (large ? CORPUS_NSIZE : CORPUS_NSIZE - 1);
+    fname = (char *) malloc(strlen(dir) + 64);
+
+    for (s = 0; s < nsize; s++)
+        for (content = 0; content < CORPUS_NCONTENT; content++)
+            for (f = 0; f < CORPUS_NFMT; f++)
+                for (interlace = 0; interlace < 2; interlace++) {
+                    fmt = corpus_fmt + f;
+                    nx = corpus_size[s][0];
+                    ny = corpus_size[s][1];
+                    sprintf(fname, "%s/%s_%lux%lu_%s%d%s.png", dir,
+                            corpus_content[content], (unsigned long) nx,
+                            (unsigned long) ny, fmt->name, fmt->depth,
+                            (interlace ? "_i" : ""));
+                    corpus_seed(&rng, seed, (unsigned long) s,
+                                (unsigned long) content,
+                                (unsigned long) f);
+                    corpus_scene(&sc, content, nx, ny, &rng);
+                    if (0 != corpus_write(fname, fmt,
+                                          (interlace ? PNG_INTERLACE_ADAM7
+                                           : PNG_INTERLACE_NONE), &sc,
+                                          &rng)) {
+                        fprintf(stderr, "failed to write %s\n", fname);
+                        free(fname);
+                        return EXIT_FAILURE;
+                    }
+                    printf("%s\n", fname);
+                }
+
+    free(fname);
+    return EXIT_SUCCESS;
+}
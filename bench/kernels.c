@@ -0,0 +1,353 @@
+/*
+ * Copyright 2026 the io_png contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file kernels.c
+ * @brief io_png conversion kernel microbenchmark
+ *
+ * Every read and write conversion kernel is timed, for every
+ * instruction set supported by the CPU, on a cache-resident image
+ * and on an image much larger than the caches. The read kernels
+ * deinterlace the PNG rows and convert them to float, unsigned char
+ * or unsigned short, with the rgb and gray options (gray to rgb and
+ * rgb to gray); the write kernels interlace and convert the arrays
+ * to PNG rows. Each line gives the throughput in GB/s, input and
+ * output bytes, and its ratio to the memcpy() throughput for the same
+ * image size.
+ *
+ * Every timing is the median of a few rounds, each keeping its
+ * fastest pass, for the kernels and for memcpy(). The output can be
+ * kept as a baseline; with the -b option, the ratios are compared to
+ * a baseline, the kernels slower than the baseline are timed again,
+ * and those still slower by more than the tolerance are reported,
+ * with a failure exit status.
+ *
+ * The kernels are static functions: io_png.c is included, not
+ * linked.
+ */
+
+#include "io_png.c"
+
+#define VERSION "0.20261018"
+
+/** @brief image sizes, cache-resident and in main memory */
+static const struct {
+    const char *name;
+    size_t nx, ny;
+} kern_size[2] = {
+    {"cache", 256, 8},
+    {"dram", 2048, 2048}
+};
+
+static const char *kern_type[3] = { "flt", "uchar", "ushrt" };
+static const char *kern_opt[3] = { "none", "rgb", "gray" };
+
+/** @brief microbenchmark state */
+typedef struct kern_s {
+    double budget;              /* time per line, in s */
+    const char *filter;         /* selected lines, or NULL */
+    FILE *base;                 /* baseline, or NULL */
+    double tol;                 /* baseline tolerance */
+    int ncmp, nreg;             /* compared and slower lines */
+    png_byte *png;              /* PNG rows, 4 channels */
+    char *data;                 /* arrays, 4 channels of floats */
+    size_t ncpy;                /* memcpy() input and output bytes */
+    double ref;                 /* memcpy() throughput, GB/s */
+} kern_t;
+
+/** @brief independent timing rounds of a line */
+#define KERN_ROUNDS 5
+/** @brief timings of a line slower than the baseline */
+#define KERN_RETRY 3
+
+/**
+ * @brief time a kernel pass: the budget is split in rounds, each
+ * keeping its fastest pass, and the median round is used
+ */
+#define KERN_TIME(B, T, PASS) do {                              \
+        double _t0, _t1, _end, _tr, _r[KERN_ROUNDS];            \
+        int _i, _j;                                             \
+        for (_i = 0; _i < KERN_ROUNDS; _i++) {                  \
+            _tr = -1.;                                          \
+            _end = _io_png_wall() + (B)->budget / KERN_ROUNDS;  \
+            do {                                                \
+                _t0 = _io_png_wall();                           \
+                PASS;                                           \
+                _t1 = _io_png_wall();                           \
+                if (0. > _tr || _t1 - _t0 < _tr)                \
+                    _tr = _t1 - _t0;                            \
+            } while (_t1 < _end);                               \
+            for (_j = _i; 0 < _j && _r[_j - 1] > _tr; _j--)     \
+                _r[_j] = _r[_j - 1];                            \
+            _r[_j] = _tr;                                       \
+        }                                                       \
+        (T) = _r[KERN_ROUNDS / 2];                              \
+    } while (0)
+
+/**
+ * @brief time a kernel pass and report it; a line slower than the
+ * baseline is timed again with memcpy(), and its best ratio to
+ * memcpy() is reported
+ */
+#define KERN_LINE(K, ISA, NAME, SIZE, BYTES, PASS) do {        \
+        double _tm, _best, _ref;                                \
+        int _n;                                                 \
+        KERN_TIME(K, _best, PASS);                              \
+        _ref = (K)->ref;                                        \
+        for (_n = 1; _n < KERN_RETRY                            \
+                 && kern_slower(K, ISA, NAME, SIZE, BYTES, _best); \
+             _n++) {                                            \
+            kern_ref(K);                                        \
+            KERN_TIME(K, _tm, PASS);                            \
+            if (_tm * (K)->ref < _best * _ref) {                \
+                _best = _tm;                                    \
+                _ref = (K)->ref;                                \
+            }                                                   \
+        }                                                       \
+        (K)->ref = _ref;                                        \
+        kern_report(K, ISA, NAME, SIZE, BYTES, _best);          \
+    } while (0)
+
+/** @brief time memcpy() within the arrays, half in and half out */
+static void kern_ref(kern_t * k)
+{
+    double tm;
+
+    KERN_TIME(k, tm, memcpy(k->data + k->ncpy / 2, k->data, k->ncpy / 2));
+    k->ref = 1E-9 * (double) k->ncpy / tm;
+    return;
+}
+
+/**
+ * @brief look for a line in the baseline
+ *
+ * @return baseline ratio to memcpy(), in %, or -1 if not found
+ */
+static double kern_base(FILE * fp, const char *isa, const char *name,
+                        const char *size)
+{
+    char line[256], b_isa[32], b_name[64], b_size[16];
+    double gbs, pct;
+
+    rewind(fp);
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        if ('#' == line[0]
+            || 5 != sscanf(line, "%31s %63s %15s %lf GB/s %lf%%", b_isa,
+                           b_name, b_size, &gbs, &pct))
+            continue;
+        if (0 == strcmp(isa, b_isa) && 0 == strcmp(name, b_name)
+            && 0 == strcmp(size, b_size))
+            return pct;
+    }
+    return -1.;
+}
+
+/**
+ * @brief compare a line with the baseline
+ *
+ * @param bytes input and output bytes of a pass
+ * @param t pass time, in s
+ * @return 1 if slower than the baseline by more than the tolerance
+ */
+static int kern_slower(const kern_t * k, const char *isa, const char *name,
+                       const char *size, double bytes, double t)
+{
+    double base;
+
+    if (NULL == k->base || 0. > (base = kern_base(k->base, isa, name, size)))
+        return 0;
+    return (1E-7 * bytes / t / k->ref < base * (1. - k->tol));
+}
+
+/**
+ * @brief print a result line, compare with the baseline
+ *
+ * @param bytes input and output bytes of a pass
+ * @param t pass time, in s
+ */
+static void kern_report(kern_t * k, const char *isa, const char *name,
+                        const char *size, double bytes, double t)
+{
+    double gbs, pct, base;
+
+    gbs = 1E-9 * bytes / t;
+    pct = 1E2 * gbs / k->ref;
+    printf("%-8s %-20s %-6s %8.2f GB/s %6.1f%%\n", isa, name, size, gbs,
+           pct);
+    if (NULL != k->base && 0. <= (base = kern_base(k->base, isa, name,
+                                                   size))) {
+        k->ncmp += 1;
+        if (kern_slower(k, isa, name, size, bytes, t)) {
+            k->nreg += 1;
+            printf("# slower: %s %s %s, %.1f%% of memcpy, "
+                   "baseline %.1f%%\n", isa, name, size, pct, base);
+        }
+    }
+    fflush(stdout);
+}
+
+/** @brief selected line, with the filter */
+static int kern_sel(const kern_t * k, const char *isa, const char *name,
+                    const char *size)
+{
+    char line[128];
+
+    if (NULL == k->filter)
+        return 1;
+    sprintf(line, "%s %s %s", isa, name, size);
+    return (NULL != strstr(line, k->filter));
+}
+
+/**
+ * @brief time every kernel of an instruction set on an image size
+ */
+static void kern_run(kern_t * k, const _io_png_kern_t * kern, size_t s)
+{
+    size_t nx, ny, nc, nco, size, i;
+    int t, o;
+    char name[64];
+
+    nx = kern_size[s].nx;
+    ny = kern_size[s].ny;
+    for (t = 0; t < 3; t++) {
+        size = _io_png_type_size[t];
+        /* read: PNG rows to arrays */
+        for (o = 0; o < 3; o++)
+            for (nc = 1; nc <= 4; nc++) {
+                _io_png_rd_kern_t rd = kern->rd[t][o][nc - 1];
+
+                sprintf(name, "rd_%s_%s_%lu", kern_type[t], kern_opt[o],
+                        (unsigned long) nc);
+                if (!kern_sel(k, kern->isa, name, kern_size[s].name))
+                    continue;
+                nco = _io_png_rd_nc[o][nc - 1];
+                KERN_LINE(k, kern->isa, name, kern_size[s].name,
+                          (double) (nx * ny * (nc + nco * size)),
+                          for (i = 0; i < ny; i++)
+                          rd(k->data + i * nx * size,
+                             k->png + i * nx * nc, nx, nx * ny));
+            }
+        /* write: arrays to PNG rows */
+        for (nc = 1; nc <= 4; nc++) {
+            _io_png_wr_kern_t wr = kern->wr[t][nc - 1];
+
+            sprintf(name, "wr_%s_%lu", kern_type[t], (unsigned long) nc);
+            if (!kern_sel(k, kern->isa, name, kern_size[s].name))
+                continue;
+            KERN_LINE(k, kern->isa, name, kern_size[s].name,
+                      (double) (nx * ny * nc * (size + 1)),
+                      for (i = 0; i < ny; i++)
+                      wr(k->png + i * nx * nc, k->data + i * nx * size,
+                         nx, nx * ny));
+        }
+    }
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    kern_t k;
+    const _io_png_kern_t *best, *kern;
+    size_t s, n, i;
+    float *flt;
+    int a;
+
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == strcmp("-v", argv[1])) {
+        fprintf(stdout, "%s version " VERSION
+                ", compiled " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+
+    k.budget = 0.1;
+    k.filter = NULL;
+    k.base = NULL;
+    k.tol = 0.15;
+    for (a = 1; a + 1 < argc && '-' == argv[a][0]; a += 2) {
+        if (0 == strcmp("-t", argv[a]))
+            k.budget = atof(argv[a + 1]);
+        else if (0 == strcmp("-f", argv[a]))
+            k.filter = argv[a + 1];
+        else if (0 == strcmp("-r", argv[a]))
+            k.tol = atof(argv[a + 1]);
+        else if (0 == strcmp("-b", argv[a])) {
+            if (NULL == (k.base = fopen(argv[a + 1], "r"))) {
+                fprintf(stderr, "failed to open %s\n", argv[a + 1]);
+                return EXIT_FAILURE;
+            }
+        }
+        else
+            break;
+    }
+    /* wrong number of parameters : simple help info */
+    if (a != argc) {
+        fprintf(stderr, "usage  : %s [options]\n", argv[0]);
+        fprintf(stderr, "         -t S    : about S seconds per line "
+                "(0.1)\n");
+        fprintf(stderr, "         -f STR  : only the lines containing "
+                "STR\n");
+        fprintf(stderr, "         -b FILE : compare with a baseline, "
+                "a previous output\n");
+        fprintf(stderr, "         -r TOL  : baseline tolerance (0.15)\n");
+        fprintf(stderr, "result : isa kernel size, GB/s, ratio to "
+                "memcpy\n");
+        return EXIT_FAILURE;
+    }
+
+    /* largest image, 4 channels of floats and of PNG bytes */
+    n = kern_size[1].nx * kern_size[1].ny * 4;
+    k.png = (png_byte *) malloc(n);
+    flt = (float *) malloc(n * sizeof(float));
+    if (NULL == k.png || NULL == flt) {
+        fprintf(stderr, "not enough memory\n");
+        return EXIT_FAILURE;
+    }
+    k.data = (char *) flt;
+    /* pseudo-random values, in [0,1] for the floats */
+    for (i = 0; i < n; i++) {
+        k.png[i] = (png_byte) ((i * 2654435761UL) >> 13);
+        flt[i] = (float) k.png[i] / 255.f;
+    }
+    k.ncmp = 0;
+    k.nreg = 0;
+
+    /* the supported instruction sets, up to the one used by io_png */
+    best = _io_png_kern();
+    printf("# %s, kernels up to %s\n", io_png_info(), best->isa);
+    printf("# isa     kernel               size   throughput  "
+           "memcpy\n");
+    for (s = 0; s < 2; s++) {
+        /* memcpy() within the largest arrays */
+        k.ncpy = kern_size[s].nx * kern_size[s].ny * 4 * sizeof(float);
+        kern_ref(&k);
+        printf("%-8s %-20s %-6s %8.2f GB/s %6.1f%%\n", "-", "memcpy",
+               kern_size[s].name, k.ref, 100.);
+        for (kern = _io_png_kern_tab; kern <= best; kern++)
+            kern_run(&k, kern, s);
+    }
+
+    if (NULL != k.base) {
+        printf("# %d lines compared with the baseline, %d slower by more "
+               "than %.0f%%\n", k.ncmp, k.nreg, 1E2 * k.tol);
+        fclose(k.base);
+    }
+    free(k.png);
+    free(flt);
+    return (0 == k.nreg ? EXIT_SUCCESS : EXIT_FAILURE);
+}
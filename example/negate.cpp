@@ -0,0 +1,184 @@
+/*
+ * Copyright 2026 the io_png contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file negate.cpp
+ * @brief negate an image, with the C++ wrapper
+ *
+ * The color channels are negated, the alpha channel is kept. With
+ * the "-i" option, the result is written from an interleaved copy,
+ * through an interleaved view. With the "-s" option, the input is
+ * streamed by bands of rows, from a generator if the compiler has the
+ * C++20 coroutines, from a row reader otherwise. With the "-m"
+ * option, the input is read into a monotonic memory resource, if the
+ * compiler has std::pmr. With the "-e" option, the negation is a lazy
+ * expression, computed while the output is written.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "io_png.hpp"
+
+#define VERSION "0.20261018"
+
+/**
+ * @brief read a PNG file by bands of rows, row after row
+ *
+ * @param fname PNG file name
+ * @param buf array, filled with ny rows of nc channels of nx values
+ * @return view of the image in buf
+ */
+static io_png::image_view<unsigned char>
+read_rows(const char *fname, std::vector<unsigned char> &buf)
+{
+    std::size_t nx = 0, ny = 0, nc = 0;
+#if defined(IO_PNG_HPP_COROUTINE)
+    for (const io_png::image_view<const unsigned char> &band :
+         io_png::rows<unsigned char>(fname, IO_PNG_OPT_NONE, 16)) {
+        nx = band.nx();
+        nc = band.nc();
+        for (std::size_t y = 0; y < band.ny(); y++)
+            for (std::size_t c = 0; c < nc; c++)
+                buf.insert(buf.end(), band.row(y, c),
+                           band.row(y, c) + nx);
+        ny += band.ny();
+    }
+#else
+    io_png::row_reader<unsigned char> rd(fname);
+    nx = rd.nx();
+    nc = rd.nc();
+    for (ny = 0; ny < rd.ny(); ny++) {
+        buf.resize((ny + 1) * nc * nx);
+        rd.get(buf.data() + ny * nc * nx, nx);
+    }
+#endif
+    return io_png::image_view<unsigned char>(buf.data(), nx, ny, nc, 1,
+                                             (std::ptrdiff_t) (nc * nx),
+                                             (std::ptrdiff_t) nx);
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == std::strcmp("-v", argv[1])) {
+        std::fprintf(stdout, "%s version " VERSION
+                     ", compiled " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+    /*
+     * "-i" option : interleaved output, "-s" option : streamed input,
+     * "-m" option : memory resource, "-e" option : lazy expression
+     */
+    bool ilv = false, str = false, lzy = false;
+#if defined(IO_PNG_HPP_PMR)
+    bool res = false;
+#endif
+    while (2 <= argc && '-' == argv[1][0] && '\0' != argv[1][1]) {
+        if (0 == std::strcmp("-i", argv[1]))
+            ilv = true;
+        else if (0 == std::strcmp("-s", argv[1]))
+            str = true;
+#if defined(IO_PNG_HPP_PMR)
+        else if (0 == std::strcmp("-m", argv[1]))
+            res = true;
+#endif
+        else if (0 == std::strcmp("-e", argv[1]))
+            lzy = true;
+        else
+            break;
+        argc--;
+        argv++;
+    }
+    /* wrong number of parameters : simple help info */
+    if (3 != argc) {
+        std::fprintf(stderr,
+                     "usage  : %s [-i] [-s] [-m] [-e] in.png out.png\n",
+                     argv[0]);
+        std::fprintf(stderr, "result : 255 - in -> out\n");
+        std::fprintf(stderr, "         -i  interleaved output\n");
+        std::fprintf(stderr, "         -s  streamed input\n");
+        std::fprintf(stderr, "         -m  memory resource, with std::pmr\n");
+        std::fprintf(stderr, "         -e  lazy expression\n");
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * read the PNG input image into img, moved to neg, or stream it
+     * into rows
+     */
+#if defined(IO_PNG_HPP_PMR)
+    std::pmr::monotonic_buffer_resource pool;
+#endif
+    io_png::image<unsigned char> img, neg;
+    std::vector<unsigned char> rows;
+    io_png::image_view<unsigned char> v;
+    if (!str) {
+#if defined(IO_PNG_HPP_PMR)
+        if (res)
+            img = io_png::read<unsigned char>(argv[1], IO_PNG_OPT_NONE,
+                                              &pool);
+        else
+#endif
+            img = io_png::read<unsigned char>(argv[1]);
+        neg = std::move(img);
+        v = neg.view();
+    } else {
+        v = read_rows(argv[1], rows);
+    }
+
+    /* negate the color channels */
+    std::size_t ncol = (2 == v.nc() || 4 == v.nc() ? v.nc() - 1 : v.nc());
+    if (lzy) {
+        /* 1 - in for the colors, in for the alpha, as a channel mix */
+        std::vector<float> m(v.nc() * v.nc(), 0.f), b(v.nc(), 0.f);
+        for (std::size_t c = 0; c < v.nc(); c++) {
+            m[c * v.nc() + c] = (c < ncol ? -1.f : 1.f);
+            b[c] = (c < ncol ? 1.f : 0.f);
+        }
+        io_png::write(argv[2], io_png::mix(io_png::lazy(v), m, b));
+        return EXIT_SUCCESS;
+    }
+    for (std::size_t c = 0; c < ncol; c++)
+        for (std::size_t y = 0; y < v.ny(); y++) {
+            unsigned char *row = v.row(y, c);
+            for (std::size_t x = 0; x < v.nx(); x++)
+                row[x] = (unsigned char) (255 - row[x]);
+        }
+
+    /* write the PNG output image, the array is freed with neg */
+    if (!ilv) {
+        io_png::write(argv[2], io_png::image_view<const unsigned char>(v));
+    } else {
+        std::vector<unsigned char> rgb(v.size());
+        io_png::image_view<unsigned char> w =
+            io_png::interleaved_view(rgb.data(), v.nx(), v.ny(), v.nc());
+        for (std::size_t c = 0; c < v.nc(); c++)
+            for (std::size_t y = 0; y < v.ny(); y++)
+                for (std::size_t x = 0; x < v.nx(); x++)
+                    w(x, y, c) = v(x, y, c);
+        io_png::write(argv[2], io_png::image_view<const unsigned char>(w));
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -30,8 +30,12 @@ int main(int argc, char **argv)
     unsigned short *img_ushrt;
     /* temporary array */
     float *tmp;
-    /* loop counter */
-    size_t i;
+    /* tiled writer, tile array, tile position and size */
+    io_png_tiles_t *tiles;
+    float *tile;
+    size_t tx, ty, tw, th;
+    /* loop counters */
+    size_t i, x, y, c;
 
     /* the file to read is given as the first command-line argument */
     if (2 > argc) {
@@ -129,6 +133,33 @@ int main(int argc, char **argv)
     /* now let's save this image */
     io_png_write_flt("float_rgb.png", img, nx, ny, 3);
 
+    /*
+     * the same image can be written by tiles, here 64 x 64 pixels,
+     * in any order; only the incomplete rows of tiles are kept in
+     * memory, so large images can be written as they are computed
+     */
+    tiles = io_png_tiles_open("tiles_rgb.png", nx, ny, 3, 64, 64,
+                              IO_PNG_OPT_NONE);
+    tile = (float *) malloc(64 * 64 * 3 * sizeof(float));
+    /* from the last tile to the first one */
+    for (ty = (ny + 63) / 64; ty-- > 0;) {
+        for (tx = (nx + 63) / 64; tx-- > 0;) {
+            /* the last tiles can be smaller */
+            tw = (nx - 64 * tx < 64 ? nx - 64 * tx : 64);
+            th = (ny - 64 * ty < 64 ? ny - 64 * ty : 64);
+            /* the tiles are deinterlaced, like the images */
+            for (c = 0; c < 3; c++)
+                for (y = 0; y < th; y++)
+                    for (x = 0; x < tw; x++)
+                        tile[x + tw * y + tw * th * c] =
+                            img[64 * tx + x + nx * (64 * ty + y)
+                                + nx * ny * c];
+            io_png_tiles_put_flt(tiles, tile, tx, ty);
+        }
+    }
+    io_png_tiles_close(tiles);
+    free(tile);
+
     /* or we can save the channels separately */
     io_png_write_flt("float_r.png", img_r, nx, ny, 1);
     io_png_write_flt("float_g.png", img_g, nx, ny, 1);
@@ -147,6 +178,21 @@ int main(int argc, char **argv)
     free(tmp);
     free(img);
 
+    /*
+     * images too large for the memory can be read into a scratch
+     * file mapped in memory, here in the current folder; the array
+     * is used as usual, and released with io_png_munmap_flt()
+     */
+    img = io_png_read_flt_mmap(argv[1], ".", &nx, &ny, &nc);
+    tmp = io_png_read_flt(argv[1], &nx, &ny, &nc);
+    /* the values are the same as in memory */
+    if (0 != memcmp(img, tmp, nx * ny * nc * sizeof(float))) {
+        fprintf(stderr, "mapped and in-memory images differ\n");
+        return EXIT_FAILURE;
+    }
+    free(tmp);
+    io_png_munmap_flt(img, nx, ny, nc);
+
     /*
      * instead of floats, you can also read and write the image as an
      * unsigned char or unsigned short array, with a similar syntax.
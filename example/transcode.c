@@ -0,0 +1,91 @@
+/*
+ * Copyright 2026 the io_png contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file transcode.c
+ * @brief re-compress a PNG image without changing its pixels
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io_png.h"
+
+#define VERSION "0.20261018"
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    io_png_opt_t opt;
+    int i;
+
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == strcmp("-v", argv[1])) {
+        fprintf(stdout, "%s version " VERSION
+                ", compiled " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+    /* wrong number of parameters : simple help info */
+    if (3 > argc) {
+        fprintf(stderr, "usage  : %s [options] in.png out.png\n", argv[0]);
+        fprintf(stderr, "         -i   : Adam7 interlacing\n");
+        fprintf(stderr, "         -z0  : minimum compression\n");
+        fprintf(stderr, "         -z9  : maximum compression\n");
+        fprintf(stderr, "         -x   : IDAT index, parallel decoding\n");
+        fprintf(stderr, "         -f   : fast encoder\n");
+        fprintf(stderr, "         -a   : archive encoder, smallest\n");
+        fprintf(stderr, "         -p   : automatic settings, with -z0 "
+                "fastest, -z9 smallest\n");
+        fprintf(stderr, "         -d   : deadline encoder, within "
+                "$IO_PNG_DEADLINE seconds\n");
+        fprintf(stderr, "result : in -> out, same pixels\n");
+        return EXIT_FAILURE;
+    }
+
+    /* collect the options */
+    opt = IO_PNG_OPT_NONE;
+    for (i = 1; i < argc - 2; i++) {
+        if (0 == strcmp("-i", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_ADAM7);
+        else if (0 == strcmp("-z0", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_ZMIN);
+        else if (0 == strcmp("-z9", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_ZMAX);
+        else if (0 == strcmp("-x", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_INDEX);
+        else if (0 == strcmp("-f", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_FAST);
+        else if (0 == strcmp("-a", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_ARCHIVE);
+        else if (0 == strcmp("-p", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_AUTO);
+        else if (0 == strcmp("-d", argv[i]))
+            opt = (io_png_opt_t) (opt | IO_PNG_OPT_DEADLINE);
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* re-encode the PNG image */
+    io_png_transcode(argv[argc - 2], argv[argc - 1], opt);
+
+    return EXIT_SUCCESS;
+}
@@ -24,28 +24,61 @@
  * Multi-channel images are handled: gray, gray+alpha, rgb and
  * rgb+alpha, as well as on-the-fly rgb/gray conversion.
  *
+ * With the -DIO_PNG_TIMING compiler option, the time spent in every
+ * stage of the read and write functions is measured, see
+ * io_png_timing().
+ *
  * @todo add type width assertions
  * @todo handle 16bit data
  * @todo replace rgb/gray with sRGB / Y references
  * @todo implement sRGB gamma and better RGBY conversion
  * @todo process the data as float before quantization
- * @todo pre/post-processing timing
  *
  * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
  */
 
+/* unified POSIX detection, for the memory-mapped files and the clock */
+#if (defined(__unix__) || defined(__unix)                       \
+     || (defined(__APPLE__) && defined(__MACH__)))
+#define _IO_PNG_POSIX
+/* mkstemp(), ftruncate(), clock_gettime() and large files */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#ifndef IO_PNG_NO_MMAP
+#define _IO_PNG_MMAP
+#endif
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <limits.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 /* option to use a local version of the libpng */
 #ifdef IO_PNG_LOCAL_LIBPNG
 #include "png.h"
+#include "zlib.h"
 #else
 #include <png.h>
+#include <zlib.h>
+#endif
+
+/*
+ * GCC on x86_64, for the CPU dispatch of the conversion kernels:
+ * target() function attributes and __builtin_cpu_supports()
+ */
+#if (!defined(IO_PNG_NO_DISPATCH)                               \
+     && defined(__GNUC__) && (5 <= __GNUC__)                    \
+     && !defined(__clang__) && !defined(__INTEL_COMPILER)       \
+     && !defined(__TINYC__) && defined(__x86_64__))
+#define _IO_PNG_DISPATCH
 #endif
 
 /* unified Windows detection */
@@ -63,9 +96,70 @@
 #include <fcntl.h>
 #endif
 
+#ifdef _IO_PNG_MMAP
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* lock of the memory counters, without OpenMP */
+#if (defined(IO_PNG_MEMSTAT) && defined(_IO_PNG_POSIX)  \
+     && !defined(_OPENMP))
+#define _IO_PNG_MEM_MUTEX
+#endif
+
+/* POSIX locks, memory counters and kernel selection */
+#ifdef _IO_PNG_POSIX
+#include <pthread.h>
+#endif
+
 /* ensure consistency */
 #include "io_png.h"
 
+/*
+ * built-in decoder for 8bit non-interlaced images without palette,
+ * disabled with IO_PNG_NO_FAST_READ to always use libpng
+ */
+#ifdef IO_PNG_NO_FAST_READ
+#define _IO_PNG_FAST_READ 0
+#else
+#define _IO_PNG_FAST_READ 1
+#endif
+
+/*
+ * size limit (in bytes) of the png_byte buffers allocated on the
+ * stack; small images are written and image rows are read without
+ * heap allocation when they fit in this size
+ */
+#ifndef IO_PNG_SMALL_SIZE
+#define IO_PNG_SMALL_SIZE 16384
+#endif
+
+/*
+ * wall clock time budget of the archive encoder, in seconds per
+ * megabyte of image data, shared by the threads; the CPU time of the
+ * worker threads cannot be measured from a single start time
+ */
+#ifndef IO_PNG_ARCHIVE_BUDGET
+#define IO_PNG_ARCHIVE_BUDGET 10
+#endif
+
+/*
+ * encoding CPU time budget of the automatic mode, in seconds per
+ * megabyte of image data
+ */
+#ifndef IO_PNG_AUTO_BUDGET
+#define IO_PNG_AUTO_BUDGET 0.1
+#endif
+
+/*
+ * wall clock time budget of the deadline encoder, in seconds, unless
+ * set by the IO_PNG_DEADLINE environment variable
+ */
+#ifndef IO_PNG_DEADLINE
+#define IO_PNG_DEADLINE 1.0
+#endif
+
 /*
  * INFO
  */
@@ -89,591 +183,4512 @@ char *io_png_info(void)
     abort();                                                    \
     } while (0);
 
-/** @brief safe malloc wrapper */
-static void *_io_png_safe_malloc(size_t size)
+/**
+ * @brief current allocator, NULL for malloc()
+ *
+ * The allocator is set per thread when the compiler can. With OpenMP,
+ * it is copied to the worker threads of the parallel loops.
+ */
+#if defined(_OPENMP)
+static const io_png_alloc_t *_io_png_cur_alloc = NULL;
+#pragma omp threadprivate(_io_png_cur_alloc)
+#elif defined(__GNUC__)
+static __thread const io_png_alloc_t *_io_png_cur_alloc = NULL;
+#else
+static const io_png_alloc_t *_io_png_cur_alloc = NULL;
+#endif
+
+/** @brief malloc wrapper, with the current allocator */
+static void *_io_png_raw_malloc(size_t size)
 {
     void *memptr;
 
-    if (NULL == (memptr = malloc(size)))
+    if (NULL != _io_png_cur_alloc)
+        memptr = _io_png_cur_alloc->alloc_fn(_io_png_cur_alloc->ctx, size);
+    else
+        memptr = malloc(size);
+    if (NULL == memptr)
         _IO_PNG_ABORT("not enough memory");
     return memptr;
 }
 
-/** @brief safe malloc wrapper macro with safe casting */
-#define _IO_PNG_SAFE_MALLOC(NB, TYPE)                                   \
-    ((TYPE *) _io_png_safe_malloc((size_t) (NB) * sizeof(TYPE)))
-
-/** @brief safe realloc wrapper */
-static void *_io_png_safe_realloc(void *memptr, size_t size)
+/** @brief realloc wrapper, with the current allocator */
+static void *_io_png_raw_realloc(void *memptr, size_t size)
 {
     void *newptr;
 
-    if (NULL == (newptr = realloc(memptr, size)))
+    if (NULL != _io_png_cur_alloc)
+        newptr = _io_png_cur_alloc->realloc_fn(_io_png_cur_alloc->ctx,
+                                               memptr, size);
+    else
+        newptr = realloc(memptr, size);
+    if (NULL == newptr)
         _IO_PNG_ABORT("not enough memory");
     return newptr;
 }
 
-/** @brief safe realloc wrapper macro with safe casting */
-#define _IO_PNG_SAFE_REALLOC(PTR, NB, TYPE)                             \
-    ((TYPE *) _io_png_safe_realloc((void *) (PTR), (size_t) (NB) * sizeof(TYPE)))
+/** @brief free wrapper, with the current allocator */
+static void _io_png_raw_free(void *memptr)
+{
+    if (NULL == memptr)
+        return;
+    if (NULL != _io_png_cur_alloc)
+        _io_png_cur_alloc->free_fn(_io_png_cur_alloc->ctx, memptr);
+    else
+        free(memptr);
+    return;
+}
 
-/**
- * @brief local error structure
- * see http://www.libpng.org/pub/png/book/chapter14.htmlpointer
+/*
+ * With the -DIO_PNG_MEMSTAT compiler option, the allocations are
+ * counted for all the threads, and for the read and write calls of
+ * every thread. The internal blocks start with a header keeping
+ * their size, to count their release. The arrays returned by the
+ * read functions have no header, so they can still be released with
+ * free(), and they are no longer counted as live memory once the call
+ * returns. The counters of all the threads are updated in an OpenMP
+ * critical section, or with a POSIX mutex; without OpenMP on other
+ * systems, the counters are only valid with a single thread.
  */
-typedef struct _io_png_err_s {
-    jmp_buf jmpbuf;
-} _io_png_err_t;
+#ifdef IO_PNG_MEMSTAT
+
+/** @brief block header size, keeps the malloc() alignment */
+#define _IO_PNG_MEM_HEAD 16
+
+/** @brief counters of all the threads */
+static io_png_mem_t _io_png_mem_all;
+
+/** @brief POSIX lock of the counters of all the threads, without OpenMP */
+#ifdef _IO_PNG_MEM_MUTEX
+static pthread_mutex_t _io_png_mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define _IO_PNG_MEM_LOCK() (void) pthread_mutex_lock(&_io_png_mem_mutex)
+#define _IO_PNG_MEM_UNLOCK() (void) pthread_mutex_unlock(&_io_png_mem_mutex)
+#else
+#define _IO_PNG_MEM_LOCK() ((void) 0)
+#define _IO_PNG_MEM_UNLOCK() ((void) 0)
+#endif
+
+/** @brief memory state of a thread */
+typedef struct _io_png_mem_s {
+    int depth;                  /* nested counted calls */
+    io_png_mem_t cur;           /* current call */
+    io_png_mem_t last;          /* last call */
+} _io_png_mem_t;
 
 /**
- * @brief local error handler
- * see http://www.libpng.org/pub/png/book/chapter14.htmlpointer
+ * @brief memory state and counters of the current call, per thread
+ * like the allocator; the current call counters are copied to the
+ * worker threads of the parallel loops
  */
-static void _io_png_err_hdl(png_structp png_ptr, png_const_charp msg)
+#if defined(_OPENMP)
+static _io_png_mem_t _io_png_mem_thr;
+static io_png_mem_t *_io_png_mem_rec = NULL;
+#pragma omp threadprivate(_io_png_mem_thr, _io_png_mem_rec)
+#elif defined(__GNUC__)
+static __thread _io_png_mem_t _io_png_mem_thr;
+static __thread io_png_mem_t *_io_png_mem_rec = NULL;
+#else
+static _io_png_mem_t _io_png_mem_thr;
+static io_png_mem_t *_io_png_mem_rec = NULL;
+#endif
+
+/** @brief update counters with an allocation and a release */
+static void _io_png_mem_upd(io_png_mem_t * m, size_t add, size_t sub,
+                            int lib)
 {
-    _io_png_err_t *err_ptr;
+    if (0 < add) {
+        m->allocs += 1;
+        m->bytes += add;
+        if (lib) {
+            m->lib_allocs += 1;
+            m->lib_bytes += add;
+        }
+    }
+    m->live += add;
+    m->live -= (sub < m->live ? sub : m->live);
+    if (m->live > m->peak)
+        m->peak = m->live;
+    return;
+}
 
-    fprintf(stderr, "libpng error: %s\n", msg);
+/**
+ * @brief count an allocation and a release
+ *
+ * @param add, sub allocated and released bytes, can be 0
+ * @param lib 1 for libpng and zlib, 0 otherwise
+ */
+static void _io_png_mem_count(size_t add, size_t sub, int lib)
+{
+#ifdef _OPENMP
+#pragma omp critical (_io_png_mem)
+#endif
+    {
+        _IO_PNG_MEM_LOCK();
+        _io_png_mem_upd(&_io_png_mem_all, add, sub, lib);
+        if (NULL != _io_png_mem_rec)
+            _io_png_mem_upd(_io_png_mem_rec, add, sub, lib);
+        _IO_PNG_MEM_UNLOCK();
+    }
+    return;
+}
 
-    err_ptr = (_io_png_err_t *) png_get_error_ptr(png_ptr);
-    if (NULL == png_ptr)
-        _IO_PNG_ABORT
-            ("fatal unrecoverable error in libpng calls, terminating");
+/** @brief counted malloc, with a size header */
+static void *_io_png_mem_malloc(size_t size, int lib)
+{
+    char *base;
 
-    longjmp(err_ptr->jmpbuf, 1);
+    base = (char *) _io_png_raw_malloc(size + _IO_PNG_MEM_HEAD);
+    *(size_t *) base = size;
+    _io_png_mem_count(size, 0, lib);
+    return (void *) (base + _IO_PNG_MEM_HEAD);
 }
 
-/*
- * TYPE AND IMAGE FORMAT CONVERSION
- */
-
-typedef enum _io_png_inter_e {
-    INTERLACE,
-    DEINTERLACE
-} _io_png_inter_t;
+/** @brief start counting a read or write call */
+static void _io_png_mem_begin(void)
+{
+    if (0 != _io_png_mem_thr.depth++)
+        return;
+    memset(&_io_png_mem_thr.cur, 0, sizeof(io_png_mem_t));
+    _io_png_mem_rec = &_io_png_mem_thr.cur;
+    return;
+}
 
 /**
- * @brief (de)interlace a float array
+ * @brief end counting a read or write call, keep it as the last call
  *
- * @param data array to interlace
- * @param csize array size per channel
- * @param nc number of channels to interlace
- * @return new array
+ * @param out size of the returned array, given to the caller
  */
-static float *_io_png_inter(const float *data, size_t csize, size_t nc,
-                            _io_png_inter_t option)
+static void _io_png_mem_end(size_t out)
 {
-    size_t i, size;
-    float *tmp;
+    if (0 != --_io_png_mem_thr.depth)
+        return;
+    _io_png_mem_thr.last = _io_png_mem_thr.cur;
+    _io_png_mem_rec = NULL;
+    _io_png_mem_count(0, out, 0);
+    return;
+}
 
-    assert(NULL != data && 0 != csize && 0 != nc);
+#define _IO_PNG_MEM_BEGIN() _io_png_mem_begin()
+#define _IO_PNG_MEM_END(OUT) _io_png_mem_end(OUT)
+/** @brief OpenMP copyin clause, the allocator and the call counters */
+#define _IO_PNG_COPYIN copyin(_io_png_cur_alloc, _io_png_mem_rec)
 
-    if (1 == nc || 1 == csize) {
-        /* duplicate */
-        tmp = _IO_PNG_SAFE_MALLOC(csize * nc, float);
-        memcpy(tmp, data, csize * nc * sizeof(float));
-        return tmp;
-    }
+#else                           /* IO_PNG_MEMSTAT */
 
-    size = nc * csize;
-    tmp = _IO_PNG_SAFE_MALLOC(size, float);
+#define _IO_PNG_MEM_BEGIN() ((void) 0)
+#define _IO_PNG_MEM_END(OUT) ((void) 0)
+/** @brief OpenMP copyin clause, the allocator */
+#define _IO_PNG_COPYIN copyin(_io_png_cur_alloc)
 
-    switch (option) {
-    case INTERLACE:
-        for (i = 0; i < size; i++)
-            /*
-             * set the i-th element of tmp, interlaced
-             * its channel is i % nc
-             * its position in this channel is i / nc
-             */
-            tmp[i] = data[i % nc * csize + i / nc];
-        break;
-    case DEINTERLACE:
-        for (i = 0; i < size; i++)
-            /* reverse */
-            tmp[i % nc * csize + i / nc] = data[i];
-        break;
-    default:
-        _IO_PNG_ABORT("bad parameters");
-    }
+#endif                          /* IO_PNG_MEMSTAT */
 
-    return tmp;
+/** @brief safe malloc wrapper, with the current allocator */
+static void *_io_png_safe_malloc(size_t size)
+{
+#ifdef IO_PNG_MEMSTAT
+    return _io_png_mem_malloc(size, 0);
+#else
+    return _io_png_raw_malloc(size);
+#endif
 }
 
-/** type-generic any2flt array conversion code */
-#define _IO_PNG_ANY2FLT(MAX) do {                       \
-        size_t i;                                       \
-        float *flt_data;                                \
-        float max;                                      \
-        assert(NULL != data && 0 != size);              \
-        flt_data = _IO_PNG_SAFE_MALLOC(size, float);    \
-        max = (float) (MAX);                            \
-        for (i = 0; i < size; i++)                      \
-            flt_data[i] = (float) (data[i]) / max;      \
-        return flt_data;                                \
-    } while (0)
+/** @brief safe malloc wrapper macro with safe casting */
+#define _IO_PNG_SAFE_MALLOC(NB, TYPE)                                   \
+    ((TYPE *) _io_png_safe_malloc((size_t) (NB) * sizeof(TYPE)))
 
-/**
- * @brief convert png_byte array to float
- *
- * @param png_data array to convert
- * @param size array size
- * @return converted array
- *
- * @todo use lookup table instead of division?
- */
-static float *_io_png_byte2flt(const png_byte * data, size_t size)
+/** @brief safe realloc wrapper, with the current allocator */
+static void *_io_png_safe_realloc(void *memptr, size_t size)
 {
-    /* png_byte is 8bit data unsigned, [0..255] */
-    _IO_PNG_ANY2FLT(255);
+#ifdef IO_PNG_MEMSTAT
+    char *base;
+    size_t old;
+
+    if (NULL == memptr)
+        return _io_png_mem_malloc(size, 0);
+    base = (char *) memptr - _IO_PNG_MEM_HEAD;
+    old = *(size_t *) base;
+    base = (char *) _io_png_raw_realloc(base, size + _IO_PNG_MEM_HEAD);
+    *(size_t *) base = size;
+    _io_png_mem_count(size, old, 0);
+    return (void *) (base + _IO_PNG_MEM_HEAD);
+#else
+    return _io_png_raw_realloc(memptr, size);
+#endif
 }
 
-/**
- * @brief convert unsigned char array to float
- *
- * See _io_png_byte2flt()
- */
-static float *_io_png_uchar2flt(const unsigned char *data, size_t size)
+/** @brief safe realloc wrapper macro with safe casting */
+#define _IO_PNG_SAFE_REALLOC(PTR, NB, TYPE)                             \
+    ((TYPE *) _io_png_safe_realloc((void *) (PTR), (size_t) (NB) * sizeof(TYPE)))
+
+/** @brief free wrapper, with the current allocator */
+static void _io_png_free(void *memptr)
+{
+#ifdef IO_PNG_MEMSTAT
+    char *base;
+
+    if (NULL == memptr)
+        return;
+    base = (char *) memptr - _IO_PNG_MEM_HEAD;
+    _io_png_mem_count(0, *(size_t *) base, 0);
+    _io_png_raw_free(base);
+#else
+    _io_png_raw_free(memptr);
+#endif
+    return;
+}
+
+/** @brief libpng and zlib malloc wrapper, with the current allocator */
+static void *_io_png_lib_malloc(size_t size)
 {
-    _IO_PNG_ANY2FLT(UCHAR_MAX);
+#ifdef IO_PNG_MEMSTAT
+    return _io_png_mem_malloc(size, 1);
+#else
+    return _io_png_raw_malloc(size);
+#endif
 }
 
 /**
- * @brief convert unsigned short array to float
- *
- * See _io_png_byte2flt()
+ * @brief output array malloc wrapper, with the current allocator and
+ * without header, released with free() or io_png_free()
  */
-static float *_io_png_ushrt2flt(const unsigned short *data, size_t size)
+static void *_io_png_out_malloc(size_t size)
+{
+    void *memptr;
+
+    memptr = _io_png_raw_malloc(size);
+#ifdef IO_PNG_MEMSTAT
+    _io_png_mem_count(size, 0, 0);
+#endif
+    return memptr;
+}
+
+/** @brief zlib allocator, with the current allocator */
+static voidpf _io_png_zalloc(voidpf opaque, uInt items, uInt size)
 {
-    _IO_PNG_ANY2FLT(USHRT_MAX);
+    (void) opaque;
+    return (voidpf) _io_png_lib_malloc((size_t) items * size);
 }
 
-/** type-generic flt2any array conversion code */
-#define _IO_PNG_FLT2ANY(TYPE, MAX) do {                         \
-        size_t i;                                               \
-        TYPE *data;                                             \
-        float tmp, max;                                         \
-        assert(NULL != flt_data && 0 != size);                  \
-        data = _IO_PNG_SAFE_MALLOC(size, TYPE);                 \
-        max = (float) (MAX);                                    \
-        for (i = 0; i < size; i++) {                            \
-            tmp = flt_data[i] * max + .5;                       \
-            data[i] = (TYPE) (tmp < 0. ? 0.                     \
-                                  : (tmp > max ? max : tmp));   \
-        }                                                       \
-        return data;                                            \
-    } while (0)
+/** @brief zlib deallocator, with the current allocator */
+static void _io_png_zfree(voidpf opaque, voidpf address)
+{
+    (void) opaque;
+    _io_png_free((void *) address);
+}
+
+/** @brief initialize a zlib stream, with the current allocator */
+static void _io_png_zinit(z_stream * z)
+{
+    memset(z, 0, sizeof(z_stream));
+    z->zalloc = &_io_png_zalloc;
+    z->zfree = &_io_png_zfree;
+    z->opaque = Z_NULL;
+    return;
+}
 
 /**
- * @brief convert float array to png_byte
+ * @brief set the allocator of the calling thread
  *
- * @param flt_data array to convert
- * @param size array size
- * @return converted array
+ * All the memory allocated by io_png is then allocated by this
+ * allocator, including the output arrays of the read functions and
+ * the memory used by libpng and zlib, until the allocator is changed.
+ * The arrays must be released with the allocator used for their
+ * allocation, and io_png_free() releases them with the current one.
+ * With OpenMP, the allocator is also used by the worker threads and
+ * must be thread-safe.
  *
- * @todo bit twiddling instead of (?:) branching?
+ * @param alloc allocator, NULL for malloc(), realloc() and free(),
+ *        kept by io_png until replaced
+ * @return previous allocator
  */
-static png_byte *_io_png_flt2byte(const float *flt_data, size_t size)
+const io_png_alloc_t *io_png_set_alloc(const io_png_alloc_t * alloc)
 {
-    /* png_byte is 8bit data unsigned, [0..255] */
-    _IO_PNG_FLT2ANY(png_byte, 255);
+    const io_png_alloc_t *prev;
+
+    if (NULL != alloc && (NULL == alloc->alloc_fn
+                          || NULL == alloc->realloc_fn
+                          || NULL == alloc->free_fn))
+        _IO_PNG_ABORT("bad parameters");
+    prev = _io_png_cur_alloc;
+    _io_png_cur_alloc = alloc;
+    return prev;
 }
 
 /**
- * @brief convert float array to unsigned char
+ * @brief allocator of the calling thread
  *
- * See _io_png_flt2byte()
+ * @return current allocator, NULL for malloc(), realloc() and free()
  */
-static unsigned char *_io_png_flt2uchar(const float *flt_data, size_t size)
+const io_png_alloc_t *io_png_get_alloc(void)
 {
-    _IO_PNG_FLT2ANY(unsigned char, UCHAR_MAX);
+    return _io_png_cur_alloc;
 }
 
 /**
- * @brief convert float array to unsigned short
+ * @brief release an array allocated by io_png, with the current
+ * allocator
  *
- * See _io_png_flt2byte()
+ * @param data array to release, can be NULL
+ * @return void
  */
-static unsigned short *_io_png_flt2ushrt(const float *flt_data, size_t size)
+void io_png_free(void *data)
 {
-    _IO_PNG_FLT2ANY(unsigned short, USHRT_MAX);
+    _io_png_raw_free(data);
+    return;
 }
 
 /**
- * @brief convert float gray to rgb
+ * @brief memory counters
+ *
+ * The counters give the number of allocations and the allocated
+ * bytes, with the part of libpng and zlib, and the bytes currently
+ * allocated (live) with their maximum (peak). The live memory of a
+ * call includes the returned array; the live memory of all the
+ * threads does not include the arrays already returned.
  *
- * @param data array to convert
- * @param size array size
- * @return converted array (via realloc())
+ * @param last filled with the last read or write call of the calling
+ *        thread, can be NULL
+ * @param all filled with the counters of all the threads since the
+ *        last io_png_mem_reset(), can be NULL
+ * @return 1 if io_png was compiled with -DIO_PNG_MEMSTAT, 0 otherwise
+ *         and the structures are filled with zeros
  */
-static float *_io_png_gray2rgb(float *data, size_t size)
+int io_png_mem(io_png_mem_t * last, io_png_mem_t * all)
 {
-    assert(NULL != data && 0 != size);
-
-    data = _IO_PNG_SAFE_REALLOC(data, 3 * size, float);
-    memcpy(data + size, data, size * sizeof(float));
-    memcpy(data + 2 * size, data, size * sizeof(float));
-
-    return data;
+#ifdef IO_PNG_MEMSTAT
+    if (NULL != last)
+        *last = _io_png_mem_thr.last;
+    if (NULL != all) {
+#ifdef _OPENMP
+#pragma omp critical (_io_png_mem)
+#endif
+        {
+            _IO_PNG_MEM_LOCK();
+            *all = _io_png_mem_all;
+            _IO_PNG_MEM_UNLOCK();
+        }
+    }
+    return 1;
+#else
+    if (NULL != last)
+        memset(last, 0, sizeof(io_png_mem_t));
+    if (NULL != all)
+        memset(all, 0, sizeof(io_png_mem_t));
+    return 0;
+#endif
 }
 
 /**
- * @brief convert float rgb to gray
- *
- * Y = Cr* R + Cg * G + Cb * B
- * with
- * Cr = 0.212639005871510
- * Cg = 0.715168678767756
- * Cb = 0.072192315360734
- * derived from ITU BT.709-5 (Rec 709) sRGB and D65 definitions
- * http://www.itu.int/rec/R-REC-BT.709/en
+ * @brief reset the memory counters of all the threads, the live
+ * memory is kept and becomes the peak
  *
- * @param data array to convert
- * @param size array size
- * @return converted array (via realloc())
- *
- * @todo restrict keyword?
+ * @return void
  */
-static float *_io_png_rgb2gray(float *data, size_t size)
+void io_png_mem_reset(void)
 {
-    size_t i;
-    float *r, *g, *b;
+#ifdef IO_PNG_MEMSTAT
+#ifdef _OPENMP
+#pragma omp critical (_io_png_mem)
+#endif
+    {
+        _IO_PNG_MEM_LOCK();
+        _io_png_mem_all.allocs = 0;
+        _io_png_mem_all.bytes = 0;
+        _io_png_mem_all.lib_allocs = 0;
+        _io_png_mem_all.lib_bytes = 0;
+        _io_png_mem_all.peak = _io_png_mem_all.live;
+        _IO_PNG_MEM_UNLOCK();
+    }
+    memset(&_io_png_mem_thr.last, 0, sizeof(io_png_mem_t));
+#endif
+    return;
+}
 
-    assert(NULL != data && 0 != size);
+/** @brief CPU time used by the process, in seconds */
+static double _io_png_cpu(void)
+{
+    return (double) clock() / CLOCKS_PER_SEC;
+}
 
-    size /= 3;
-    r = data;
-    g = data + size;
-    b = data + 2 * size;
+/**
+ * @brief CPU time used by the calling thread, in seconds, or by the
+ * process without a per-thread clock
+ */
+static double _io_png_thread_cpu(void)
+{
+#if defined(_IO_PNG_POSIX) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
 
-    for (i = 0; i < size; i++)
-        data[i] = 0.212639005871510 * r[i]
-            + 0.715168678767756 * g[i]
-            + 0.072192315360734 * b[i];
+    if (0 == clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+#endif
+    return _io_png_cpu();
+}
 
-    data = _IO_PNG_SAFE_REALLOC(data, size, float);
+/** @brief wall clock time, in seconds */
+static double _io_png_wall(void)
+{
+#ifdef _IO_PNG_POSIX
+    struct timespec ts;
 
-    return data;
+    if (0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+        return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+#endif
+    /* CPU time, close enough for a single thread */
+    return _io_png_cpu();
 }
 
 /*
- * READ
+ * TIMING
  */
 
-#define PNG_SIG_LEN 4
-
-/**
- * @brief internal function used to read a PNG file into an array
- *
- * @param fname PNG file name, "-" means stdin
- * @param nxp, nyp, ncp pointers to variables to be filled
- *        with the number of columns, lines and channels of the image
- * @param opt post-processing option, can be IO_PNG_OPT_RGB or IO_PNG_OPT_GRAY,
- *         IO_PNG_OPT_NONE to do nothing
- * @return pointer to an array of float pixels, abort() on error
- *
- * @todo don't loose 16bit info
- * @todo use enums?
+/*
+ * With the -DIO_PNG_TIMING compiler option, the read and write
+ * functions measure the time spent in every stage with the wall
+ * clock. The time is charged to one stage at a time, the innermost
+ * one, so the stages add up to the call time; the file reads and
+ * writes are charged to the I/O stage, whatever the stage calling
+ * them. The other functions, and the OpenMP worker threads, are not
+ * timed.
  */
-static float *_io_png_read(const char *fname,
-                           size_t * nxp, size_t * nyp, size_t * ncp,
-                           io_png_opt_t opt)
-{
-    png_byte png_sig[PNG_SIG_LEN];
-    png_structp png_ptr;
-    png_infop info_ptr;
-    png_bytepp row_pointers;
-    size_t rowbytes;
-    png_byte *png_data;
-    float *data, *tmp;
-    int png_transform;
-    /* volatile: because of setjmp/longjmp */
-    FILE *volatile fp = NULL;
-    size_t nx, ny, nc;
-    size_t size;
-    size_t i;
-    /* local error structure */
-    _io_png_err_t err;
+#ifdef IO_PNG_TIMING
 
-    assert(NULL != fname && NULL != nxp && NULL != nyp && NULL != ncp);
+/** @brief timed stages */
+#define _IO_PNG_TM_OTHER 0
+#define _IO_PNG_TM_OPEN 1
+#define _IO_PNG_TM_IO 2
+#define _IO_PNG_TM_CODEC 3
+#define _IO_PNG_TM_CONVERT 4
+#define _IO_PNG_TM_CLOSE 5
+#define _IO_PNG_TM_NB 6
+/** @brief maximum stage nesting */
+#define _IO_PNG_TM_DEPTH 8
 
-    /* open the PNG input file */
-    if (0 == strcmp(fname, "-")) {
-        fp = stdin;
-#ifdef WIN32                    /* set the stream to binary mode */
-        fflush(fp);
-        setmode(fileno(fp), O_BINARY);
+/** @brief timing state of a thread */
+typedef struct _io_png_tm_s {
+    int depth;                  /* nested timed calls */
+    int top;                    /* stage stack size */
+    int stack[_IO_PNG_TM_DEPTH];        /* stage stack, current on top */
+    double t0, mark;            /* call start and last stage change */
+    double cur[_IO_PNG_TM_NB];  /* time by stage, current call */
+    io_png_timing_t last;       /* last call */
+    io_png_timing_t sum[2];     /* read and write calls */
+} _io_png_tm_t;
+
+/** @brief timing state, per thread like the allocator */
+#if defined(_OPENMP)
+static _io_png_tm_t _io_png_tm;
+#pragma omp threadprivate(_io_png_tm)
+#elif defined(__GNUC__)
+static __thread _io_png_tm_t _io_png_tm;
+#else
+static _io_png_tm_t _io_png_tm;
 #endif
-    }
-    else {
-        if (NULL == (fp = fopen(fname, "rb")))
-            _IO_PNG_ABORT("failed to open file");
-    }
 
-    /* read in some of the signature bytes and check this signature */
-    if ((PNG_SIG_LEN != fread(png_sig, 1, PNG_SIG_LEN, fp))
-        || 0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN))
-        _IO_PNG_ABORT("the file is not a PNG image");
+/** @brief charge the time since the last change to the current stage */
+static void _io_png_tm_charge(_io_png_tm_t * tm, double now)
+{
+    tm->cur[tm->stack[tm->top - 1]] += now - tm->mark;
+    tm->mark = now;
+    return;
+}
 
-    /*
-     * create and initialize the png_struct and png_info structures
-     * with local error handling
-     */
-    if (NULL == (png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-                                                  &err, &_io_png_err_hdl,
-                                                  NULL)))
-        _IO_PNG_ABORT("libpng initialization error");
-    if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
-        _IO_PNG_ABORT("libpng initialization error");
+/** @brief start timing a read or write call */
+static void _io_png_tm_begin(void)
+{
+    _io_png_tm_t *tm = &_io_png_tm;
+    int s;
 
-    /* if we get here, we had a problem reading from the file */
-    if (setjmp(err.jmpbuf))
-        _IO_PNG_ABORT("libpng reading error");
+    if (0 != tm->depth++)
+        return;
+    for (s = 0; s < _IO_PNG_TM_NB; s++)
+        tm->cur[s] = 0.;
+    tm->top = 1;
+    tm->stack[0] = _IO_PNG_TM_OTHER;
+    tm->t0 = _io_png_wall();
+    tm->mark = tm->t0;
+    return;
+}
 
-    /* set up the input control using standard C streams */
-    png_init_io(png_ptr, fp);
+/** @brief enter a stage, nested in the current one */
+static void _io_png_tm_enter(int stage)
+{
+    _io_png_tm_t *tm = &_io_png_tm;
+
+    if (0 == tm->depth)
+        return;
+    assert(_IO_PNG_TM_DEPTH > tm->top);
+    _io_png_tm_charge(tm, _io_png_wall());
+    tm->stack[tm->top++] = stage;
+    return;
+}
+
+/** @brief replace the current stage, with a single clock read */
+static void _io_png_tm_switch(int stage)
+{
+    _io_png_tm_t *tm = &_io_png_tm;
+
+    if (0 == tm->depth)
+        return;
+    _io_png_tm_charge(tm, _io_png_wall());
+    tm->stack[tm->top - 1] = stage;
+    return;
+}
+
+/** @brief leave the current stage */
+static void _io_png_tm_leave(void)
+{
+    _io_png_tm_t *tm = &_io_png_tm;
+
+    if (0 == tm->depth)
+        return;
+    assert(1 < tm->top);
+    _io_png_tm_charge(tm, _io_png_wall());
+    tm->top -= 1;
+    return;
+}
+
+/** @brief add the stage times of the current call to a record */
+static void _io_png_tm_add(io_png_timing_t * t, const _io_png_tm_t * tm)
+{
+    t->open += tm->cur[_IO_PNG_TM_OPEN];
+    t->io += tm->cur[_IO_PNG_TM_IO];
+    t->codec += tm->cur[_IO_PNG_TM_CODEC];
+    t->convert += tm->cur[_IO_PNG_TM_CONVERT];
+    t->close += tm->cur[_IO_PNG_TM_CLOSE];
+    t->other += tm->cur[_IO_PNG_TM_OTHER];
+    t->total += tm->mark - tm->t0;
+    t->calls += 1;
+    return;
+}
+
+/**
+ * @brief end timing a read or write call, keep it as the last call
+ * and add it to the thread sums
+ *
+ * @param wr 0 for a read call, 1 for a write call
+ */
+static void _io_png_tm_end(int wr)
+{
+    _io_png_tm_t *tm = &_io_png_tm;
+
+    if (0 != --tm->depth)
+        return;
+    assert(1 == tm->top);
+    _io_png_tm_charge(tm, _io_png_wall());
+    memset(&tm->last, 0, sizeof(io_png_timing_t));
+    _io_png_tm_add(&tm->last, tm);
+    _io_png_tm_add(&tm->sum[wr], tm);
+    return;
+}
+
+#define _IO_PNG_TM_BEGIN() _io_png_tm_begin()
+#define _IO_PNG_TM_ENTER(STAGE) _io_png_tm_enter(STAGE)
+#define _IO_PNG_TM_SWITCH(STAGE) _io_png_tm_switch(STAGE)
+#define _IO_PNG_TM_LEAVE() _io_png_tm_leave()
+#define _IO_PNG_TM_END(WR) _io_png_tm_end(WR)
+
+#else                           /* IO_PNG_TIMING */
+
+#define _IO_PNG_TM_BEGIN() ((void) 0)
+#define _IO_PNG_TM_ENTER(STAGE) ((void) 0)
+#define _IO_PNG_TM_SWITCH(STAGE) ((void) 0)
+#define _IO_PNG_TM_LEAVE() ((void) 0)
+#define _IO_PNG_TM_END(WR) ((void) 0)
+
+#endif                          /* IO_PNG_TIMING */
+
+/**
+ * @brief per-stage timing of the read and write functions of the
+ * calling thread
+ *
+ * The times are in seconds, for the stages: file opening and header
+ * (open), file reads and writes (io), decoding or encoding of the
+ * PNG rows (codec), conversions between the PNG rows and the arrays
+ * (convert), end of file and cleanup (close), and the rest, mostly
+ * the allocation of the arrays (other). The total is the sum of the
+ * stages.
+ *
+ * @param last filled with the last read or write call, can be NULL
+ * @param rd, wr filled with the sums of the read and write calls
+ *        since the last io_png_timing_reset(), can be NULL
+ * @return 1 if io_png was compiled with -DIO_PNG_TIMING, 0 otherwise
+ *         and the structures are filled with zeros
+ */
+int io_png_timing(io_png_timing_t * last,
+                  io_png_timing_t * rd, io_png_timing_t * wr)
+{
+#ifdef IO_PNG_TIMING
+    if (NULL != last)
+        *last = _io_png_tm.last;
+    if (NULL != rd)
+        *rd = _io_png_tm.sum[0];
+    if (NULL != wr)
+        *wr = _io_png_tm.sum[1];
+    return 1;
+#else
+    if (NULL != last)
+        memset(last, 0, sizeof(io_png_timing_t));
+    if (NULL != rd)
+        memset(rd, 0, sizeof(io_png_timing_t));
+    if (NULL != wr)
+        memset(wr, 0, sizeof(io_png_timing_t));
+    return 0;
+#endif
+}
+
+/**
+ * @brief reset the per-stage timing sums of the calling thread
+ *
+ * @return void
+ */
+void io_png_timing_reset(void)
+{
+#ifdef IO_PNG_TIMING
+    memset(&_io_png_tm.last, 0, sizeof(io_png_timing_t));
+    memset(_io_png_tm.sum, 0, 2 * sizeof(io_png_timing_t));
+#endif
+    return;
+}
+
+/**
+ * @brief open a file, "-" means stdin or stdout
+ *
+ * @param fname file name
+ * @param mode "rb" to read, "wb" to write
+ * @return file stream, abort() on error
+ */
+static FILE *_io_png_fopen(const char *fname, const char *mode)
+{
+    FILE *fp;
+
+    if (0 == strcmp(fname, "-")) {
+        fp = ('r' == mode[0] ? stdin : stdout);
+#ifdef WIN32                    /* set the stream to binary mode */
+        fflush(fp);
+        setmode(fileno(fp), O_BINARY);
+#endif
+    }
+    else {
+        if (NULL == (fp = fopen(fname, mode)))
+            _IO_PNG_ABORT("failed to open file");
+    }
+    return fp;
+}
+
+/** @brief close a file opened with _io_png_fopen() */
+static void _io_png_fclose(FILE * fp)
+{
+    if (stdin != fp && stdout != fp)
+        (void) fclose(fp);
+    return;
+}
+
+/** @brief fread() wrapper, timed as I/O */
+static size_t _io_png_fread(void *ptr, size_t size, FILE * fp)
+{
+    size_t n;
+
+    _IO_PNG_TM_ENTER(_IO_PNG_TM_IO);
+    n = fread(ptr, 1, size, fp);
+    _IO_PNG_TM_LEAVE();
+    return n;
+}
+
+/**
+ * @brief local error structure
+ * see http://www.libpng.org/pub/png/book/chapter14.htmlpointer
+ */
+typedef struct _io_png_err_s {
+    jmp_buf jmpbuf;
+} _io_png_err_t;
+
+/**
+ * @brief local error handler
+ * see http://www.libpng.org/pub/png/book/chapter14.htmlpointer
+ */
+static void _io_png_err_hdl(png_structp png_ptr, png_const_charp msg)
+{
+    _io_png_err_t *err_ptr;
+
+    fprintf(stderr, "libpng error: %s\n", msg);
+
+    err_ptr = (_io_png_err_t *) png_get_error_ptr(png_ptr);
+    if (NULL == png_ptr)
+        _IO_PNG_ABORT
+            ("fatal unrecoverable error in libpng calls, terminating");
+
+    longjmp(err_ptr->jmpbuf, 1);
+}
+
+#ifdef PNG_USER_MEM_SUPPORTED
+#if PNG_LIBPNG_VER >= 10400
+typedef png_alloc_size_t _io_png_alloc_size_t;
+#else
+typedef png_size_t _io_png_alloc_size_t;
+#endif
+
+/** @brief libpng allocator, with the current allocator */
+static png_voidp _io_png_png_malloc(png_structp png_ptr,
+                                    _io_png_alloc_size_t size)
+{
+    (void) png_ptr;
+    return (png_voidp) _io_png_lib_malloc((size_t) size);
+}
+
+/** @brief libpng deallocator, with the current allocator */
+static void _io_png_png_free(png_structp png_ptr, png_voidp ptr)
+{
+    (void) png_ptr;
+    _io_png_free((void *) ptr);
+}
+#endif
+
+/**
+ * @brief create a libpng read structure, with local error handling
+ * and the current allocator
+ *
+ * @param err local error structure
+ * @return libpng read structure, NULL on error
+ */
+static png_structp _io_png_create_read(_io_png_err_t * err)
+{
+#ifdef PNG_USER_MEM_SUPPORTED
+    return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, err,
+                                    &_io_png_err_hdl, NULL, NULL,
+                                    &_io_png_png_malloc, &_io_png_png_free);
+#else
+    return png_create_read_struct(PNG_LIBPNG_VER_STRING, err,
+                                  &_io_png_err_hdl, NULL);
+#endif
+}
+
+/**
+ * @brief create a libpng write structure, with local error handling
+ * and the current allocator
+ *
+ * @param err local error structure
+ * @return libpng write structure, NULL on error
+ */
+static png_structp _io_png_create_write(_io_png_err_t * err)
+{
+#ifdef PNG_USER_MEM_SUPPORTED
+    return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, err,
+                                     &_io_png_err_hdl, NULL, NULL,
+                                     &_io_png_png_malloc,
+                                     &_io_png_png_free);
+#else
+    return png_create_write_struct(PNG_LIBPNG_VER_STRING, err,
+                                   &_io_png_err_hdl, NULL);
+#endif
+}
+
+#ifdef IO_PNG_TIMING
+/** @brief libpng read function, timed as I/O */
+static void _io_png_png_read(png_structp png_ptr, png_bytep data,
+                             png_size_t length)
+{
+    if ((size_t) length != _io_png_fread((void *) data, (size_t) length,
+                                         (FILE *) png_get_io_ptr(png_ptr)))
+        png_error(png_ptr, "Read Error");
+}
+
+/** @brief libpng write function, timed as I/O */
+static void _io_png_png_write(png_structp png_ptr, png_bytep data,
+                              png_size_t length)
+{
+    size_t n;
+
+    _IO_PNG_TM_ENTER(_IO_PNG_TM_IO);
+    n = fwrite((const void *) data, 1, (size_t) length,
+               (FILE *) png_get_io_ptr(png_ptr));
+    _IO_PNG_TM_LEAVE();
+    if ((size_t) length != n)
+        png_error(png_ptr, "Write Error");
+}
+
+/** @brief libpng flush function */
+static void _io_png_png_flush(png_structp png_ptr)
+{
+    (void) fflush((FILE *) png_get_io_ptr(png_ptr));
+}
+#endif
+
+/**
+ * @brief set up the libpng input or output control with standard C
+ * streams, timed as I/O with -DIO_PNG_TIMING
+ *
+ * @param png_ptr libpng read or write structure
+ * @param fp file stream
+ * @param wr 0 for the input, 1 for the output
+ */
+static void _io_png_init_io(png_structp png_ptr, FILE * fp, int wr)
+{
+#ifdef IO_PNG_TIMING
+    if (wr)
+        png_set_write_fn(png_ptr, (png_voidp) fp, &_io_png_png_write,
+                         &_io_png_png_flush);
+    else
+        png_set_read_fn(png_ptr, (png_voidp) fp, &_io_png_png_read);
+#else
+    (void) wr;
+    png_init_io(png_ptr, fp);
+#endif
+    return;
+}
+
+/*
+ * TYPE AND IMAGE FORMAT CONVERSION
+ */
+
+/*
+ * The conversions are done one row at a time, by kernels specialized
+ * for every data type, read option and number of channels, chosen
+ * once per image. The kernels are written once, as macros, and
+ * compiled for several instruction sets; the best one for the CPU is
+ * used, see _io_png_kern().
+ */
+
+/** @brief data types, as kernel table indexes */
+#define _IO_PNG_FLT 0
+#define _IO_PNG_UCHAR 1
+#define _IO_PNG_USHRT 2
+
+/** @brief size of the data types, by kernel table index */
+static const size_t _io_png_type_size[3] = {
+    sizeof(float), sizeof(unsigned char), sizeof(unsigned short)
+};
+
+/**
+ * type-generic float to integer value conversion, with rounding and
+ * clamping to [0,MAX]
+ *
+ * The computations stay in single precision: x + .5f gives exactly
+ * the same float as the former (float) (x + .5) in double precision,
+ * for every float x. The clamping is written in the a > b ? a : b
+ * and a < b ? a : b forms, compiled as branchless min/max
+ * instructions, NaN giving 0, and the clamped values are truncated
+ * with a float to int conversion, then narrowed; loops of this
+ * conversion are vectorized with saturating pack instructions.
+ */
+#define _IO_PNG_FLT2VAL(TYPE, MAX, OUT, IN) do {                \
+        float tmp;                                              \
+        tmp = (IN) * (float) (MAX) + .5f;                       \
+        tmp = (tmp > 0.f ? tmp : 0.f);                          \
+        tmp = (tmp < (float) (MAX) ? tmp : (float) (MAX));      \
+        (OUT) = (TYPE) (int) tmp;                               \
+    } while (0)
+
+/*
+ * png_byte to output value conversions, exactly the same as a
+ * conversion to float followed by _IO_PNG_FLT2VAL()
+ */
+/** png_byte to float, [0..255] to [0,1] */
+#define _IO_PNG_B2FLT(B) ((float) (B) / (float) 255)
+/** png_byte to unsigned char */
+#define _IO_PNG_B2UCHAR(B) ((unsigned char) (B))
+/** png_byte to unsigned short, [0..255] to [0..65535] */
+#define _IO_PNG_B2USHRT(B) ((unsigned short) (257 * (B)))
+
+/* float to output value conversions */
+/** float to float */
+#define _IO_PNG_F2FLT(OUT, IN) ((OUT) = (IN))
+/** float to unsigned char */
+#define _IO_PNG_F2UCHAR(OUT, IN)                                \
+    _IO_PNG_FLT2VAL(unsigned char, UCHAR_MAX, OUT, IN)
+/** float to unsigned short */
+#define _IO_PNG_F2USHRT(OUT, IN)                                \
+    _IO_PNG_FLT2VAL(unsigned short, USHRT_MAX, OUT, IN)
+
+/*
+ * input value to png_byte conversions, exactly the same as a
+ * conversion to float followed by _IO_PNG_FLT2VAL()
+ */
+/** float to png_byte */
+#define _IO_PNG_FLT2B(OUT, IN) _IO_PNG_FLT2VAL(png_byte, 255, OUT, IN)
+/** unsigned char to png_byte */
+#define _IO_PNG_UCHAR2B(OUT, IN) ((OUT) = (png_byte) (IN))
+/** unsigned short to png_byte, via float */
+#define _IO_PNG_USHRT2B(OUT, IN)                                \
+    _IO_PNG_FLT2B(OUT, (float) ((float) (IN) / (float) USHRT_MAX))
+
+/**
+ * read kernel body: split the first K channels of an interlaced row
+ * of S channels (RGBA RGBA RGBA) into K channels, csize values apart
+ */
+#define _IO_PNG_RD_SPLIT(TYPE, B2V, K, S) do {                  \
+        TYPE *data = (TYPE *) out;                              \
+        size_t i;                                               \
+        for (i = 0; i < nx; i++, row += (S)) {                  \
+            data[i] = B2V(row[0]);                              \
+            if (1 < (K))                                        \
+                data[i + csize] = B2V(row[1]);                  \
+            if (2 < (K))                                        \
+                data[i + 2 * csize] = B2V(row[2]);              \
+            if (3 < (K))                                        \
+                data[i + 3 * csize] = B2V(row[3]);              \
+        }                                                       \
+    } while (0)
+
+/**
+ * read kernel body: gray to rgb, from the first channel of an
+ * interlaced row of S channels
+ */
+#define _IO_PNG_RD_RGB(TYPE, B2V, S) do {                       \
+        TYPE *data = (TYPE *) out;                              \
+        size_t i;                                               \
+        for (i = 0; i < nx; i++, row += (S)) {                  \
+            data[i] = B2V(row[0]);                              \
+            data[i + csize] = data[i];                          \
+            data[i + 2 * csize] = data[i];                      \
+        }                                                       \
+    } while (0)
+
+/**
+ * read kernel body: rgb to gray, from the first 3 channels of an
+ * interlaced row of S channels
+ *
+ * Y = Cr* R + Cg * G + Cb * B
+ * with
+ * Cr = 0.212639005871510
+ * Cg = 0.715168678767756
+ * Cb = 0.072192315360734
+ * derived from ITU BT.709-5 (Rec 709) sRGB and D65 definitions
+ * http://www.itu.int/rec/R-REC-BT.709/en
+ *
+ * The row is converted by blocks of _IO_PNG_WR_BLOCK pixels, split in
+ * three float planes, and the luminance is computed in single
+ * precision on these planes so that it vectorizes at the full float
+ * width.
+ */
+#define _IO_PNG_RD_GRAY(TYPE, F2V, S) do {                      \
+        TYPE *data = (TYPE *) out;                              \
+        float blk[3][_IO_PNG_WR_BLOCK];                         \
+        size_t i, j, n;                                         \
+        float y;                                                \
+        (void) csize;           /* single output channel */     \
+        for (i = 0; i < nx; i += n) {                           \
+            n = (nx - i < _IO_PNG_WR_BLOCK                      \
+                 ? nx - i : _IO_PNG_WR_BLOCK);                  \
+            for (j = 0; j < n; j++, row += (S)) {               \
+                blk[0][j] = _IO_PNG_B2FLT(row[0]);              \
+                blk[1][j] = _IO_PNG_B2FLT(row[1]);              \
+                blk[2][j] = _IO_PNG_B2FLT(row[2]);              \
+            }                                                   \
+            for (j = 0; j < n; j++) {                           \
+                y = 0.212639005871510f * blk[0][j]              \
+                    + 0.715168678767756f * blk[1][j]            \
+                    + 0.072192315360734f * blk[2][j];           \
+                F2V(data[i + j], y);                            \
+            }                                                   \
+        }                                                       \
+    } while (0)
+
+/** @brief pixels per block in the write kernels */
+#define _IO_PNG_WR_BLOCK 256
+
+/**
+ * write kernel body: merge NC channels, csize values apart, into an
+ * interlaced row (RGBA RGBA RGBA)
+ *
+ * The values are converted by blocks, one channel at a time, into
+ * contiguous png_byte buffers, then interlaced; both loops are simple
+ * enough to be vectorized for any number of channels.
+ */
+#define _IO_PNG_WR_MERGE(TYPE, V2B, NC) do {                    \
+        const TYPE *data = (const TYPE *) in;                   \
+        png_byte blk[4][_IO_PNG_WR_BLOCK];                      \
+        size_t i, j, n, c;                                      \
+        for (i = 0; i < nx; i += n, data += n, row += (NC) * n) { \
+            n = (nx - i < _IO_PNG_WR_BLOCK ? nx - i             \
+                 : _IO_PNG_WR_BLOCK);                           \
+            if (1 == (NC)) {                                    \
+                for (j = 0; j < n; j++)                         \
+                    V2B(row[j], data[j]);                       \
+                continue;                                       \
+            }                                                   \
+            for (c = 0; c < (NC); c++)                          \
+                for (j = 0; j < n; j++)                         \
+                    V2B(blk[c][j], data[j + c * csize]);        \
+            for (j = 0; j < n; j++) {                           \
+                row[(NC) * j] = blk[0][j];                      \
+                if (1 < (NC))                                   \
+                    row[(NC) * j + 1] = blk[1][j];              \
+                if (2 < (NC))                                   \
+                    row[(NC) * j + 2] = blk[2][j];              \
+                if (3 < (NC))                                   \
+                    row[(NC) * j + 3] = blk[3][j];              \
+            }                                                   \
+        }                                                       \
+    } while (0)
+
+/*
+ * unfilter kernel bodies, for BPP bytes per pixel
+ *
+ * BPP is a constant, so the compiler knows the distance of the
+ * dependencies in Sub and Avg, and Up is vectorized. Paeth is
+ * computed one pixel at a time, without branches, the BPP bytes of a
+ * pixel together as a single vector. out can be the same as in.
+ */
+#define _IO_PNG_UNF_SUB(BPP) do {                               \
+        size_t i, k;                                            \
+        (void) prev;            /* no previous row */           \
+        for (k = 0; k < (BPP); k++)                             \
+            out[k] = in[k];                                     \
+        for (i = (BPP); i < rowbytes; i++)                      \
+            out[i] = (png_byte) (in[i] + out[i - (BPP)]);       \
+    } while (0)
+
+#define _IO_PNG_UNF_UP(BPP) do {                                \
+        size_t i;                                               \
+        for (i = 0; i < rowbytes; i++)                          \
+            out[i] = (png_byte) (in[i] + prev[i]);              \
+    } while (0)
+
+#define _IO_PNG_UNF_AVG(BPP) do {                               \
+        size_t i, k;                                            \
+        for (k = 0; k < (BPP); k++)                             \
+            out[k] = (png_byte) (in[k] + (prev[k] >> 1));       \
+        for (i = (BPP); i < rowbytes; i++)                      \
+            out[i] = (png_byte) (in[i] + ((out[i - (BPP)]       \
+                                           + prev[i]) >> 1));   \
+    } while (0)
+
+#define _IO_PNG_UNF_PAETH(BPP) do {                             \
+        size_t i, k;                                            \
+        int a, b, c, pa, pb, pc;                                \
+        for (k = 0; k < (BPP); k++)                             \
+            out[k] = (png_byte) (in[k] + prev[k]);              \
+        for (i = (BPP); i < rowbytes; i += (BPP))               \
+            for (k = 0; k < (BPP); k++) {                       \
+                a = out[i + k - (BPP)];                         \
+                b = prev[i + k];                                \
+                c = prev[i + k - (BPP)];                        \
+                pa = b - c;                                     \
+                pb = a - c;                                     \
+                pc = pa + pb;                                   \
+                pa = (pa < 0 ? -pa : pa);                       \
+                pb = (pb < 0 ? -pb : pb);                       \
+                pc = (pc < 0 ? -pc : pc);                       \
+                a = (pb < pa ? b : a);                          \
+                pa = (pb < pa ? pb : pa);                       \
+                a = (pc < pa ? c : a);                          \
+                out[i + k] = (png_byte) (in[i + k] + a);        \
+            }                                                   \
+    } while (0)
+
+/**
+ * @brief define an unfilter kernel, _io_png_unf_NAME_BPP_ISA()
+ *
+ * The kernel unfilters a row of rowbytes bytes, with the previous
+ * unfiltered row.
+ */
+#define _IO_PNG_UNF_KERNEL(ISA, NAME, BPP, BODY)                        \
+    _IO_PNG_ATTR_##ISA static void                                      \
+    _io_png_unf_##NAME##_##BPP##_##ISA(png_byte * out,                  \
+                                       const png_byte * in,             \
+                                       const png_byte * prev,           \
+                                       size_t rowbytes)                 \
+    {                                                                   \
+        BODY;                                                           \
+    }
+
+/** @brief define the unfilter kernels for a number of bytes per pixel */
+#define _IO_PNG_BPP_KERNELS(ISA, BPP)                                   \
+    _IO_PNG_UNF_KERNEL(ISA, sub, BPP, _IO_PNG_UNF_SUB(BPP))             \
+    _IO_PNG_UNF_KERNEL(ISA, up, BPP, _IO_PNG_UNF_UP(BPP))               \
+    _IO_PNG_UNF_KERNEL(ISA, avg, BPP, _IO_PNG_UNF_AVG(BPP))             \
+    _IO_PNG_UNF_KERNEL(ISA, paeth, BPP, _IO_PNG_UNF_PAETH(BPP))
+
+/**
+ * @brief define a read kernel, _io_png_rd_T_NAME_ISA()
+ *
+ * The kernel converts an interlaced png_byte row into the output
+ * array, at the row position in the first channel, with csize values
+ * per channel.
+ */
+#define _IO_PNG_RD_KERNEL(ISA, T, NAME, BODY)                           \
+    _IO_PNG_ATTR_##ISA static void                                      \
+    _io_png_rd_##T##_##NAME##_##ISA(void *out, const png_byte * row,    \
+                                    size_t nx, size_t csize)            \
+    {                                                                   \
+        BODY;                                                           \
+    }
+
+/**
+ * @brief define a write kernel, _io_png_wr_T_NC_ISA()
+ *
+ * The kernel converts the input array, at the row position in the
+ * first channel, with csize values per channel, into an interlaced
+ * png_byte row.
+ */
+#define _IO_PNG_WR_KERNEL(ISA, T, NC, BODY)                             \
+    _IO_PNG_ATTR_##ISA static void                                      \
+    _io_png_wr_##T##_##NC##_##ISA(png_byte * row, const void *in,       \
+                                  size_t nx, size_t csize)              \
+    {                                                                   \
+        BODY;                                                           \
+    }
+
+/** @brief define the read and write kernels for a data type */
+#define _IO_PNG_TYPE_KERNELS(ISA, T, TYPE, B2V, F2V, V2B)               \
+    _IO_PNG_RD_KERNEL(ISA, T, 11, _IO_PNG_RD_SPLIT(TYPE, B2V, 1, 1))    \
+    _IO_PNG_RD_KERNEL(ISA, T, 12, _IO_PNG_RD_SPLIT(TYPE, B2V, 1, 2))    \
+    _IO_PNG_RD_KERNEL(ISA, T, 22, _IO_PNG_RD_SPLIT(TYPE, B2V, 2, 2))    \
+    _IO_PNG_RD_KERNEL(ISA, T, 33, _IO_PNG_RD_SPLIT(TYPE, B2V, 3, 3))    \
+    _IO_PNG_RD_KERNEL(ISA, T, 34, _IO_PNG_RD_SPLIT(TYPE, B2V, 3, 4))    \
+    _IO_PNG_RD_KERNEL(ISA, T, 44, _IO_PNG_RD_SPLIT(TYPE, B2V, 4, 4))    \
+    _IO_PNG_RD_KERNEL(ISA, T, rgb1, _IO_PNG_RD_RGB(TYPE, B2V, 1))       \
+    _IO_PNG_RD_KERNEL(ISA, T, rgb2, _IO_PNG_RD_RGB(TYPE, B2V, 2))       \
+    _IO_PNG_RD_KERNEL(ISA, T, gray3, _IO_PNG_RD_GRAY(TYPE, F2V, 3))     \
+    _IO_PNG_RD_KERNEL(ISA, T, gray4, _IO_PNG_RD_GRAY(TYPE, F2V, 4))     \
+    _IO_PNG_WR_KERNEL(ISA, T, 1, _IO_PNG_WR_MERGE(TYPE, V2B, 1))        \
+    _IO_PNG_WR_KERNEL(ISA, T, 2, _IO_PNG_WR_MERGE(TYPE, V2B, 2))        \
+    _IO_PNG_WR_KERNEL(ISA, T, 3, _IO_PNG_WR_MERGE(TYPE, V2B, 3))        \
+    _IO_PNG_WR_KERNEL(ISA, T, 4, _IO_PNG_WR_MERGE(TYPE, V2B, 4))
+
+/**
+ * @brief instantiate the conversion kernels for an instruction set
+ *
+ * The kernels are named _io_png_xx_T_NAME_ISA or _io_png_unf_NAME_BPP_ISA,
+ * and declared with the
+ * _IO_PNG_ATTR_ISA function attributes.
+ */
+#define _IO_PNG_KERNELS(ISA)                                            \
+    _IO_PNG_TYPE_KERNELS(ISA, flt, float,                               \
+                         _IO_PNG_B2FLT, _IO_PNG_F2FLT, _IO_PNG_FLT2B)   \
+    _IO_PNG_TYPE_KERNELS(ISA, uchar, unsigned char,                     \
+                         _IO_PNG_B2UCHAR, _IO_PNG_F2UCHAR, _IO_PNG_UCHAR2B) \
+    _IO_PNG_TYPE_KERNELS(ISA, ushrt, unsigned short,                    \
+                         _IO_PNG_B2USHRT, _IO_PNG_F2USHRT, _IO_PNG_USHRT2B) \
+    _IO_PNG_BPP_KERNELS(ISA, 1) _IO_PNG_BPP_KERNELS(ISA, 2)             \
+    _IO_PNG_BPP_KERNELS(ISA, 3) _IO_PNG_BPP_KERNELS(ISA, 4)
+
+/** @brief generic kernels, for the compiler default target */
+#define _IO_PNG_ATTR_generic
+_IO_PNG_KERNELS(generic)
+
+#ifdef _IO_PNG_DISPATCH
+/**
+ * @brief function attributes for an instruction set
+ *
+ * The loops are vectorized, but the floating-point contractions (FMA)
+ * are disabled to keep exactly the same rounding as the generic code.
+ */
+#define _IO_PNG_TARGET(ISA)                                     \
+    __attribute__((target(ISA),                                 \
+                   optimize("tree-vectorize",                   \
+                            "vect-cost-model=dynamic",          \
+                            "fp-contract=off")))
+
+/** @brief SSE2 kernels, the x86_64 baseline, vectorized */
+#define _IO_PNG_ATTR_sse2 _IO_PNG_TARGET("sse2")
+_IO_PNG_KERNELS(sse2)
+/** @brief AVX2 kernels */
+#define _IO_PNG_ATTR_avx2 _IO_PNG_TARGET("avx2")
+_IO_PNG_KERNELS(avx2)
+/** @brief AVX-512 kernels */
+#define _IO_PNG_ATTR_avx512 _IO_PNG_TARGET("avx512f")
+_IO_PNG_KERNELS(avx512)
+#endif                          /* _IO_PNG_DISPATCH */
+
+/** @brief read kernel, see _IO_PNG_RD_KERNEL() */
+typedef void (*_io_png_rd_kern_t) (void *, const png_byte *, size_t, size_t);
+/** @brief write kernel, see _IO_PNG_WR_KERNEL() */
+typedef void (*_io_png_wr_kern_t) (png_byte *, const void *, size_t, size_t);
+/** @brief unfilter kernel, see _IO_PNG_UNF_KERNEL() */
+typedef void (*_io_png_unf_kern_t) (png_byte *, const png_byte *,
+                                    const png_byte *, size_t);
+
+/** @brief conversion kernels for an instruction set */
+typedef struct _io_png_kern_s {
+    const char *isa;            /* instruction set name */
+    /* by output type, read option (none, rgb, gray) and channels */
+    _io_png_rd_kern_t rd[3][3][4];
+    /* by input type and channels */
+    _io_png_wr_kern_t wr[3][4];
+    /* by filter type (sub, up, avg, paeth) and bytes per pixel */
+    _io_png_unf_kern_t unf[4][4];
+} _io_png_kern_t;
+
+/** read kernel table entries for a data type */
+#define _IO_PNG_RD_TAB(T, ISA) {                                        \
+        {&_io_png_rd_##T##_11_##ISA, &_io_png_rd_##T##_22_##ISA,        \
+         &_io_png_rd_##T##_33_##ISA, &_io_png_rd_##T##_44_##ISA},       \
+        {&_io_png_rd_##T##_rgb1_##ISA, &_io_png_rd_##T##_rgb2_##ISA,    \
+         &_io_png_rd_##T##_33_##ISA, &_io_png_rd_##T##_34_##ISA},       \
+        {&_io_png_rd_##T##_11_##ISA, &_io_png_rd_##T##_12_##ISA,        \
+         &_io_png_rd_##T##_gray3_##ISA, &_io_png_rd_##T##_gray4_##ISA}  \
+    }
+
+/** write kernel table entries for a data type */
+#define _IO_PNG_WR_TAB(T, ISA) {                                \
+        &_io_png_wr_##T##_1_##ISA, &_io_png_wr_##T##_2_##ISA,   \
+        &_io_png_wr_##T##_3_##ISA, &_io_png_wr_##T##_4_##ISA    \
+    }
+
+/** unfilter kernel table entries for a filter type */
+#define _IO_PNG_UNF_TAB(NAME, ISA) {                                    \
+        &_io_png_unf_##NAME##_1_##ISA, &_io_png_unf_##NAME##_2_##ISA,   \
+        &_io_png_unf_##NAME##_3_##ISA, &_io_png_unf_##NAME##_4_##ISA    \
+    }
+
+/** kernel table entry for an instruction set */
+#define _IO_PNG_KERN(ISA) {                                             \
+        #ISA,                                                           \
+        {_IO_PNG_RD_TAB(flt, ISA), _IO_PNG_RD_TAB(uchar, ISA),          \
+         _IO_PNG_RD_TAB(ushrt, ISA)},                                   \
+        {_IO_PNG_WR_TAB(flt, ISA), _IO_PNG_WR_TAB(uchar, ISA),          \
+         _IO_PNG_WR_TAB(ushrt, ISA)},                                   \
+        {_IO_PNG_UNF_TAB(sub, ISA), _IO_PNG_UNF_TAB(up, ISA),           \
+         _IO_PNG_UNF_TAB(avg, ISA), _IO_PNG_UNF_TAB(paeth, ISA)}        \
+    }
+
+/** @brief kernel table, by increasing instruction set level */
+static const _io_png_kern_t _io_png_kern_tab[] = {
+    _IO_PNG_KERN(generic)
+#ifdef _IO_PNG_DISPATCH
+        , _IO_PNG_KERN(sse2), _IO_PNG_KERN(avx2), _IO_PNG_KERN(avx512)
+#endif
+};
+
+/** @brief selected kernel table entry, see _io_png_kern() */
+static const _io_png_kern_t *_io_png_kern_sel = NULL;
+
+/**
+ * @brief select the conversion kernels
+ *
+ * The best instruction set supported by the CPU is used. The
+ * IO_PNG_ISA environment variable can force a lower level, for
+ * testing: "generic", "sse2", "avx2" or "avx512"; other values are
+ * ignored.
+ */
+static void _io_png_kern_init(void)
+{
+    const char *env;
+    size_t n, i;
+
+    /* levels supported by the CPU */
+    n = 1;
+#ifdef _IO_PNG_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        n = 2;
+    if (__builtin_cpu_supports("avx2"))
+        n = 3;
+    if (__builtin_cpu_supports("avx512f"))
+        n = 4;
+#endif
+    /* forced level */
+    if (NULL != (env = getenv("IO_PNG_ISA")))
+        for (i = 0; i < n; i++)
+            if (0 == strcmp(env, _io_png_kern_tab[i].isa)) {
+                n = i + 1;
+                break;
+            }
+    _io_png_kern_sel = _io_png_kern_tab + n - 1;
+    return;
+}
+
+#ifdef _IO_PNG_POSIX
+/** @brief once-only kernel selection, for all the threads */
+static pthread_once_t _io_png_kern_once = PTHREAD_ONCE_INIT;
+#endif
+
+/**
+ * @brief conversion kernels, selected once for all the threads
+ *
+ * The selection is guarded by pthread_once(), or by an OpenMP
+ * critical section without POSIX threads, for the worker threads of
+ * the parallel loops and the calling threads.
+ *
+ * @return kernel table entry
+ */
+static const _io_png_kern_t *_io_png_kern(void)
+{
+#if defined(_IO_PNG_POSIX)
+    (void) pthread_once(&_io_png_kern_once, &_io_png_kern_init);
+#elif defined(_OPENMP)
+#pragma omp critical (_io_png_kern)
+    {
+        if (NULL == _io_png_kern_sel)
+            _io_png_kern_init();
+    }
+#else
+    if (NULL == _io_png_kern_sel)
+        _io_png_kern_init();
+#endif
+    return _io_png_kern_sel;
+}
+
+/**
+ * @brief read option index in the kernel table
+ *
+ * @param opt read option, IO_PNG_OPT_NONE, IO_PNG_OPT_RGB or
+ *        IO_PNG_OPT_GRAY
+ * @return 0, 1 or 2, abort() on error
+ */
+static int _io_png_rd_opt(io_png_opt_t opt)
+{
+    switch (opt) {
+    case IO_PNG_OPT_NONE:
+        return 0;
+    case IO_PNG_OPT_RGB:
+        return 1;
+    case IO_PNG_OPT_GRAY:
+        return 2;
+    default:
+        _IO_PNG_ABORT("unsupported preprocessing option");
+    }
+    return -1;
+}
+
+/** @brief number of output channels, by read option and channels */
+static const size_t _io_png_rd_nc[3][4] = {
+    {1, 2, 3, 4}, {3, 3, 3, 3}, {1, 1, 1, 1}
+};
+
+/*
+ * ROW FILTERS
+ */
+
+/** @brief PNG filter types */
+#define _IO_PNG_FILTER_NONE 0
+#define _IO_PNG_FILTER_SUB 1
+#define _IO_PNG_FILTER_UP 2
+#define _IO_PNG_FILTER_AVG 3
+#define _IO_PNG_FILTER_PAETH 4
+
+/**
+ * @brief Paeth predictor
+ *
+ * See http://www.w3.org/TR/PNG/#9Filter-type-4-Paeth
+ */
+static int _io_png_paeth(int a, int b, int c)
+{
+    int pa, pb, pc;
+
+    pa = abs(b - c);
+    pb = abs(a - c);
+    pc = abs(a + b - 2 * c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+/**
+ * @brief filter a png_byte row
+ *
+ * @param out filtered row, rowbytes + 1 bytes, with the filter type first
+ * @param row row to filter
+ * @param prev previous row, filled with 0 for the first row
+ * @param rowbytes row size
+ * @param bpp bytes per pixel
+ * @param type filter type
+ */
+static void _io_png_filter(png_byte * out, const png_byte * row,
+                           const png_byte * prev, size_t rowbytes,
+                           size_t bpp, int type)
+{
+    size_t i;
+
+    out[0] = (png_byte) type;
+    out += 1;
+    switch (type) {
+    case _IO_PNG_FILTER_NONE:
+        memcpy(out, row, rowbytes);
+        break;
+    case _IO_PNG_FILTER_SUB:
+        for (i = 0; i < bpp; i++)
+            out[i] = row[i];
+        for (i = bpp; i < rowbytes; i++)
+            out[i] = (png_byte) (row[i] - row[i - bpp]);
+        break;
+    case _IO_PNG_FILTER_UP:
+        for (i = 0; i < rowbytes; i++)
+            out[i] = (png_byte) (row[i] - prev[i]);
+        break;
+    case _IO_PNG_FILTER_AVG:
+        for (i = 0; i < bpp; i++)
+            out[i] = (png_byte) (row[i] - (prev[i] >> 1));
+        for (i = bpp; i < rowbytes; i++)
+            out[i] = (png_byte) (row[i] - ((row[i - bpp] + prev[i]) >> 1));
+        break;
+    case _IO_PNG_FILTER_PAETH:
+        for (i = 0; i < bpp; i++)
+            out[i] = (png_byte) (row[i] - prev[i]);
+        for (i = bpp; i < rowbytes; i++)
+            out[i] = (png_byte) (row[i]
+                                 - _io_png_paeth(row[i - bpp], prev[i],
+                                                 prev[i - bpp]));
+        break;
+    default:
+        _IO_PNG_ABORT("bad parameters");
+    }
+    return;
+}
+
+/**
+ * @brief filter a png_byte row with the best filter
+ *
+ * The filter is chosen among the first nfilter types with the minimum
+ * sum of absolute differences heuristic, like libpng.
+ *
+ * @param out filtered row, rowbytes + 1 bytes, with the filter type first
+ * @param tmp work space, rowbytes + 1 bytes
+ * @param row row to filter
+ * @param prev previous row, filled with 0 for the first row
+ * @param rowbytes row size
+ * @param bpp bytes per pixel
+ * @param nfilter number of filter types to try, from 1 to 5
+ */
+static void _io_png_filter_best(png_byte * out, png_byte * tmp,
+                                const png_byte * row, const png_byte * prev,
+                                size_t rowbytes, size_t bpp, int nfilter)
+{
+    size_t i, sum, best_sum;
+    int type;
+    png_byte *cur, *best;
+
+    /* filter in the free buffer, keep the best one */
+    best = NULL;
+    best_sum = 0;
+    cur = out;
+    for (type = _IO_PNG_FILTER_NONE; type < nfilter; type++) {
+        _io_png_filter(cur, row, prev, rowbytes, bpp, type);
+        /* the filtered bytes are seen as signed values */
+        sum = 0;
+        for (i = 1; i <= rowbytes; i++)
+            sum += (cur[i] < 128 ? cur[i] : 256 - cur[i]);
+        if (NULL == best || sum < best_sum) {
+            best_sum = sum;
+            best = cur;
+            cur = (out == best ? tmp : out);
+        }
+    }
+    if (out != best)
+        memcpy(out, best, rowbytes + 1);
+    return;
+}
+
+/**
+ * @brief unfilter a png_byte row
+ *
+ * The row is unfiltered by the kernels of the selected instruction
+ * set.
+ *
+ * @param out unfiltered row, can be the same as in
+ * @param in filtered row, without the filter type
+ * @param prev previous unfiltered row, filled with 0 for the first row
+ * @param rowbytes row size
+ * @param bpp bytes per pixel, from 1 to 4
+ * @param type filter type
+ * @return void, abort() on unknown filter type
+ */
+static void _io_png_unfilter(png_byte * out, const png_byte * in,
+                             const png_byte * prev, size_t rowbytes,
+                             size_t bpp, int type)
+{
+    assert(1 <= bpp && 4 >= bpp);
+
+    if (_IO_PNG_FILTER_NONE == type) {
+        if (out != in)
+            memcpy(out, in, rowbytes);
+        return;
+    }
+    if (_IO_PNG_FILTER_PAETH < type)
+        _IO_PNG_ABORT("corrupted PNG file");
+    _io_png_kern()->unf[type - 1][bpp - 1] (out, in, prev, rowbytes);
+    return;
+}
+
+/*
+ * IDAT INDEX
+ */
+
+/*
+ * The IDAT index makes a PNG file decodable in parallel. The zlib
+ * stream is split in segments, one per band of rows; each segment
+ * starts after a full flush, so it can be inflated alone, and the
+ * first row of a band is filtered without the previous row. The
+ * private ancillary "ioIX" chunk, before the IDAT chunks, holds the
+ * number of segments then, for each one, its first row and its
+ * offset in the zlib stream, as PNG 4-byte unsigned integers. Other
+ * decoders ignore this chunk and read a standard PNG file.
+ */
+
+/** @brief IDAT index chunk name */
+#define _IO_PNG_IDX_NAME "ioIX"
+/** @brief filtered data size of the IDAT index segments */
+#define _IO_PNG_IDX_BAND (256 * 1024)
+/** @brief maximum IDAT chunk size */
+#define _IO_PNG_IDAT_SIZE (64 * 1024)
+
+/**
+ * @brief inflate a raw deflate stream, with any size
+ *
+ * @param z initialized zlib stream
+ * @param out output buffer, completely filled
+ * @param size output size
+ * @param in input data
+ * @param len input size
+ * @return 0, or -1 if the stream is invalid or too short
+ */
+static int _io_png_inflate(z_stream * z, png_byte * out, size_t size,
+                           const png_byte * in, size_t len)
+{
+    uInt chunk;
+    int ret;
+
+    /* zlib counts in uInt, feed it by pieces */
+    chunk = (uInt) 1 << 30;
+    z->next_out = out;
+    z->avail_out = 0;
+    z->next_in = (Bytef *) in;
+    z->avail_in = 0;
+    ret = Z_OK;
+    while (Z_OK == ret && (0 != size || 0 != z->avail_out)) {
+        if (0 == z->avail_out) {
+            z->avail_out = (size < chunk ? (uInt) size : chunk);
+            size -= z->avail_out;
+        }
+        if (0 == z->avail_in) {
+            z->avail_in = (len < chunk ? (uInt) len : chunk);
+            len -= z->avail_in;
+        }
+        ret = inflate(z, Z_SYNC_FLUSH);
+    }
+    if ((Z_OK != ret && Z_STREAM_END != ret)
+        || 0 != size || 0 != z->avail_out)
+        return -1;
+    return 0;
+}
+
+/** @brief adler32 checksum of a buffer, with any size */
+static uLong _io_png_adler32(uLong adler, const png_byte * data, size_t size)
+{
+    uInt chunk;
+
+    /* zlib counts in uInt, feed it by pieces */
+    chunk = (uInt) 1 << 30;
+    while (size > chunk) {
+        adler = adler32(adler, data, chunk);
+        data += chunk;
+        size -= chunk;
+    }
+    return adler32(adler, data, (uInt) size);
+}
+
+/**
+ * @brief inflate and unfilter an IDAT index segment
+ *
+ * If the first row needs the previous band, the filtered band is
+ * returned, to be unfiltered once the previous band is complete.
+ *
+ * @param png_data image array, receives the unfiltered rows
+ * @param zdata segment data
+ * @param zlen segment size
+ * @param y0, y1 first and next-to-last segment rows
+ * @param rowbytes row size
+ * @param bpp bytes per pixel
+ * @param zero row filled with 0
+ * @param adler adler32 checksum of the filtered band
+ * @param fail set to 1 if the segment does not inflate to valid rows,
+ * 0 otherwise
+ * @return filtered band, or NULL
+ */
+static png_byte *_io_png_idx_inflate(png_byte * png_data,
+                                     const png_byte * zdata, size_t zlen,
+                                     size_t y0, size_t y1, size_t rowbytes,
+                                     size_t bpp, const png_byte * zero,
+                                     uLong * adler, int *fail)
+{
+    z_stream z;
+    png_byte *band, *row;
+    size_t size, y;
+    int ret;
+
+    size = (y1 - y0) * (rowbytes + 1);
+    band = _IO_PNG_SAFE_MALLOC(size, png_byte);
+
+    _io_png_zinit(&z);
+    if (Z_OK != inflateInit2(&z, -15))
+        _IO_PNG_ABORT("zlib initialization error");
+    ret = _io_png_inflate(&z, band, size, zdata, zlen);
+    (void) inflateEnd(&z);
+    /* a wrong index gives invalid data or filter types */
+    for (y = y0; 0 == ret && y < y1; y++)
+        if (_IO_PNG_FILTER_PAETH < band[(y - y0) * (rowbytes + 1)])
+            ret = -1;
+    *fail = (0 != ret);
+    if (0 != ret) {
+        _io_png_free(band);
+        return NULL;
+    }
+    *adler = _io_png_adler32(adler32(0L, Z_NULL, 0), band, size);
+
+    /* Up, Avg and Paeth need the previous row */
+    if (0 != y0 && _IO_PNG_FILTER_SUB < band[0])
+        return band;
+
+    for (y = y0; y < y1; y++) {
+        row = band + (y - y0) * (rowbytes + 1);
+        _io_png_unfilter(png_data + y * rowbytes, row + 1,
+                         (0 == y ? zero : png_data + (y - 1) * rowbytes),
+                         rowbytes, bpp, row[0]);
+    }
+    _io_png_free(band);
+    return NULL;
+}
+
+/**
+ * @brief filter and deflate an IDAT index segment
+ *
+ * @param png_data image array
+ * @param y0, y1 first and next-to-last segment rows
+ * @param rowbytes row size
+ * @param bpp bytes per pixel
+ * @param zero row filled with 0
+ * @param level zlib compression level
+ * @param last last segment, ends the deflate stream
+ * @param zlen segment size
+ * @param adler adler32 checksum of the filtered band
+ * @return segment data
+ */
+static png_byte *_io_png_idx_deflate(const png_byte * png_data,
+                                     size_t y0, size_t y1, size_t rowbytes,
+                                     size_t bpp, const png_byte * zero,
+                                     int level, int last,
+                                     size_t * zlen, uLong * adler)
+{
+    z_stream z;
+    png_byte *band, *tmp, *zdata;
+    size_t size, bound, y;
+
+    /* filter, without the previous row for the first row */
+    size = (y1 - y0) * (rowbytes + 1);
+    band = _IO_PNG_SAFE_MALLOC(size, png_byte);
+    tmp = _IO_PNG_SAFE_MALLOC(rowbytes + 1, png_byte);
+    for (y = y0; y < y1; y++)
+        _io_png_filter_best(band + (y - y0) * (rowbytes + 1), tmp,
+                            png_data + y * rowbytes,
+                            (0 == y ? zero : png_data + (y - 1) * rowbytes),
+                            rowbytes, bpp,
+                            (y0 == y ? _IO_PNG_FILTER_UP
+                             : _IO_PNG_FILTER_PAETH + 1));
+    _io_png_free(tmp);
+    *adler = _io_png_adler32(adler32(0L, Z_NULL, 0), band, size);
+
+    /* raw deflate, ended by a full flush or the final block */
+    _io_png_zinit(&z);
+    if (Z_OK != deflateInit2(&z, level, Z_DEFLATED, -15, 8,
+                             Z_DEFAULT_STRATEGY))
+        _IO_PNG_ABORT("zlib initialization error");
+    bound = (size_t) deflateBound(&z, (uLong) size) + 16;
+    zdata = _IO_PNG_SAFE_MALLOC(bound, png_byte);
+    z.next_in = band;
+    z.avail_in = (uInt) size;
+    z.next_out = zdata;
+    z.avail_out = (uInt) bound;
+    if ((last ? Z_STREAM_END : Z_OK)
+        != deflate(&z, (last ? Z_FINISH : Z_FULL_FLUSH))
+        || 0 != z.avail_in || 0 == z.avail_out)
+        _IO_PNG_ABORT("zlib compression error");
+    *zlen = bound - z.avail_out;
+    (void) deflateEnd(&z);
+    _io_png_free(band);
+    return zdata;
+}
+
+/*
+ * READ
+ */
+
+#define PNG_SIG_LEN 4
+
+/**
+ * @brief PNG reader state
+ *
+ * The image is decoded as 8bit interlaced png_byte rows, whatever the
+ * file contains, and the rows are served one at a time. Files with an
+ * IDAT index are decoded at once, in parallel. The other 8bit
+ * non-interlaced files without palette are decoded row by row by the
+ * built-in decoder, without libpng after the header.
+ */
+typedef struct _io_png_rd_s {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    FILE *fp;
+    _io_png_err_t err;
+    size_t nx, ny, nc;          /* image size */
+    size_t rowbytes;            /* png_byte row size */
+    int interlace;              /* Adam7 or not */
+    size_t y;                   /* next row */
+    png_byte *idx;              /* IDAT index chunk data, or NULL */
+    size_t idx_size;            /* IDAT index chunk size */
+    int indexed;                /* decoded with the IDAT index */
+    int fast;                   /* decoded by the built-in decoder */
+    z_stream z;                 /* built-in decoder zlib stream */
+    png_byte *zin;              /* built-in decoder IDAT data buffer */
+    size_t zrest;               /* bytes left in the IDAT chunk */
+    uLong zcrc;                 /* CRC of the IDAT chunk */
+    png_byte head[8];           /* header of the current chunk */
+    png_byte *png_data;         /* row buffer, whole image for Adam7 */
+    png_byte png_row[IO_PNG_SMALL_SIZE];        /* for the small rows */
+} _io_png_rd_t;
+
+/**
+ * @brief libpng user chunk callback, to keep the IDAT index chunk
+ *
+ * @return 1 if the chunk was handled, 0 otherwise
+ */
+static int _io_png_rd_chunk(png_structp png_ptr, png_unknown_chunkp chunk)
+{
+    _io_png_rd_t *rd;
+
+    if (0 != memcmp(chunk->name, _IO_PNG_IDX_NAME, 4))
+        return 0;
+    rd = (_io_png_rd_t *) png_get_user_chunk_ptr(png_ptr);
+    if (NULL == rd->idx && 0 != chunk->size) {
+        rd->idx = _IO_PNG_SAFE_MALLOC(chunk->size, png_byte);
+        memcpy(rd->idx, chunk->data, chunk->size);
+        rd->idx_size = chunk->size;
+    }
+    return 1;
+}
+
+/**
+ * @brief skip the chunks after the image data, up to IEND
+ *
+ * @param fp PNG file, after a chunk header
+ * @param head this chunk header
+ * @return void, abort() on error
+ */
+static void _io_png_rd_iend(FILE * fp, const png_byte * head)
+{
+    png_byte next[8];
+
+    memcpy(next, head, 8);
+    while (0 != memcmp(next + 4, "IEND", 4))
+        if (0 != fseek(fp, (long) png_get_uint_32(next) + 4, SEEK_CUR)
+            || 8 != _io_png_fread(next, 8, fp))
+            _IO_PNG_ABORT("corrupted PNG file");
+    return;
+}
+
+/*
+ * The built-in decoder reads the IDAT chunks itself, inflates the
+ * zlib stream with zlib directly into a ring of two filtered rows
+ * and unfilters each row in place with the unfilter kernels. The
+ * header is parsed by libpng, which remains used for every other
+ * file.
+ */
+
+/**
+ * @brief start the built-in decoder
+ *
+ * @param rd reader state, with the file at the first IDAT chunk and
+ *        the two filtered rows allocated
+ * @return void, abort() on error
+ */
+static void _io_png_rd_fast_open(_io_png_rd_t * rd)
+{
+    /* the row before the first one is filled with 0 */
+    memset(rd->png_data, 0, 2 * (rd->rowbytes + 1));
+
+    rd->zin = _IO_PNG_SAFE_MALLOC(_IO_PNG_IDAT_SIZE, png_byte);
+    _io_png_zinit(&rd->z);
+    if (Z_OK != inflateInit(&rd->z))
+        _IO_PNG_ABORT("zlib initialization error");
+
+    /* first IDAT chunk */
+    if (8 != _io_png_fread(rd->head, 8, rd->fp)
+        || 0 != memcmp(rd->head + 4, "IDAT", 4))
+        _IO_PNG_ABORT("corrupted PNG file");
+    rd->zrest = (size_t) png_get_uint_32(rd->head);
+    rd->zcrc = crc32(0L, rd->head + 4, 4);
+    return;
+}
+
+/**
+ * @brief read the next IDAT data for the built-in decoder
+ *
+ * The CRC of every IDAT chunk is checked at its end. After the last
+ * IDAT chunk, the next chunk header is kept in the reader state.
+ *
+ * @param rd reader state
+ * @return 1 if some data was read, 0 after the last IDAT chunk
+ */
+static int _io_png_rd_fast_in(_io_png_rd_t * rd)
+{
+    png_byte crc[4];
+    size_t len;
+
+    while (0 == rd->zrest) {
+        if (0 != memcmp(rd->head + 4, "IDAT", 4))
+            return 0;
+        /* end of an IDAT chunk, check its CRC */
+        if (4 != _io_png_fread(crc, 4, rd->fp)
+            || png_get_uint_32(crc) != rd->zcrc
+            || 8 != _io_png_fread(rd->head, 8, rd->fp))
+            _IO_PNG_ABORT("corrupted PNG file");
+        rd->zcrc = crc32(0L, rd->head + 4, 4);
+        if (0 == memcmp(rd->head + 4, "IDAT", 4))
+            rd->zrest = (size_t) png_get_uint_32(rd->head);
+    }
+
+    len = (rd->zrest < _IO_PNG_IDAT_SIZE ? rd->zrest : _IO_PNG_IDAT_SIZE);
+    if (len != _io_png_fread(rd->zin, len, rd->fp))
+        _IO_PNG_ABORT("corrupted PNG file");
+    rd->zcrc = crc32(rd->zcrc, rd->zin, (uInt) len);
+    rd->zrest -= len;
+    rd->z.next_in = rd->zin;
+    rd->z.avail_in = (uInt) len;
+    return 1;
+}
+
+/**
+ * @brief decode the next row with the built-in decoder
+ *
+ * @param rd reader state
+ * @return interlaced png_byte row, valid until the next call
+ */
+static const png_byte *_io_png_rd_fast_row(_io_png_rd_t * rd)
+{
+    png_byte *row, *prev;
+    int ret;
+
+    row = rd->png_data + (rd->y % 2) * (rd->rowbytes + 1);
+    prev = rd->png_data + ((rd->y + 1) % 2) * (rd->rowbytes + 1);
+
+    /* inflate the filtered row, with its filter type */
+    rd->z.next_out = row;
+    rd->z.avail_out = (uInt) (rd->rowbytes + 1);
+    while (0 != rd->z.avail_out) {
+        if (0 == rd->z.avail_in && !_io_png_rd_fast_in(rd))
+            _IO_PNG_ABORT("corrupted PNG file");
+        ret = inflate(&rd->z, Z_SYNC_FLUSH);
+        if (Z_OK != ret && (Z_STREAM_END != ret || 0 != rd->z.avail_out))
+            _IO_PNG_ABORT("corrupted PNG file");
+    }
+
+    _io_png_unfilter(row + 1, row + 1, prev + 1, rd->rowbytes, rd->nc,
+                     row[0]);
+    rd->y += 1;
+    return row + 1;
+}
+
+/**
+ * @brief end the built-in decoder
+ *
+ * The end of the zlib stream is inflated, to check its checksum,
+ * and a stream cut before its end is an error, as with libpng. The
+ * file is read up to IEND. Like libpng, extra image data is
+ * ignored. After an early stop, the end of the file is not read.
+ *
+ * @param rd reader state
+ * @return void, abort() on error
+ */
+static void _io_png_rd_fast_close(_io_png_rd_t * rd)
+{
+    png_byte tail;
+    int ret;
+
+    if (rd->y == rd->ny) {
+        /* without input, inflate() fails unless the stream has ended */
+        ret = Z_OK;
+        while (Z_OK == ret) {
+            if (0 == rd->z.avail_in)
+                (void) _io_png_rd_fast_in(rd);
+            rd->z.next_out = &tail;
+            rd->z.avail_out = 1;
+            ret = inflate(&rd->z, Z_SYNC_FLUSH);
+        }
+        if (Z_STREAM_END != ret)
+            _IO_PNG_ABORT("corrupted PNG file");
+        while (_io_png_rd_fast_in(rd))
+            rd->z.avail_in = 0;
+        _io_png_rd_iend(rd->fp, rd->head);
+    }
+
+    (void) inflateEnd(&rd->z);
+    _io_png_free(rd->zin);
+    return;
+}
+
+/**
+ * @brief open a PNG file and read its header
+ *
+ * @param rd reader state to initialize
+ * @param fname PNG file name, "-" means stdin
+ * @return void, abort() on error
+ */
+static void _io_png_rd_open(_io_png_rd_t * rd, const char *fname)
+{
+    png_byte png_sig[PNG_SIG_LEN];
+    long pos;
+
+    assert(NULL != rd && NULL != fname);
+
+    /* open the PNG input file */
+    rd->fp = _io_png_fopen(fname, "rb");
+
+    /* read in some of the signature bytes and check this signature */
+    if ((PNG_SIG_LEN != _io_png_fread(png_sig, PNG_SIG_LEN, rd->fp))
+        || 0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN))
+        _IO_PNG_ABORT("the file is not a PNG image");
+
+    /*
+     * create and initialize the png_struct and png_info structures
+     * with local error handling and the current allocator
+     */
+    if (NULL == (rd->png_ptr = _io_png_create_read(&rd->err)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (rd->info_ptr = png_create_info_struct(rd->png_ptr)))
+        _IO_PNG_ABORT("libpng initialization error");
+
+    /* if we get here, we had a problem reading from the file */
+    if (setjmp(rd->err.jmpbuf))
+        _IO_PNG_ABORT("libpng reading error");
+
+    /* set up the input control using standard C streams */
+    _io_png_init_io(rd->png_ptr, rd->fp, 0);
 
     /* let libpng know that some bytes have been read */
-    png_set_sig_bytes(png_ptr, PNG_SIG_LEN);
+    png_set_sig_bytes(rd->png_ptr, PNG_SIG_LEN);
+
+    /* look for an IDAT index */
+    rd->idx = NULL;
+    rd->idx_size = 0;
+    png_set_read_user_chunk_fn(rd->png_ptr, (png_voidp) rd,
+                               &_io_png_rd_chunk);
+
+    /*
+     * set the read filter transforms, to get 8bit RGB whatever the
+     * original file may contain:
+     * png_set_palette_to_rgb      convert palette to RGB
+     * png_set_packing             expand 1, 2 and 4-bit
+     *                             samples to bytes
+     * png_set_strip_16            chop 16-bit samples to
+     *                             8-bit
+     * png_set_interlace_handling  read full rows from
+     *                             Adam7 interlaced files
+     */
+    /* todo: handle 16bit? */
+    png_set_palette_to_rgb(rd->png_ptr);
+    png_read_info(rd->png_ptr, rd->info_ptr);
+
+    /*
+     * 8bit non-palette images without tRNS need no transform and are
+     * decoded without libpng, with the IDAT index or the built-in
+     * decoder, from the first IDAT chunk header just read by libpng
+     * if the file can seek
+     */
+    rd->indexed = 0;
+    rd->fast = 0;
+    if ((NULL != rd->idx
+         || (_IO_PNG_FAST_READ
+             && (png_size_t) UINT_MAX > png_get_rowbytes(rd->png_ptr,
+                                                         rd->info_ptr)))
+        && 8 == png_get_bit_depth(rd->png_ptr, rd->info_ptr)
+        && 0 == (png_get_color_type(rd->png_ptr, rd->info_ptr)
+                 & PNG_COLOR_MASK_PALETTE)
+        && PNG_INTERLACE_NONE == png_get_interlace_type(rd->png_ptr,
+                                                        rd->info_ptr)
+        && 0 == png_get_valid(rd->png_ptr, rd->info_ptr, PNG_INFO_tRNS)
+        && -1L != (pos = ftell(rd->fp))
+        && 0 == fseek(rd->fp, pos - 8, SEEK_SET)) {
+        if (NULL != rd->idx)
+            rd->indexed = 1;
+        else
+            rd->fast = 1;
+    }
+    png_set_packing(rd->png_ptr);
+    png_set_strip_16(rd->png_ptr);
+    (void) png_set_interlace_handling(rd->png_ptr);
+    png_read_update_info(rd->png_ptr, rd->info_ptr);
+
+    /* collect the image informations */
+    rd->nx = (size_t) png_get_image_width(rd->png_ptr, rd->info_ptr);
+    rd->ny = (size_t) png_get_image_height(rd->png_ptr, rd->info_ptr);
+    rd->nc = (size_t) png_get_channels(rd->png_ptr, rd->info_ptr);
+    rd->rowbytes = (size_t) png_get_rowbytes(rd->png_ptr, rd->info_ptr);
+    rd->interlace = png_get_interlace_type(rd->png_ptr, rd->info_ptr);
+    assert(rd->rowbytes == rd->nx * rd->nc);
+
+    /* the rows are read one at a time, on the stack if possible */
+    if (PNG_INTERLACE_NONE != rd->interlace || rd->indexed)
+        /* Adam7 and the IDAT index need the whole image */
+        rd->png_data = _IO_PNG_SAFE_MALLOC(rd->ny * rd->rowbytes, png_byte);
+    else if (rd->fast) {
+        /* the built-in decoder needs two filtered rows */
+        if (2 * (rd->rowbytes + 1) <= IO_PNG_SMALL_SIZE)
+            rd->png_data = rd->png_row;
+        else
+            rd->png_data = _IO_PNG_SAFE_MALLOC(2 * (rd->rowbytes + 1),
+                                               png_byte);
+        _io_png_rd_fast_open(rd);
+    }
+    else if (rd->rowbytes <= IO_PNG_SMALL_SIZE)
+        rd->png_data = rd->png_row;
+    else
+        rd->png_data = _IO_PNG_SAFE_MALLOC(rd->rowbytes, png_byte);
+    rd->y = 0;
+    return;
+}
+
+/**
+ * @brief inflate and unfilter the IDAT index segments
+ *
+ * @param rd reader state, receives the image
+ * @param zdata, zlen zlib stream
+ * @param row, off first row and data offset of the segments, with a
+ * sentinel segment at the end
+ * @param nseg number of segments
+ * @param zero row filled with 0
+ * @return 0, or -1 if a segment is invalid or the checksum is wrong
+ */
+static int _io_png_idx_decode(_io_png_rd_t * rd, const png_byte * zdata,
+                              size_t zlen, const size_t * row,
+                              const size_t * off, size_t nseg,
+                              const png_byte * zero)
+{
+    png_byte **band;
+    uLong *adler, adler_all;
+    size_t k, y;
+    long kk;
+    int *bad, fail;
+
+    /* inflate and unfilter the segments, in parallel */
+    band = _IO_PNG_SAFE_MALLOC(nseg, png_byte *);
+    adler = _IO_PNG_SAFE_MALLOC(nseg, uLong);
+    bad = _IO_PNG_SAFE_MALLOC(nseg, int);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) _IO_PNG_COPYIN
+#endif
+    for (kk = 0; kk < (long) nseg; kk++)
+        band[kk] = _io_png_idx_inflate(rd->png_data, zdata + off[kk],
+                                       off[kk + 1] - off[kk],
+                                       row[kk], row[kk + 1], rd->rowbytes,
+                                       rd->nc, zero, adler + kk, bad + kk);
+    fail = 0;
+    for (k = 0; k < nseg; k++)
+        fail |= bad[k];
+
+    /* unfilter the bands needing the previous one, in order */
+    for (k = 0; k < nseg; k++) {
+        if (NULL == band[k])
+            continue;
+        for (y = row[k]; 0 == fail && y < row[k + 1]; y++)
+            _io_png_unfilter(rd->png_data + y * rd->rowbytes,
+                             band[k] + (y - row[k]) * (rd->rowbytes + 1) + 1,
+                             rd->png_data + (y - 1) * rd->rowbytes,
+                             rd->rowbytes, rd->nc,
+                             band[k][(y - row[k]) * (rd->rowbytes + 1)]);
+        _io_png_free(band[k]);
+    }
+
+    /* check the zlib stream checksum */
+    if (0 == fail) {
+        adler_all = adler[0];
+        for (k = 1; k < nseg; k++)
+            adler_all = adler32_combine(adler_all, adler[k],
+                                        (z_off_t) ((row[k + 1] - row[k])
+                                                   * (rd->rowbytes + 1)));
+        if (png_get_uint_32(zdata + zlen - 4) != adler_all)
+            fail = 1;
+    }
+
+    _io_png_free(band);
+    _io_png_free(adler);
+    _io_png_free(bad);
+    return (0 == fail ? 0 : -1);
+}
+
+/**
+ * @brief decode a PNG file with an IDAT index
+ *
+ * The IDAT chunks are collected and checked, then the segments are
+ * inflated and unfiltered in parallel into the reader image buffer.
+ * Invalid indexes are replaced by a single segment, and so are the
+ * indexes giving invalid segments or a wrong checksum: the stream is
+ * then decoded again, sequentially.
+ *
+ * @param rd reader state, with the file at the first IDAT chunk
+ * @return void, abort() on error
+ */
+static void _io_png_rd_idx(_io_png_rd_t * rd)
+{
+    png_byte head[8], crc[4];
+    png_byte *zdata, *zero;
+    size_t zlen, zmax, len;
+    size_t nseg, k;
+    size_t *row, *off;
+
+    /* collect the IDAT chunks data, check their CRC */
+    zdata = NULL;
+    zlen = 0;
+    zmax = 0;
+    for (;;) {
+        if (8 != _io_png_fread(head, 8, rd->fp))
+            _IO_PNG_ABORT("corrupted PNG file");
+        len = (size_t) png_get_uint_32(head);
+        if (0 != memcmp(head + 4, "IDAT", 4))
+            break;
+        if (zlen + len > zmax) {
+            zmax = 2 * (zlen + len);
+            zdata = _IO_PNG_SAFE_REALLOC(zdata, zmax, png_byte);
+        }
+        if (len != _io_png_fread(zdata + zlen, len, rd->fp)
+            || 4 != _io_png_fread(crc, 4, rd->fp)
+            || png_get_uint_32(crc)
+            != crc32(crc32(0L, head + 4, 4), zdata + zlen, (uInt) len))
+            _IO_PNG_ABORT("corrupted PNG file");
+        zlen += len;
+    }
+    _io_png_rd_iend(rd->fp, head);
+
+    /* zlib header: deflate, no preset dictionary */
+    if (6 > zlen || 8 != (zdata[0] & 0x0f) || 0 != (zdata[1] & 0x20)
+        || 0 != (zdata[0] * 256 + zdata[1]) % 31)
+        _IO_PNG_ABORT("corrupted PNG file");
+
+    /* read the index, sentinel segment at the end */
+    nseg = (4 <= rd->idx_size ? (size_t) png_get_uint_32(rd->idx) : 0);
+    if (0 == nseg || rd->idx_size != 4 + 8 * nseg)
+        nseg = 1;
+    row = _IO_PNG_SAFE_MALLOC(nseg + 1, size_t);
+    off = _IO_PNG_SAFE_MALLOC(nseg + 1, size_t);
+    for (k = 0; k < nseg && rd->idx_size == 4 + 8 * nseg; k++) {
+        row[k] = (size_t) png_get_uint_32(rd->idx + 4 + 8 * k);
+        off[k] = (size_t) png_get_uint_32(rd->idx + 8 + 8 * k);
+    }
+    row[nseg] = rd->ny;
+    off[nseg] = zlen - 4;
+    /* the segments must start at the first row and data */
+    if (rd->idx_size != 4 + 8 * nseg || 0 != row[0] || 2 != off[0])
+        k = 0;
+    else
+        for (k = 0; k < nseg; k++)
+            if (row[k] >= row[k + 1] || off[k] >= off[k + 1])
+                break;
+    if (k != nseg) {
+        nseg = 1;
+        row[0] = 0;
+        off[0] = 2;
+        row[1] = rd->ny;
+        off[1] = zlen - 4;
+    }
+
+    /* decode, with a single segment if the index is wrong */
+    zero = _IO_PNG_SAFE_MALLOC(rd->rowbytes, png_byte);
+    memset(zero, 0, rd->rowbytes);
+    if (0 != _io_png_idx_decode(rd, zdata, zlen, row, off, nseg, zero)) {
+        if (1 == nseg)
+            _IO_PNG_ABORT("corrupted PNG file");
+        row[0] = 0;
+        off[0] = 2;
+        row[1] = rd->ny;
+        off[1] = zlen - 4;
+        if (0 != _io_png_idx_decode(rd, zdata, zlen, row, off, 1, zero))
+            _IO_PNG_ABORT("corrupted PNG file");
+    }
+
+    _io_png_free(zero);
+    _io_png_free(row);
+    _io_png_free(off);
+    _io_png_free(zdata);
+    return;
+}
+
+/**
+ * @brief read the next row of a PNG file
+ *
+ * @param rd reader state
+ * @return interlaced png_byte row, valid until the next call
+ */
+static const png_byte *_io_png_rd_row(_io_png_rd_t * rd)
+{
+    png_bytepp row_pointers;
+    size_t i;
+
+    assert(NULL != rd && rd->y < rd->ny);
+
+    /* if we get here, we had a problem reading from the file */
+    if (setjmp(rd->err.jmpbuf))
+        _IO_PNG_ABORT("libpng reading error");
+
+    if (rd->fast)
+        return _io_png_rd_fast_row(rd);
+
+    /* IDAT index: decode all the segments, then serve the rows */
+    if (rd->indexed) {
+        if (0 == rd->y)
+            _io_png_rd_idx(rd);
+        rd->y += 1;
+        return rd->png_data + (rd->y - 1) * rd->rowbytes;
+    }
+
+    if (PNG_INTERLACE_NONE == rd->interlace) {
+        png_read_row(rd->png_ptr, rd->png_data, NULL);
+        rd->y += 1;
+        return rd->png_data;
+    }
+
+    /* Adam7: decode all the passes, then serve the rows */
+    if (0 == rd->y) {
+        row_pointers = _IO_PNG_SAFE_MALLOC(rd->ny, png_bytep);
+        for (i = 0; i < rd->ny; i++)
+            row_pointers[i] = rd->png_data + i * rd->rowbytes;
+        png_read_image(rd->png_ptr, row_pointers);
+        _io_png_free(row_pointers);
+    }
+    rd->y += 1;
+    return rd->png_data + (rd->y - 1) * rd->rowbytes;
+}
+
+/**
+ * @brief end reading a PNG file, free the reader memory
+ *
+ * The reading can stop before the last row; the end of the file is
+ * then ignored.
+ *
+ * @param rd reader state
+ * @return void, abort() on error
+ */
+static void _io_png_rd_close(_io_png_rd_t * rd)
+{
+    assert(NULL != rd && rd->y <= rd->ny);
+
+    /* if we get here, we had a problem reading from the file */
+    if (setjmp(rd->err.jmpbuf))
+        _IO_PNG_ABORT("libpng reading error");
+
+    /* the IDAT index decoder already read the file up to IEND */
+    if (rd->fast)
+        _io_png_rd_fast_close(rd);
+    else if (!rd->indexed && rd->y == rd->ny)
+        png_read_end(rd->png_ptr, rd->info_ptr);
+    png_destroy_read_struct(&rd->png_ptr, &rd->info_ptr, NULL);
+    _io_png_fclose(rd->fp);
+    if (rd->png_row != rd->png_data)
+        _io_png_free(rd->png_data);
+    if (NULL != rd->idx)
+        _io_png_free(rd->idx);
+    return;
+}
+
+/**
+ * @brief internal function used to read a PNG file into an array
+ *
+ * The rows are converted to the output type, with the option, by a
+ * single kernel, directly into the output array.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param nxp, nyp, ncp pointers to variables to be filled
+ *        with the number of columns, lines and channels of the image
+ * @param opt post-processing option, can be IO_PNG_OPT_RGB or IO_PNG_OPT_GRAY,
+ *         IO_PNG_OPT_NONE to do nothing
+ * @param type output data type, _IO_PNG_FLT, _IO_PNG_UCHAR or
+ *        _IO_PNG_USHRT
+ * @return pointer to an array of pixels, abort() on error
+ *
+ * @todo don't loose 16bit info
+ */
+static void *_io_png_read(const char *fname,
+                          size_t * nxp, size_t * nyp, size_t * ncp,
+                          io_png_opt_t opt, int type)
+{
+    _io_png_rd_t rd;
+    _io_png_rd_kern_t kern;
+    const png_byte *row;
+    char *data;
+    size_t nx, ny, nc, size;
+    size_t i;
+    int o;
+
+    assert(NULL != fname && NULL != nxp && NULL != nyp && NULL != ncp);
+
+    _IO_PNG_TM_BEGIN();
+    _IO_PNG_MEM_BEGIN();
+    o = _io_png_rd_opt(opt);
+    _IO_PNG_TM_ENTER(_IO_PNG_TM_OPEN);
+    _io_png_rd_open(&rd, fname);
+    _IO_PNG_TM_LEAVE();
+    nx = rd.nx;
+    ny = rd.ny;
+    kern = _io_png_kern()->rd[type][o][rd.nc - 1];
+    nc = _io_png_rd_nc[o][rd.nc - 1];
+
+    /*
+     * convert and deinterlace RGBA RGBA RGBA to RRR GGG BBB AAA, with
+     * the option, one row at a time
+     */
+    size = _io_png_type_size[type];
+    data = (char *) _io_png_out_malloc(nx * ny * nc * size);
+    _IO_PNG_TM_ENTER(_IO_PNG_TM_CODEC);
+    for (i = 0; i < ny; i++) {
+        _IO_PNG_TM_SWITCH(_IO_PNG_TM_CODEC);
+        row = _io_png_rd_row(&rd);
+        _IO_PNG_TM_SWITCH(_IO_PNG_TM_CONVERT);
+        kern(data + i * nx * size, row, nx, nx * ny);
+    }
+
+    _IO_PNG_TM_SWITCH(_IO_PNG_TM_CLOSE);
+    _io_png_rd_close(&rd);
+    _IO_PNG_TM_LEAVE();
+    _IO_PNG_MEM_END(nx * ny * nc * size);
+    _IO_PNG_TM_END(0);
+
+    *nxp = nx;
+    *nyp = ny;
+    *ncp = nc;
+    return (void *) data;
+}
+
+/**
+ * @brief read a PNG file into a float array with some options
+ *
+ * The image is read into an array with the deinterlaced channels,
+ * with values in [0,1]. The option parameter is a string whose
+ * content defines the filters applied to the image data:
+ * - "": do nothing
+ * - "rgb": strip the alpha channel, convert gray images to rgb
+ * - "gray": strip the alpha channel, convert rgb images to gray
+ *
+ * @param fname PNG file name
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image, if not NULL
+ * @param opt post-processing opt
+ * @return pointer to an array of pixels, abort() on error
+ */
+float *io_png_read_flt_opt(const char *fname,
+                           size_t * nxp, size_t * nyp, size_t * ncp,
+                           io_png_opt_t opt)
+{
+    float *flt_data;
+    size_t nx, ny, nc;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    flt_data = (float *) _io_png_read(fname, &nx, &ny, &nc, opt,
+                                      _IO_PNG_FLT);
+
+    if (NULL != nxp)
+        *nxp = nx;
+    if (NULL != nyp)
+        *nyp = ny;
+    if (NULL != ncp)
+        *ncp = nc;
+    return flt_data;
+}
+
+/**
+ * @brief read a PNG file into a float array
+ *
+ * The image is read into an array with the deinterlaced channels,
+ * with values in [0,1].
+ *
+ * @param fname PNG file name
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image
+ * @return pointer to an array of pixels, abort() on error
+ */
+float *io_png_read_flt(const char *fname,
+                       size_t * nxp, size_t * nyp, size_t * ncp)
+{
+    return io_png_read_flt_opt(fname, nxp, nyp, ncp, IO_PNG_OPT_NONE);
+}
+
+/**
+ * @brief read a PNG file into an unsigned char array with some options
+ *
+ * The image is read into an array with the deinterlaced channels,
+ * with values in [0,UCHAR_MAX]. See  io_png_read_flt_opt() for
+ * details.
+ */
+unsigned char *io_png_read_uchar_opt(const char *fname,
+                                     size_t * nxp, size_t * nyp, size_t * ncp,
+                                     io_png_opt_t opt)
+{
+    unsigned char *data;
+    size_t nx, ny, nc;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    data = (unsigned char *) _io_png_read(fname, &nx, &ny, &nc, opt,
+                                          _IO_PNG_UCHAR);
+
+    if (NULL != nxp)
+        *nxp = nx;
+    if (NULL != nyp)
+        *nyp = ny;
+    if (NULL != ncp)
+        *ncp = nc;
+    return data;
+}
+
+/**
+ * @brief read a PNG file into an unsigned char array
+ *
+ * The array contains the de-interlaced channels, with values in
+ * [0,UCHAR_MAX].
+ *
+ * @param fname PNG file name
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image
+ * @return pointer to an array of pixels, abort() on error
+ */
+unsigned char *io_png_read_uchar(const char *fname,
+                                 size_t * nxp, size_t * nyp, size_t * ncp)
+{
+    return io_png_read_uchar_opt(fname, nxp, nyp, ncp, IO_PNG_OPT_NONE);
+}
+
+/**
+ * @brief read a PNG file into an unsigned short array with some options
+ *
+ * The image is read into an array with the deinterlaced channels,
+ * with values in [0,USHRT_MAX]. See  io_png_read_uchar_opt() for
+ * details.
+ */
+unsigned short *io_png_read_ushrt_opt(const char *fname,
+                                      size_t * nxp, size_t * nyp,
+                                      size_t * ncp, io_png_opt_t opt)
+{
+    unsigned short *data;
+    size_t nx, ny, nc;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    data = (unsigned short *) _io_png_read(fname, &nx, &ny, &nc, opt,
+                                           _IO_PNG_USHRT);
+
+    if (NULL != nxp)
+        *nxp = nx;
+    if (NULL != nyp)
+        *nyp = ny;
+    if (NULL != ncp)
+        *ncp = nc;
+    return data;
+}
+
+/**
+ * @brief read a PNG file into an unsigned short array
+ *
+ * The array contains the de-interlaced channels, with values in
+ * [0,USHRT_MAX].
+ *
+ * @param fname PNG file name
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image
+ * @return pointer to an array of pixels, abort() on error
+ */
+unsigned short *io_png_read_ushrt(const char *fname,
+                                  size_t * nxp, size_t * nyp, size_t * ncp)
+{
+    return io_png_read_ushrt_opt(fname, nxp, nyp, ncp, IO_PNG_OPT_NONE);
+}
+
+/*
+ * OUT-OF-CORE READ
+ */
+
+/** @brief number of bytes decoded between two flushes of the mapping */
+#define _IO_PNG_FLUSH_SIZE (16 * 1024 * 1024)
+
+/**
+ * @brief read a PNG file into a float array mapped to a scratch file
+ *
+ * The image is read like with io_png_read_flt(), but the array is
+ * a shared memory mapping of a new sparse file created in the dir
+ * folder, so images larger than the memory can be processed. The
+ * file is removed from the folder at once, and its storage is released
+ * by io_png_munmap_flt(). The rows are flushed to the file as they are
+ * decoded. Adam7 interlaced files still need nx * ny * nc bytes of
+ * memory during the decoding.
+ *
+ * On systems without POSIX memory mapping, the array is allocated in
+ * memory.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param dir folder for the scratch file
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image, if not NULL
+ * @return pointer to an array of pixels, to be released with
+ *         io_png_munmap_flt(), abort() on error
+ */
+float *io_png_read_flt_mmap(const char *fname, const char *dir,
+                            size_t * nxp, size_t * nyp, size_t * ncp)
+{
+    _io_png_rd_t rd;
+    _io_png_rd_kern_t kern;
+    const png_byte *row;
+    float *data;
+    size_t nx, ny, nc, size;
+    size_t i;
+#ifdef _IO_PNG_MMAP
+    char *path;
+    int fd;
+    size_t page, flushed, band, c;
+    size_t beg, end;
+#endif
+
+    if (NULL == fname || NULL == dir)
+        _IO_PNG_ABORT("bad parameters");
+
+    _IO_PNG_TM_BEGIN();
+    _IO_PNG_MEM_BEGIN();
+    _IO_PNG_TM_ENTER(_IO_PNG_TM_OPEN);
+    _io_png_rd_open(&rd, fname);
+    nx = rd.nx;
+    ny = rd.ny;
+    nc = rd.nc;
+    size = nx * ny * nc * sizeof(float);
+    kern = _io_png_kern()->rd[_IO_PNG_FLT][0][nc - 1];
+
+#ifdef _IO_PNG_MMAP
+    /* create the scratch file, unlinked, and extend it without writing */
+    path = _IO_PNG_SAFE_MALLOC(strlen(dir) + sizeof("/io_png_XXXXXX"), char);
+    strcpy(path, dir);
+    strcat(path, "/io_png_XXXXXX");
+    if (-1 == (fd = mkstemp(path)))
+        _IO_PNG_ABORT("failed to create the scratch file");
+    (void) unlink(path);
+    _io_png_free(path);
+    if (0 != ftruncate(fd, (off_t) size))
+        _IO_PNG_ABORT("failed to extend the scratch file");
+    data = (float *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+    if (MAP_FAILED == (void *) data)
+        _IO_PNG_ABORT("failed to map the scratch file");
+    /* the mapping keeps the file */
+    (void) close(fd);
+
+    /* flush the channel rows every few MB, page-aligned */
+    page = (size_t) sysconf(_SC_PAGESIZE);
+    band = _IO_PNG_FLUSH_SIZE / (nx * nc * sizeof(float)) + 1;
+    flushed = 0;
+    for (i = 0; i < ny; i++) {
+        _IO_PNG_TM_SWITCH(_IO_PNG_TM_CODEC);
+        row = _io_png_rd_row(&rd);
+        _IO_PNG_TM_SWITCH(_IO_PNG_TM_CONVERT);
+        kern(data + i * nx, row, nx, nx * ny);
+        if (i + 1 - flushed < band && i + 1 < ny)
+            continue;
+        _IO_PNG_TM_SWITCH(_IO_PNG_TM_IO);
+        for (c = 0; c < nc; c++) {
+            beg = (c * nx * ny + flushed * nx) * sizeof(float);
+            end = (c * nx * ny + (i + 1) * nx) * sizeof(float);
+            beg -= beg % page;
+            (void) msync((char *) data + beg, end - beg, MS_ASYNC);
+        }
+        flushed = i + 1;
+    }
+#else
+    data = (float *) _io_png_safe_malloc(size);
+    for (i = 0; i < ny; i++) {
+        _IO_PNG_TM_SWITCH(_IO_PNG_TM_CODEC);
+        row = _io_png_rd_row(&rd);
+        _IO_PNG_TM_SWITCH(_IO_PNG_TM_CONVERT);
+        kern(data + i * nx, row, nx, nx * ny);
+    }
+#endif
+
+    _IO_PNG_TM_SWITCH(_IO_PNG_TM_CLOSE);
+    _io_png_rd_close(&rd);
+    _IO_PNG_TM_LEAVE();
+    _IO_PNG_MEM_END(0);
+    _IO_PNG_TM_END(0);
+
+    if (NULL != nxp)
+        *nxp = nx;
+    if (NULL != nyp)
+        *nyp = ny;
+    if (NULL != ncp)
+        *ncp = nc;
+    return data;
+}
+
+/**
+ * @brief release an array read by io_png_read_flt_mmap()
+ *
+ * @param data array to release
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @return void, abort() on error
+ */
+void io_png_munmap_flt(float *data, size_t nx, size_t ny, size_t nc)
+{
+    if (NULL == data)
+        _IO_PNG_ABORT("bad parameters");
+#ifdef _IO_PNG_MMAP
+    if (0 != munmap((void *) data, nx * ny * nc * sizeof(float)))
+        _IO_PNG_ABORT("failed to unmap the scratch file");
+#else
+    (void) nx;
+    (void) ny;
+    (void) nc;
+    _io_png_free(data);
+#endif
+    return;
+}
+
+/*
+ * WRITE
+ */
+
+/**
+ * @brief zlib compression level for the write options
+ *
+ * @param opt processing option, IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX
+ * @return compression level, from 0 to 9
+ */
+static int _io_png_zlevel(io_png_opt_t opt)
+{
+    if (opt & IO_PNG_OPT_ZMAX)
+        return 9;
+    if (opt & IO_PNG_OPT_ZMIN)
+        return 0;
+    return 5;
+}
+
+/**
+ * @brief PNG color type for a number of channels
+ *
+ * @param nc number of channels, from 1 to 4
+ * @return gray, gray+alpha, rgb or rgb+alpha color type, abort() on error
+ */
+static int _io_png_color_type(size_t nc)
+{
+    switch (nc) {
+    case 1:
+        return PNG_COLOR_TYPE_GRAY;
+    case 2:
+        return PNG_COLOR_TYPE_GRAY_ALPHA;
+    case 3:
+        return PNG_COLOR_TYPE_RGB;
+    case 4:
+        return PNG_COLOR_TYPE_RGB_ALPHA;
+    default:
+        _IO_PNG_ABORT("bad parameters");
+    }
+    return -1;
+}
+
+/**
+ * @brief write the image data with an IDAT index
+ *
+ * The bands are filtered and compressed in parallel as independent
+ * segments of a single zlib stream, then the index chunk, the IDAT
+ * chunks and IEND are written, replacing png_write_row() and
+ * png_write_end().
+ *
+ * @param png_ptr libpng write structure, after png_write_info()
+ * @param png_data packed PNG rows, non-interlaced
+ * @param rowbytes, ny row size and number of rows
+ * @param bpp filter byte distance, bytes per pixel rounded up
+ * @param level zlib compression level
+ * @return void, abort() on error
+ */
+static void _io_png_write_idx(png_structp png_ptr, const png_byte * png_data,
+                              size_t rowbytes, size_t ny, size_t bpp,
+                              int level)
+{
+    png_byte head[2], tail[4];
+    png_byte *zero, *idx;
+    png_byte **zdata;
+    size_t *zlen;
+    uLong *adler, adler_all;
+    size_t nrow, nseg, k, off, rest, len, chunk;
+    long kk;
+
+    nrow = _IO_PNG_IDX_BAND / (rowbytes + 1) + 1;
+    nseg = (ny + nrow - 1) / nrow;
+
+    /* compress the bands, in parallel */
+    zero = _IO_PNG_SAFE_MALLOC(rowbytes, png_byte);
+    memset(zero, 0, rowbytes);
+    zdata = _IO_PNG_SAFE_MALLOC(nseg, png_byte *);
+    zlen = _IO_PNG_SAFE_MALLOC(nseg, size_t);
+    adler = _IO_PNG_SAFE_MALLOC(nseg, uLong);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) _IO_PNG_COPYIN
+#endif
+    for (kk = 0; kk < (long) nseg; kk++)
+        zdata[kk] = _io_png_idx_deflate(png_data, (size_t) kk * nrow,
+                                        ((size_t) kk + 1 < nseg
+                                         ? ((size_t) kk + 1) * nrow : ny),
+                                        rowbytes, bpp, zero, level,
+                                        (size_t) kk + 1 == nseg,
+                                        zlen + kk, adler + kk);
+    _io_png_free(zero);
+
+    /* zlib header and trailer */
+    head[0] = 0x78;
+    head[1] = (png_byte) ((2 > level ? 0 : 6 > level ? 1
+                           : 6 == level ? 2 : 3) << 6);
+    head[1] = (png_byte) (head[1]
+                          + (31 - (head[0] * 256 + head[1]) % 31) % 31);
+    adler_all = adler[0];
+    for (k = 1; k < nseg; k++)
+        adler_all = adler32_combine(adler_all, adler[k],
+                                    (z_off_t) ((k + 1 < nseg ? nrow
+                                                : ny - k * nrow)
+                                               * (rowbytes + 1)));
+    png_save_uint_32(tail, (png_uint_32) adler_all);
+
+    /* the index chunk, if the offsets fit in 32 bits */
+    off = 2;
+    for (k = 0; k < nseg; k++)
+        off += zlen[k];
+    if (off <= 0xffffffffUL) {
+        idx = _IO_PNG_SAFE_MALLOC(4 + 8 * nseg, png_byte);
+        png_save_uint_32(idx, (png_uint_32) nseg);
+        off = 2;
+        for (k = 0; k < nseg; k++) {
+            png_save_uint_32(idx + 4 + 8 * k, (png_uint_32) (k * nrow));
+            png_save_uint_32(idx + 8 + 8 * k, (png_uint_32) off);
+            off += zlen[k];
+        }
+        png_write_chunk(png_ptr, (png_bytep) _IO_PNG_IDX_NAME, idx,
+                        4 + 8 * nseg);
+        _io_png_free(idx);
+    }
+
+    /* the zlib stream, in IDAT chunks */
+    rest = off + 4;
+    len = 0;
+    for (k = 0; k <= nseg + 1; k++) {
+        const png_byte *data = (0 == k ? head : k <= nseg ? zdata[k - 1]
+                                : tail);
+        size_t size = (0 == k ? 2 : k <= nseg ? zlen[k - 1] : 4);
+
+        while (0 < size) {
+            if (0 == len) {
+                /* next IDAT chunk */
+                if (rest != off + 4)
+                    png_write_chunk_end(png_ptr);
+                len = (rest < _IO_PNG_IDAT_SIZE ? rest : _IO_PNG_IDAT_SIZE);
+                png_write_chunk_start(png_ptr, (png_bytep) "IDAT",
+                                      (png_uint_32) len);
+            }
+            chunk = (size < len ? size : len);
+            png_write_chunk_data(png_ptr, (png_bytep) data, chunk);
+            data += chunk;
+            size -= chunk;
+            len -= chunk;
+            rest -= chunk;
+        }
+        if (0 < k && k <= nseg)
+            _io_png_free(zdata[k - 1]);
+    }
+    png_write_chunk_end(png_ptr);
+    png_write_chunk(png_ptr, (png_bytep) "IEND", NULL, 0);
+
+    _io_png_free(zdata);
+    _io_png_free(zlen);
+    _io_png_free(adler);
+    return;
+}
+
+/*
+ * DEFLATE ENCODER
+ */
+
+/*
+ * The built-in deflate encoder codes a sequence of LZ77 symbols in
+ * blocks, each with Huffman tables computed from its symbol
+ * frequencies, or stored if that is smaller, into a standard zlib
+ * stream. The symbols come from a greedy matcher for the fast
+ * encoder, or from an optimal parser for the archive encoder.
+ */
+
+/** @brief deflate window size */
+#define _IO_PNG_WINDOW 32768
+
+/** @brief deflate length base, by length code - 257 */
+static const unsigned short _io_png_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+/** @brief deflate length extra bits, by length code - 257 */
+static const unsigned char _io_png_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+/** @brief deflate distance base, by distance code */
+static const unsigned short _io_png_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+/** @brief deflate distance extra bits, by distance code */
+static const unsigned char _io_png_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/** @brief deflate code length codes order */
+static const unsigned char _io_png_cl_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/** @brief LZ77 symbol: literal or length code, and distance code */
+typedef struct _io_png_tok_s {
+    unsigned short sym;         /* literal/length code */
+    unsigned short ext;         /* length extra bits value */
+    unsigned short dext;        /* distance extra bits value */
+    unsigned char dsym;         /* distance code */
+} _io_png_tok_t;
+
+/** @brief bit writer, least significant bit first */
+typedef struct _io_png_bits_s {
+    png_byte *out;              /* output buffer */
+    size_t pos;                 /* output size */
+    size_t max;                 /* output buffer size */
+    unsigned long acc;          /* pending bits */
+    int n;                      /* number of pending bits, < 16 */
+} _io_png_bits_t;
+
+/**
+ * @brief write up to 16 bits, with the bit writer state in local
+ *        variables, two bytes at a time
+ */
+#define _IO_PNG_BITS_PUT(OUT, ACC, N, VAL, LEN) do {            \
+        (ACC) |= (unsigned long) (VAL) << (N);                  \
+        (N) += (LEN);                                           \
+        if (16 <= (N)) {                                        \
+            *(OUT)++ = (png_byte) ((ACC) & 0xff);               \
+            *(OUT)++ = (png_byte) (((ACC) >> 8) & 0xff);        \
+            (ACC) >>= 16;                                       \
+            (N) -= 16;                                          \
+        }                                                       \
+    } while (0)
+
+/**
+ * @brief write up to 16 bits
+ *
+ * @param bw bit writer
+ * @param val bits, in the lowest bits
+ * @param n number of bits
+ */
+static void _io_png_bits_put(_io_png_bits_t * bw, unsigned long val, int n)
+{
+    bw->acc |= val << bw->n;
+    bw->n += n;
+    while (8 <= bw->n) {
+        bw->out[bw->pos++] = (png_byte) (bw->acc & 0xff);
+        bw->acc >>= 8;
+        bw->n -= 8;
+    }
+    return;
+}
+
+/** @brief pad the bit writer to a byte boundary */
+static void _io_png_bits_align(_io_png_bits_t * bw)
+{
+    if (0 < bw->n)
+        _io_png_bits_put(bw, 0, 8 - bw->n);
+    return;
+}
+
+/**
+ * @brief start a zlib stream
+ *
+ * @param bw bit writer to initialize
+ * @param size expected compressed size, the buffer grows if needed
+ * @param flevel zlib header compression level, 0 (fastest) to 3
+ *        (maximum)
+ */
+static void _io_png_zlib_open(_io_png_bits_t * bw, size_t size, int flevel)
+{
+    bw->max = size + 64;
+    bw->out = _IO_PNG_SAFE_MALLOC(bw->max, png_byte);
+    bw->pos = 0;
+    bw->acc = 0;
+    bw->n = 0;
+    /* deflate, 32K window, FCHECK multiple of 31 */
+    bw->out[bw->pos++] = 0x78;
+    bw->out[bw->pos++] = (png_byte) (flevel << 6);
+    bw->out[bw->pos - 1] = (png_byte) (bw->out[bw->pos - 1]
+                                       + (31 - (0x78 * 256
+                                                + bw->out[bw->pos - 1])
+                                          % 31) % 31);
+    return;
+}
+
+/**
+ * @brief end a zlib stream, after the last block
+ *
+ * @param bw bit writer
+ * @param data uncompressed data, for the checksum
+ * @param size uncompressed size
+ */
+static void _io_png_zlib_close(_io_png_bits_t * bw, const png_byte * data,
+                               size_t size)
+{
+    _io_png_bits_align(bw);
+    png_save_uint_32(bw->out + bw->pos,
+                     (png_uint_32) _io_png_adler32(adler32(0L, Z_NULL, 0),
+                                                   data, size));
+    bw->pos += 4;
+    return;
+}
+
+/** @brief position of the highest bit set */
+static int _io_png_log2(size_t x)
+{
+    int k;
+
+    for (k = 0; 1 < x; k++)
+        x >>= 1;
+    return k;
+}
+
+/** @brief deflate distance code, for a distance from 1 to 32768 */
+static int _io_png_dist_code(size_t dist)
+{
+    return (5 > dist ? (int) dist - 1
+            : 2 * _io_png_log2(dist - 1)
+            + (int) (((dist - 1) >> (_io_png_log2(dist - 1) - 1)) & 1));
+}
+
+/** @brief deflate length code - 257, for a length from 3 to 258 */
+static int _io_png_len_code(size_t len)
+{
+    return (258 == len ? 28 : 11 > len ? (int) len - 3
+            : 4 * _io_png_log2(len - 3) - 4
+            + (int) (((len - 3) >> (_io_png_log2(len - 3) - 2)) & 3));
+}
+
+/**
+ * @brief set a match symbol
+ *
+ * @param t symbol
+ * @param len match length, from 3 to 258
+ * @param dist match distance, from 1 to 32768
+ */
+static void _io_png_tok_match(_io_png_tok_t * t, size_t len, size_t dist)
+{
+    int c;
+
+    c = _io_png_len_code(len);
+    t->sym = (unsigned short) (257 + c);
+    t->ext = (unsigned short) (len - _io_png_len_base[c]);
+    c = _io_png_dist_code(dist);
+    t->dsym = (unsigned char) c;
+    t->dext = (unsigned short) (dist - _io_png_dist_base[c]);
+    return;
+}
+
+/** @brief data size of a symbol */
+static size_t _io_png_tok_size(const _io_png_tok_t * t)
+{
+    return (256 > t->sym ? 1 : (size_t) _io_png_len_base[t->sym - 257]
+            + t->ext);
+}
+
+/**
+ * @brief Huffman code lengths, limited to maxlen bits
+ *
+ * The code is built by merging the two lightest trees; when it is
+ * too deep, the frequencies are halved and it is built again. At
+ * least two symbols get a code, so the code is always complete.
+ *
+ * @param freq symbol frequencies
+ * @param n number of symbols, up to 288
+ * @param maxlen maximum code length
+ * @param len code lengths, 0 for the unused symbols
+ */
+static void _io_png_huff_len(const size_t * freq, int n, int maxlen,
+                             unsigned char *len)
+{
+    size_t f[288], w[2 * 288];
+    int parent[2 * 288];
+    char alive[2 * 288];
+    int i, k, m, a, b, next, depth, maxdepth;
+
+    /* at least two symbols */
+    m = 0;
+    for (i = 0; i < n; i++) {
+        f[i] = freq[i];
+        m += (0 != f[i]);
+    }
+    for (i = 0; m < 2 && i < n; i++)
+        if (0 == f[i]) {
+            f[i] = 1;
+            m++;
+        }
+
+    for (;;) {
+        for (i = 0; i < n; i++) {
+            w[i] = f[i];
+            alive[i] = (0 != f[i]);
+            parent[i] = -1;
+        }
+        /* merge the two lightest trees, m - 1 times */
+        for (next = n; next < n + m - 1; next++) {
+            a = -1;
+            b = -1;
+            for (k = 0; k < next; k++) {
+                if (!alive[k])
+                    continue;
+                if (-1 == a || w[k] < w[a]) {
+                    b = a;
+                    a = k;
+                }
+                else if (-1 == b || w[k] < w[b])
+                    b = k;
+            }
+            w[next] = w[a] + w[b];
+            alive[next] = 1;
+            parent[next] = -1;
+            alive[a] = 0;
+            alive[b] = 0;
+            parent[a] = next;
+            parent[b] = next;
+        }
+        /* leaf depths */
+        maxdepth = 0;
+        for (i = 0; i < n; i++) {
+            depth = 0;
+            if (0 != f[i])
+                for (k = i; -1 != parent[k]; k = parent[k])
+                    depth++;
+            len[i] = (unsigned char) depth;
+            maxdepth = (depth > maxdepth ? depth : maxdepth);
+        }
+        if (maxdepth <= maxlen)
+            break;
+        for (i = 0; i < n; i++)
+            f[i] = (f[i] + 1) / 2;
+    }
+    return;
+}
+
+/**
+ * @brief canonical Huffman codes, bit-reversed for the bit writer
+ *
+ * @param len code lengths, up to 15
+ * @param n number of symbols
+ * @param code codes
+ */
+static void _io_png_huff_code(const unsigned char *len, int n,
+                              unsigned short *code)
+{
+    unsigned int count[16], next[16];
+    unsigned int c, r;
+    int i, k;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+        count[len[i]]++;
+    count[0] = 0;
+    c = 0;
+    for (k = 1; k < 16; k++) {
+        c = (c + count[k - 1]) << 1;
+        next[k] = c;
+    }
+    for (i = 0; i < n; i++) {
+        if (0 == len[i])
+            continue;
+        c = next[len[i]]++;
+        r = 0;
+        for (k = 0; k < len[i]; k++) {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+        code[i] = (unsigned short) r;
+    }
+    return;
+}
+
+/** @brief coding plan of a deflate block */
+typedef struct _io_png_plan_s {
+    unsigned char llen[286];    /* literal/length code lengths */
+    unsigned char dlen[30];     /* distance code lengths */
+    unsigned char clen[19];     /* code length code lengths */
+    unsigned char rle[286 + 30];        /* run-length coded lengths */
+    unsigned char rle_ext[286 + 30];    /* and their extra bits */
+    int nlit, ndist, ncl, nrle;
+    int stored;                 /* stored block(s) */
+    size_t bits;                /* block size, in bits */
+} _io_png_plan_t;
+
+/**
+ * @brief plan the coding of a deflate block, with Huffman tables or
+ *        stored
+ *
+ * @param plan coding plan
+ * @param tok block symbols
+ * @param ntok number of symbols
+ * @param size block data size
+ * @return block size, in bits
+ */
+static size_t _io_png_block_plan(_io_png_plan_t * plan,
+                                 const _io_png_tok_t * tok, size_t ntok,
+                                 size_t size)
+{
+    size_t lfreq[286], dfreq[30], cfreq[19];
+    unsigned char all[286 + 30];
+    int nall, i, run, r;
+    size_t k, bits, stored;
+
+    /* code lengths */
+    memset(lfreq, 0, sizeof(lfreq));
+    memset(dfreq, 0, sizeof(dfreq));
+    for (k = 0; k < ntok; k++) {
+        lfreq[tok[k].sym]++;
+        if (256 < tok[k].sym)
+            dfreq[tok[k].dsym]++;
+    }
+    lfreq[256] = 1;
+    _io_png_huff_len(lfreq, 286, 15, plan->llen);
+    _io_png_huff_len(dfreq, 30, 15, plan->dlen);
+    for (plan->nlit = 286;
+         257 < plan->nlit && 0 == plan->llen[plan->nlit - 1]; plan->nlit--);
+    for (plan->ndist = 30;
+         1 < plan->ndist && 0 == plan->dlen[plan->ndist - 1]; plan->ndist--);
+
+    /* run-length coded lengths, both tables together */
+    memcpy(all, plan->llen, plan->nlit);
+    memcpy(all + plan->nlit, plan->dlen, plan->ndist);
+    nall = plan->nlit + plan->ndist;
+    plan->nrle = 0;
+    for (i = 0; i < nall; i += run) {
+        for (run = 1; i + run < nall && all[i + run] == all[i]; run++);
+        if (0 == all[i] && 3 <= run) {
+            for (r = run; 11 <= r; r -= (138 < r ? 138 : r)) {
+                plan->rle[plan->nrle] = 18;
+                plan->rle_ext[plan->nrle++] =
+                    (unsigned char) ((138 < r ? 138 : r) - 11);
+            }
+            if (3 <= r) {
+                plan->rle[plan->nrle] = 17;
+                plan->rle_ext[plan->nrle++] = (unsigned char) (r - 3);
+                r = 0;
+            }
+            run -= r;
+            continue;
+        }
+        plan->rle[plan->nrle++] = all[i];
+        for (r = run - 1; 3 <= r; r -= (6 < r ? 6 : r)) {
+            plan->rle[plan->nrle] = 16;
+            plan->rle_ext[plan->nrle++] =
+                (unsigned char) ((6 < r ? 6 : r) - 3);
+        }
+        run -= r;
+    }
+    memset(cfreq, 0, sizeof(cfreq));
+    for (i = 0; i < plan->nrle; i++)
+        cfreq[plan->rle[i]]++;
+    _io_png_huff_len(cfreq, 19, 7, plan->clen);
+    for (plan->ncl = 19;
+         4 < plan->ncl && 0 == plan->clen[_io_png_cl_order[plan->ncl - 1]];
+         plan->ncl--);
+
+    /* compressed and stored sizes, in bits */
+    bits = 3 + 5 + 5 + 4 + 3 * plan->ncl;
+    for (i = 0; i < plan->nrle; i++)
+        bits += plan->clen[plan->rle[i]]
+            + (16 == plan->rle[i] ? 2 : 17 == plan->rle[i] ? 3
+               : 18 == plan->rle[i] ? 7 : 0);
+    for (k = 0; k < ntok; k++) {
+        bits += plan->llen[tok[k].sym];
+        if (256 < tok[k].sym)
+            bits += (_io_png_len_extra[tok[k].sym - 257]
+                     + plan->dlen[tok[k].dsym]
+                     + _io_png_dist_extra[tok[k].dsym]);
+    }
+    bits += plan->llen[256];
+    stored = 8 * (size + 5 * ((size + 65534) / 65535)) + 7;
+
+    plan->stored = (stored <= bits);
+    plan->bits = (plan->stored ? stored : bits);
+    return plan->bits;
+}
+
+/**
+ * @brief write a deflate block, with a coding plan
+ *
+ * @param bw bit writer
+ * @param plan coding plan, from _io_png_block_plan()
+ * @param tok block symbols
+ * @param ntok number of symbols
+ * @param raw block data, uncompressed
+ * @param size block data size
+ * @param last last block
+ */
+static void _io_png_block_write(_io_png_bits_t * bw,
+                                const _io_png_plan_t * plan,
+                                const _io_png_tok_t * tok, size_t ntok,
+                                const png_byte * raw, size_t size, int last)
+{
+    unsigned short lcode[286], dcode[30], ccode[19];
+    int i, n;
+    size_t k, len;
+    const _io_png_tok_t *t;
+    png_byte *out;
+    unsigned long acc;
+
+    /* room for the stored block(s), never smaller */
+    if (bw->max - bw->pos < plan->bits / 8 + 16) {
+        bw->max = 2 * bw->max + plan->bits / 8 + 16;
+        bw->out = _IO_PNG_SAFE_REALLOC(bw->out, bw->max, png_byte);
+    }
+
+    if (plan->stored) {
+        /* stored blocks, up to 65535 bytes */
+        do {
+            len = (65535 < size ? 65535 : size);
+            _io_png_bits_put(bw, (last && len == size ? 1 : 0), 1);
+            _io_png_bits_put(bw, 0, 2);
+            _io_png_bits_align(bw);
+            _io_png_bits_put(bw, (unsigned long) len, 16);
+            _io_png_bits_put(bw, (unsigned long) (len ^ 0xffff), 16);
+            memcpy(bw->out + bw->pos, raw, len);
+            bw->pos += len;
+            raw += len;
+            size -= len;
+        } while (0 < size);
+        return;
+    }
+
+    /* dynamic Huffman block header */
+    _io_png_huff_code(plan->llen, 286, lcode);
+    _io_png_huff_code(plan->dlen, 30, dcode);
+    _io_png_huff_code(plan->clen, 19, ccode);
+    _io_png_bits_put(bw, (last ? 1 : 0), 1);
+    _io_png_bits_put(bw, 2, 2);
+    _io_png_bits_put(bw, (unsigned long) (plan->nlit - 257), 5);
+    _io_png_bits_put(bw, (unsigned long) (plan->ndist - 1), 5);
+    _io_png_bits_put(bw, (unsigned long) (plan->ncl - 4), 4);
+    for (i = 0; i < plan->ncl; i++)
+        _io_png_bits_put(bw, plan->clen[_io_png_cl_order[i]], 3);
+    for (i = 0; i < plan->nrle; i++) {
+        _io_png_bits_put(bw, ccode[plan->rle[i]], plan->clen[plan->rle[i]]);
+        if (16 <= plan->rle[i])
+            _io_png_bits_put(bw, plan->rle_ext[i],
+                             (16 == plan->rle[i] ? 2
+                              : 17 == plan->rle[i] ? 3 : 7));
+    }
+
+    /* symbols */
+    out = bw->out + bw->pos;
+    acc = bw->acc;
+    n = bw->n;
+    for (k = 0; k < ntok; k++) {
+        t = tok + k;
+        _IO_PNG_BITS_PUT(out, acc, n, lcode[t->sym], plan->llen[t->sym]);
+        if (256 < t->sym) {
+            _IO_PNG_BITS_PUT(out, acc, n, t->ext,
+                             _io_png_len_extra[t->sym - 257]);
+            _IO_PNG_BITS_PUT(out, acc, n, dcode[t->dsym],
+                             plan->dlen[t->dsym]);
+            _IO_PNG_BITS_PUT(out, acc, n, t->dext,
+                             _io_png_dist_extra[t->dsym]);
+        }
+    }
+    bw->pos = (size_t) (out - bw->out);
+    bw->acc = acc;
+    bw->n = n;
+    _io_png_bits_put(bw, lcode[256], plan->llen[256]);
+    return;
+}
+
+/**
+ * @brief write the zlib stream in IDAT chunks, then IEND
+ *
+ * This replaces png_write_row() and png_write_end().
+ *
+ * @param png_ptr libpng write structure, after png_write_info()
+ * @param zdata zlib stream
+ * @param zlen zlib stream size
+ */
+static void _io_png_write_zdata(png_structp png_ptr, const png_byte * zdata,
+                                size_t zlen)
+{
+    size_t off, len;
+
+    for (off = 0; off < zlen; off += len) {
+        len = (zlen - off < _IO_PNG_IDAT_SIZE ? zlen - off
+               : _IO_PNG_IDAT_SIZE);
+        png_write_chunk(png_ptr, (png_bytep) "IDAT", zdata + off, len);
+    }
+    png_write_chunk(png_ptr, (png_bytep) "IEND", NULL, 0);
+    return;
+}
+
+/*
+ * FAST ENCODER
+ */
+
+/*
+ * The fast encoder replaces zlib for the speed-oriented writes. Every
+ * row is filtered with Up, which is vectorized and does not depend on
+ * the pixel size, then the filtered data is compressed by a greedy
+ * LZ77 matcher with a single hash probe, in blocks of
+ * _IO_PNG_FAST_BLOCK symbols.
+ */
+
+/** @brief symbols per block */
+#define _IO_PNG_FAST_BLOCK 65536
+/** @brief hash table size, log2 */
+#define _IO_PNG_FAST_HBITS 15
+
+/**
+ * @brief compress data into a zlib stream with the fast encoder
+ *
+ * @param data data to compress
+ * @param size data size
+ * @param zlen compressed size
+ * @return zlib stream, allocated
+ */
+static png_byte *_io_png_fast_deflate(const png_byte * data, size_t size,
+                                      size_t * zlen)
+{
+    png_uint_32 *head;
+    _io_png_tok_t *tok, *t;
+    _io_png_bits_t bw;
+    _io_png_plan_t plan;
+    size_t pos, start, ntok, len, lim, dist, hsize, miss, probe;
+    png_uint_32 v, w;
+    unsigned long h;
+
+    /* stored blocks at worst */
+    _io_png_zlib_open(&bw, size + 11 * (size / 65535 + 2), 0);
+
+    hsize = (size_t) 1 << _IO_PNG_FAST_HBITS;
+    head = _IO_PNG_SAFE_MALLOC(hsize, png_uint_32);
+    memset(head, 0, hsize * sizeof(png_uint_32));
+    tok = _IO_PNG_SAFE_MALLOC(_IO_PNG_FAST_BLOCK, _io_png_tok_t);
+
+    /*
+     * the hash table keeps the low 32 bits of the last positions; a
+     * wrong position only gives a shorter match, checked anyway
+     */
+    pos = 0;
+    miss = 0;
+    probe = 0;
+    while (pos < size) {
+        start = pos;
+        for (ntok = 0; pos < size && ntok < _IO_PNG_FAST_BLOCK; ntok++) {
+            t = tok + ntok;
+            len = 0;
+            dist = 0;
+            if (pos + 4 <= size && pos >= probe) {
+                /*
+                 * one probe, the last position with the same hash of
+                 * the next 4 bytes, read in the machine byte order
+                 */
+                memcpy(&v, data + pos, 4);
+                h = (((unsigned long) v * 2654435761UL) & 0xffffffffUL)
+                    >> (32 - _IO_PNG_FAST_HBITS);
+                dist = (size_t) (((png_uint_32) pos - head[h])
+                                 & 0xffffffffUL);
+                head[h] = (png_uint_32) (pos & 0xffffffffUL);
+                if (0 < dist && dist <= pos && dist <= _IO_PNG_WINDOW) {
+                    memcpy(&w, data + pos - dist, 4);
+                    if (v == w) {
+                        lim = (258 < size - pos ? 258 : size - pos);
+                        for (len = 4; len < lim
+                             && data[pos - dist + len] == data[pos + len];
+                             len++);
+                    }
+                }
+            }
+            if (0 == len) {
+                t->sym = data[pos];
+                pos += 1;
+                /* after many misses, probe less often */
+                miss += 1;
+                if (pos > probe)
+                    probe = pos + (miss >> 5);
+                continue;
+            }
+            miss = 0;
+            _io_png_tok_match(t, len, dist);
+            pos += len;
+        }
+        (void) _io_png_block_plan(&plan, tok, ntok, pos - start);
+        _io_png_block_write(&bw, &plan, tok, ntok, data + start,
+                            pos - start, pos == size);
+    }
+    _io_png_zlib_close(&bw, data, size);
+
+    _io_png_free(head);
+    _io_png_free(tok);
+    *zlen = bw.pos;
+    return bw.out;
+}
+
+/**
+ * @brief write the image data with the fast encoder
+ *
+ * The rows are filtered with Up, compressed by _io_png_fast_deflate(),
+ * then the IDAT chunks and IEND are written, replacing png_write_row()
+ * and png_write_end().
+ *
+ * @param png_ptr libpng write structure, after png_write_info()
+ * @param png_data packed PNG rows, non-interlaced
+ * @param rowbytes, ny row size and number of rows
+ * @return void, abort() on error
+ */
+static void _io_png_write_fast(png_structp png_ptr, const png_byte * png_data,
+                               size_t rowbytes, size_t ny)
+{
+    png_byte *filt, *zdata;
+    size_t zlen, i;
+
+    /* the first row has no previous row, Up is None */
+    filt = _IO_PNG_SAFE_MALLOC(ny * (rowbytes + 1), png_byte);
+    _io_png_filter(filt, png_data, NULL, rowbytes, 1, _IO_PNG_FILTER_NONE);
+    for (i = 1; i < ny; i++)
+        _io_png_filter(filt + i * (rowbytes + 1), png_data + i * rowbytes,
+                       png_data + (i - 1) * rowbytes, rowbytes, 1,
+                       _IO_PNG_FILTER_UP);
+    zdata = _io_png_fast_deflate(filt, ny * (rowbytes + 1), &zlen);
+    _io_png_free(filt);
+
+    _io_png_write_zdata(png_ptr, zdata, zlen);
+    _io_png_free(zdata);
+    return;
+}
+
+/*
+ * ARCHIVE ENCODER
+ */
+
+/*
+ * The archive encoder spends CPU time for the smallest files. The
+ * image is first compressed by zlib at the maximum level with every
+ * filter choice and zlib strategy; then the data filtered with the
+ * two best filter choices is compressed again by an optimal parser:
+ * the LZ77 symbols of minimum cost are searched with a cost model
+ * updated from the previous parse, and the symbols are split in
+ * blocks where the Huffman tables change. The trials run in parallel
+ * with OpenMP. The wall clock time, shared by all the threads, is
+ * bounded by IO_PNG_ARCHIVE_BUDGET seconds per megabyte of image data,
+ * the trials started after this budget is used are skipped, and the
+ * smallest result is written.
+ */
+
+/** @brief filter choices: the 5 filter types, minimum sum, entropy */
+#define _IO_PNG_ARCH_NMODE 7
+/** @brief zlib strategies */
+#define _IO_PNG_ARCH_NSTRAT 3
+/** @brief optimal parser block size */
+#define _IO_PNG_ARCH_BLOCK 1048576
+/** @brief hash table size, log2 */
+#define _IO_PNG_ARCH_HBITS 16
+/** @brief hash chain length limit */
+#define _IO_PNG_ARCH_CHAIN 256
+/** @brief optimal parser iterations */
+#define _IO_PNG_ARCH_ITER 15
+/** @brief split points tried for every block */
+#define _IO_PNG_ARCH_NSPLIT 15
+/** @brief minimum number of symbols in a split block */
+#define _IO_PNG_ARCH_MINTOK 1024
+
+/** @brief match found by the optimal parser */
+typedef struct _io_png_match_s {
+    unsigned short len;         /* match length */
+    unsigned short dist;        /* match distance - 1 */
+} _io_png_match_t;
+
+/**
+ * @brief filter the image rows with a filter choice
+ *
+ * @param out filtered rows
+ * @param png_data packed PNG rows, non-interlaced
+ * @param rowbytes, ny row size and number of rows
+ * @param bpp bytes per pixel, at least one
+ * @param mode filter choice, a filter type, _IO_PNG_FILTER_PAETH + 1
+ *        for the minimum sum of absolute differences, or
+ *        _IO_PNG_FILTER_PAETH + 2 for the minimum entropy, for every
+ *        row
+ */
+static void _io_png_filter_mode(png_byte * out, const png_byte * png_data,
+                                size_t rowbytes, size_t ny, size_t bpp,
+                                int mode)
+{
+    png_byte *zero, *tmp, *row;
+    size_t hist[256];
+    double ent, best_ent;
+    size_t i, y;
+    int type;
 
-    /*
-     * set the read filter transforms, to get 8bit RGB whatever the
-     * original file may contain:
-     * PNG_TRANSFORM_PACKING       expand 1, 2 and 4-bit
-     *                             samples to bytes
-     * PNG_TRANSFORM_STRIP_16      chop 16-bit samples to
-     *                             8-bit
-     */
-    /* todo: handle 16bit? */
-    png_transform = (PNG_TRANSFORM_IDENTITY
-                     | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_STRIP_16);
+    zero = _IO_PNG_SAFE_MALLOC(rowbytes, png_byte);
+    memset(zero, 0, rowbytes);
+    tmp = _IO_PNG_SAFE_MALLOC(rowbytes + 1, png_byte);
+    for (y = 0; y < ny; y++) {
+        row = out + y * (rowbytes + 1);
+        if (_IO_PNG_FILTER_PAETH >= mode)
+            _io_png_filter(row, png_data + y * rowbytes,
+                           (0 == y ? zero : png_data + (y - 1) * rowbytes),
+                           rowbytes, bpp, mode);
+        else if (_IO_PNG_FILTER_PAETH + 1 == mode)
+            _io_png_filter_best(row, tmp, png_data + y * rowbytes,
+                                (0 == y ? zero
+                                 : png_data + (y - 1) * rowbytes),
+                                rowbytes, bpp, _IO_PNG_FILTER_PAETH + 1);
+        else {
+            /* the filter type with the lowest byte entropy */
+            best_ent = 0.;
+            for (type = _IO_PNG_FILTER_NONE; type <= _IO_PNG_FILTER_PAETH;
+                 type++) {
+                _io_png_filter(tmp, png_data + y * rowbytes,
+                               (0 == y ? zero
+                                : png_data + (y - 1) * rowbytes),
+                               rowbytes, bpp, type);
+                memset(hist, 0, sizeof(hist));
+                for (i = 1; i <= rowbytes; i++)
+                    hist[tmp[i]]++;
+                ent = 0.;
+                for (i = 0; i < 256; i++)
+                    if (0 < hist[i])
+                        ent -= (double) hist[i] * log((double) hist[i]);
+                if (_IO_PNG_FILTER_NONE == type || ent < best_ent) {
+                    best_ent = ent;
+                    memcpy(row, tmp, rowbytes + 1);
+                }
+            }
+        }
+    }
+    _io_png_free(tmp);
+    _io_png_free(zero);
+    return;
+}
 
-    /* convert palette to RGB */
-    png_set_palette_to_rgb(png_ptr);
+/**
+ * @brief compress data into a zlib stream with zlib
+ *
+ * @param data data to compress
+ * @param size data size
+ * @param level zlib compression level
+ * @param strategy zlib strategy
+ * @param zlen compressed size
+ * @return zlib stream, allocated
+ */
+static png_byte *_io_png_zlib_compress(const png_byte * data, size_t size,
+                                       int level, int strategy,
+                                       size_t * zlen)
+{
+    z_stream z;
+    png_byte *zdata;
+    size_t bound, len;
+    int ret;
 
-    /*
-     * read in the entire image at once
-     * then collect the image informations
-     */
-    png_read_png(png_ptr, info_ptr, png_transform, NULL);
-    nx = (size_t) png_get_image_width(png_ptr, info_ptr);
-    ny = (size_t) png_get_image_height(png_ptr, info_ptr);
-    nc = (size_t) png_get_channels(png_ptr, info_ptr);
-    size = nx * ny * nc;
-    row_pointers = png_get_rows(png_ptr, info_ptr);
-    rowbytes = (size_t) png_get_rowbytes(png_ptr, info_ptr);
-
-    /* dump the rows in a continuous array */
-    /* todo: first check if the data is continuous via row_pointers */
-    png_data = _IO_PNG_SAFE_MALLOC(size, png_byte);
-    for (i = 0; i < ny; i++)
-        memcpy((void *) (png_data + i * rowbytes),
-               (void *) row_pointers[i], rowbytes * sizeof(png_byte));
-
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-    if (stdin != fp)
-        (void) fclose(fp);
+    _io_png_zinit(&z);
+    if (Z_OK != deflateInit2(&z, level, Z_DEFLATED, 15, 9, strategy))
+        _IO_PNG_ABORT("zlib initialization error");
+    /* stored blocks at worst */
+    bound = size + 5 * (size / 16383 + 1) + 64;
+    zdata = _IO_PNG_SAFE_MALLOC(bound, png_byte);
+    z.next_out = zdata;
+    z.avail_out = (uInt) (bound > UINT_MAX ? UINT_MAX : bound);
+    /* feed the data by pieces, for the 32bit zlib counters */
+    do {
+        len = (size > (size_t) 1 << 30 ? (size_t) 1 << 30 : size);
+        z.next_in = (Bytef *) data;
+        z.avail_in = (uInt) len;
+        data += len;
+        size -= len;
+        do {
+            if (0 == z.avail_out) {
+                len = (size_t) (z.next_out - zdata);
+                bound *= 2;
+                zdata = _IO_PNG_SAFE_REALLOC(zdata, bound, png_byte);
+                z.next_out = zdata + len;
+                z.avail_out = (uInt) (bound - len > UINT_MAX ? UINT_MAX
+                                      : bound - len);
+            }
+            ret = deflate(&z, (0 == size ? Z_FINISH : Z_NO_FLUSH));
+        } while (0 != z.avail_in || (0 == size && Z_STREAM_END != ret));
+    } while (0 < size);
+    *zlen = (size_t) (z.next_out - zdata);
+    (void) deflateEnd(&z);
+    return zdata;
+}
 
-    /* convert to float */
-    /* todo: at the row step */
-    tmp = _io_png_byte2flt(png_data, nx * ny * nc);
-    free(png_data);
-    /* deinterlace RGBA RGBA RGBA to RRR GGG BBB AAA */
-    data = _io_png_inter(tmp, nx * ny, nc, DEINTERLACE);
-    free(tmp);
+/**
+ * @brief find the matches at every position of a block
+ *
+ * For every position, the matches are listed by increasing length
+ * and distance, every match longer than the closer ones.
+ *
+ * @param data data to compress
+ * @param start, end block position
+ * @param head hash table, last position + 1 for every hash
+ * @param prev hash chains, previous position + 1, by position modulo
+ *        the window size
+ * @param nmatch number of matches at every block position
+ * @param match matches, reallocated
+ * @param mmax size of the match array
+ * @return matches
+ */
+static _io_png_match_t *_io_png_arch_find(const png_byte * data,
+                                          size_t start, size_t end,
+                                          size_t * head, size_t * prev,
+                                          unsigned char *nmatch,
+                                          _io_png_match_t * match,
+                                          size_t * mmax)
+{
+    size_t pos, cand, len, best, lim, n, chain;
+    unsigned long h;
 
-    /* post-processing */
-    switch (opt) {
-    case IO_PNG_OPT_RGB:
-        if (4 == nc || 2 == nc) {
-            /* strip alpha channel ... */
-            data = _IO_PNG_SAFE_REALLOC(data, nx * ny * (nc - 1), float);
-            nc = (nc - 1);
+    n = 0;
+    for (pos = start; pos < end; pos++) {
+        nmatch[pos - start] = 0;
+        if (pos + 3 > end)
+            continue;
+        if (*mmax < n + 32) {
+            *mmax = 2 * *mmax + 32;
+            match = _IO_PNG_SAFE_REALLOC(match, *mmax, _io_png_match_t);
         }
-        if (1 == nc) {
-            /* gray->rgb */
-            data = _io_png_gray2rgb(data, nx * ny);
-            nc = 3;
+        /* walk the chain, insert the position */
+        h = (((unsigned long) data[pos] << 16 | (unsigned long) data[pos + 1]
+              << 8 | data[pos + 2]) * 2654435761UL & 0xffffffffUL)
+            >> (32 - _IO_PNG_ARCH_HBITS);
+        cand = head[h];
+        head[h] = pos + 1;
+        prev[pos % _IO_PNG_WINDOW] = cand;
+        lim = (258 < end - pos ? 258 : end - pos);
+        best = 2;
+        for (chain = 0; 0 < cand && chain < _IO_PNG_ARCH_CHAIN
+             && pos - (cand - 1) <= _IO_PNG_WINDOW && best < lim; chain++) {
+            cand -= 1;
+            if (data[cand + best] == data[pos + best]) {
+                for (len = 0; len < lim && data[cand + len] == data[pos + len];
+                     len++);
+                if (len > best) {
+                    best = len;
+                    match[n].len = (unsigned short) len;
+                    match[n].dist = (unsigned short) (pos - cand - 1);
+                    n++;
+                    nmatch[pos - start]++;
+                    if (32 <= nmatch[pos - start])
+                        break;
+                }
+            }
+            cand = prev[cand % _IO_PNG_WINDOW];
         }
-        break;
-    case IO_PNG_OPT_GRAY:
-        if (4 == nc || 2 == nc) {
-            /* strip alpha channel ... */
-            data = _IO_PNG_SAFE_REALLOC(data, nx * ny * (nc - 1), float);
-            nc = (nc - 1);
+    }
+    return match;
+}
+
+/**
+ * @brief symbol costs of a Huffman code, from the symbol frequencies
+ *
+ * @param freq symbol frequencies, NULL for the fixed Huffman code
+ * @param n number of symbols
+ * @param cost symbol costs, in bits
+ */
+static void _io_png_arch_cost(const size_t * freq, int n, float *cost)
+{
+    size_t total;
+    int i;
+
+    if (NULL == freq) {
+        /* fixed Huffman code */
+        for (i = 0; i < n; i++)
+            cost[i] = (30 == n ? 5.f : 144 > i ? 8.f : 256 > i ? 9.f
+                       : 280 > i ? 7.f : 8.f);
+        return;
+    }
+    total = 0;
+    for (i = 0; i < n; i++)
+        total += freq[i];
+    for (i = 0; i < n; i++)
+        cost[i] = (float) (log((double) total
+                               / (0 < freq[i] ? (double) freq[i] : .5))
+                           / log(2.));
+    return;
+}
+
+/**
+ * @brief minimum cost parse of a block
+ *
+ * @param data data to compress
+ * @param start, end block position
+ * @param nmatch, match matches at every block position
+ * @param lcost, dcost literal/length and distance costs
+ * @param cost, from work space, end - start + 1 values
+ * @param tok parsed symbols
+ * @return number of symbols
+ */
+static size_t _io_png_arch_parse(const png_byte * data, size_t start,
+                                 size_t end, const unsigned char *nmatch,
+                                 const _io_png_match_t * match,
+                                 const float *lcost, const float *dcost,
+                                 double *cost, _io_png_match_t * from,
+                                 _io_png_tok_t * tok)
+{
+    float lencost[259];
+    double c, cd;
+    size_t n, pos, len, l0, k, ntok;
+    int i, code;
+    const _io_png_match_t *m;
+
+    for (len = 3; len <= 258; len++) {
+        code = _io_png_len_code(len);
+        lencost[len] = lcost[257 + code] + _io_png_len_extra[code];
+    }
+    n = end - start;
+    cost[0] = 0.;
+    for (k = 1; k <= n; k++)
+        cost[k] = 1e30;
+
+    /* forward, the best way to reach every position */
+    m = match;
+    for (k = 0; k < n; k++) {
+        pos = start + k;
+        c = cost[k] + lcost[data[pos]];
+        if (c < cost[k + 1]) {
+            cost[k + 1] = c;
+            from[k + 1].len = 1;
         }
-        if (3 == nc) {
-            /* rgb->gray */
-            data = _io_png_rgb2gray(data, nx * ny * nc);
-            nc = 1;
+        l0 = 3;
+        for (i = 0; i < nmatch[k]; i++, m++) {
+            code = _io_png_dist_code((size_t) m->dist + 1);
+            cd = cost[k] + dcost[code] + _io_png_dist_extra[code];
+            /* long repeats, only the full length */
+            if (258 == m->len)
+                l0 = 258;
+            for (len = l0; len <= m->len; len++) {
+                c = cd + lencost[len];
+                if (c < cost[k + len]) {
+                    cost[k + len] = c;
+                    from[k + len].len = (unsigned short) len;
+                    from[k + len].dist = m->dist;
+                }
+            }
+            l0 = (size_t) m->len + 1;
         }
-        break;
-    case IO_PNG_OPT_NONE:
-        /* do nothing */
-        break;
-    default:
-        _IO_PNG_ABORT("unsupported preprocessing option");
     }
 
-    *nxp = nx;
-    *nyp = ny;
-    *ncp = nc;
-    return data;
+    /* backward, the symbols in reverse order */
+    ntok = 0;
+    for (k = n; 0 < k; k -= from[k].len)
+        ntok++;
+    n = ntok;
+    for (k = end - start; 0 < k; k -= from[k].len) {
+        ntok--;
+        if (1 == from[k].len) {
+            tok[ntok].sym = data[start + k - 1];
+            continue;
+        }
+        _io_png_tok_match(tok + ntok, from[k].len, (size_t) from[k].dist + 1);
+    }
+    return n;
 }
 
 /**
- * @brief read a PNG file into a float array with some options
+ * @brief split the symbols in blocks and write them
  *
- * The image is read into an array with the deinterlaced channels,
- * with values in [0,1]. The option parameter is a string whose
- * content defines the filters applied to the image data:
- * - "": do nothing
- * - "rgb": strip the alpha channel, convert gray images to rgb
- * - "gray": strip the alpha channel, convert rgb images to gray
+ * The symbols are split at the point, among _IO_PNG_ARCH_NSPLIT
+ * evenly spaced ones, giving the smallest total size, then both parts
+ * are split again, until splitting does not reduce the size.
  *
- * @param fname PNG file name
- * @param nxp, nyp, ncp pointers to variables to be filled with the number of
- *        columns, lines and channels of the image, if not NULL
- * @param opt post-processing opt
- * @return pointer to an array of pixels, abort() on error
+ * @param bw bit writer
+ * @param tok symbols
+ * @param ntok number of symbols
+ * @param raw uncompressed data
+ * @param last last block
  */
-float *io_png_read_flt_opt(const char *fname,
-                           size_t * nxp, size_t * nyp, size_t * ncp,
-                           io_png_opt_t opt)
+static void _io_png_arch_split(_io_png_bits_t * bw,
+                               const _io_png_tok_t * tok, size_t ntok,
+                               const png_byte * raw, int last)
 {
-    float *flt_data;
-    size_t nx, ny, nc;
+    _io_png_plan_t plan;
+    size_t size, lsize, k, s, best_k, best_lsize, bits, best_bits;
+    int i;
 
-    if (NULL == fname)
-        _IO_PNG_ABORT("bad parameters");
+    size = 0;
+    for (k = 0; k < ntok; k++)
+        size += _io_png_tok_size(tok + k);
+    best_bits = _io_png_block_plan(&plan, tok, ntok, size);
+    best_k = 0;
+    best_lsize = 0;
+    if (2 * _IO_PNG_ARCH_MINTOK <= ntok) {
+        k = 0;
+        lsize = 0;
+        for (i = 1; i <= _IO_PNG_ARCH_NSPLIT; i++) {
+            s = _IO_PNG_ARCH_MINTOK + (ntok - 2 * _IO_PNG_ARCH_MINTOK)
+                * (size_t) i / (_IO_PNG_ARCH_NSPLIT + 1);
+            for (; k < s; k++)
+                lsize += _io_png_tok_size(tok + k);
+            bits = (_io_png_block_plan(&plan, tok, s, lsize)
+                    + _io_png_block_plan(&plan, tok + s, ntok - s,
+                                         size - lsize));
+            if (bits < best_bits) {
+                best_bits = bits;
+                best_k = s;
+                best_lsize = lsize;
+            }
+        }
+    }
+    if (0 == best_k) {
+        (void) _io_png_block_plan(&plan, tok, ntok, size);
+        _io_png_block_write(bw, &plan, tok, ntok, raw, size, last);
+        return;
+    }
+    _io_png_arch_split(bw, tok, best_k, raw, 0);
+    _io_png_arch_split(bw, tok + best_k, ntok - best_k, raw + best_lsize,
+                       last);
+    return;
+}
 
-    flt_data = _io_png_read(fname, &nx, &ny, &nc, opt);
+/**
+ * @brief compress data into a zlib stream with the optimal parser
+ *
+ * @param data data to compress
+ * @param size data size
+ * @param t0, budget start time and wall clock time budget, in seconds
+ * @param zlen compressed size
+ * @return zlib stream, allocated, or NULL if the budget is used
+ */
+static png_byte *_io_png_arch_deflate(const png_byte * data, size_t size,
+                                      double t0, double budget,
+                                      size_t * zlen)
+{
+    _io_png_bits_t bw;
+    _io_png_plan_t plan;
+    _io_png_match_t *match, *from;
+    _io_png_tok_t *tok, *best_tok;
+    unsigned char *nmatch;
+    size_t *head, *prev;
+    double *cost;
+    float lcost[286], dcost[30];
+    size_t lfreq[286], dfreq[30];
+    size_t start, end, n, ntok, best_ntok, bits, best_bits, mmax, k;
+    int iter;
 
-    if (NULL != nxp)
-        *nxp = nx;
-    if (NULL != nyp)
-        *nyp = ny;
-    if (NULL != ncp)
-        *ncp = nc;
-    return flt_data;
+    _io_png_zlib_open(&bw, size / 2, 3);
+    n = (size < _IO_PNG_ARCH_BLOCK ? size : _IO_PNG_ARCH_BLOCK);
+    head = _IO_PNG_SAFE_MALLOC((size_t) 1 << _IO_PNG_ARCH_HBITS, size_t);
+    memset(head, 0, ((size_t) 1 << _IO_PNG_ARCH_HBITS) * sizeof(size_t));
+    prev = _IO_PNG_SAFE_MALLOC(_IO_PNG_WINDOW, size_t);
+    nmatch = _IO_PNG_SAFE_MALLOC(n, unsigned char);
+    mmax = n;
+    match = _IO_PNG_SAFE_MALLOC(mmax, _io_png_match_t);
+    cost = _IO_PNG_SAFE_MALLOC(n + 1, double);
+    from = _IO_PNG_SAFE_MALLOC(n + 1, _io_png_match_t);
+    tok = _IO_PNG_SAFE_MALLOC(n, _io_png_tok_t);
+    best_tok = _IO_PNG_SAFE_MALLOC(n, _io_png_tok_t);
+
+    for (start = 0; start < size; start = end) {
+        if (_io_png_wall() - t0 > budget) {
+            _io_png_free(bw.out);
+            bw.out = NULL;
+            break;
+        }
+        end = (size - start < _IO_PNG_ARCH_BLOCK ? size
+               : start + _IO_PNG_ARCH_BLOCK);
+        match = _io_png_arch_find(data, start, end, head, prev, nmatch,
+                                  match, &mmax);
+
+        /* first parse with the fixed Huffman costs */
+        _io_png_arch_cost(NULL, 286, lcost);
+        _io_png_arch_cost(NULL, 30, dcost);
+        best_bits = 0;
+        best_ntok = 0;
+        for (iter = 0; iter < _IO_PNG_ARCH_ITER; iter++) {
+            ntok = _io_png_arch_parse(data, start, end, nmatch, match,
+                                      lcost, dcost, cost, from, tok);
+            bits = _io_png_block_plan(&plan, tok, ntok, end - start);
+            if (0 < iter && bits >= best_bits)
+                break;
+            best_bits = bits;
+            best_ntok = ntok;
+            memcpy(best_tok, tok, ntok * sizeof(_io_png_tok_t));
+            if (_io_png_wall() - t0 > budget)
+                break;
+            /* next parse with the costs of this one */
+            memset(lfreq, 0, sizeof(lfreq));
+            memset(dfreq, 0, sizeof(dfreq));
+            for (k = 0; k < ntok; k++) {
+                lfreq[tok[k].sym]++;
+                if (256 < tok[k].sym)
+                    dfreq[tok[k].dsym]++;
+            }
+            lfreq[256] = 1;
+            _io_png_arch_cost(lfreq, 286, lcost);
+            _io_png_arch_cost(dfreq, 30, dcost);
+        }
+        _io_png_arch_split(&bw, best_tok, best_ntok, data + start,
+                           end == size);
+    }
+    if (NULL != bw.out)
+        _io_png_zlib_close(&bw, data, size);
+
+    _io_png_free(head);
+    _io_png_free(prev);
+    _io_png_free(nmatch);
+    _io_png_free(match);
+    _io_png_free(cost);
+    _io_png_free(from);
+    _io_png_free(tok);
+    _io_png_free(best_tok);
+    *zlen = bw.pos;
+    return bw.out;
 }
 
 /**
- * @brief read a PNG file into a float array
+ * @brief write the image data with the archive encoder
  *
- * The image is read into an array with the deinterlaced channels,
- * with values in [0,1].
+ * This replaces png_write_row() and png_write_end().
  *
- * @param fname PNG file name
- * @param nxp, nyp, ncp pointers to variables to be filled with the number of
- *        columns, lines and channels of the image
- * @return pointer to an array of pixels, abort() on error
+ * @param png_ptr libpng write structure, after png_write_info()
+ * @param png_data packed PNG rows, non-interlaced
+ * @param rowbytes, ny row size and number of rows
+ * @param bpp bytes per pixel, at least one
+ * @return void, abort() on error
  */
-float *io_png_read_flt(const char *fname,
-                       size_t * nxp, size_t * nyp, size_t * ncp)
+static void _io_png_write_arch(png_structp png_ptr, const png_byte * png_data,
+                               size_t rowbytes, size_t ny, size_t bpp)
 {
-    return io_png_read_flt_opt(fname, nxp, nyp, ncp, IO_PNG_OPT_NONE);
+    static const int strategy[_IO_PNG_ARCH_NSTRAT] =
+        { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+    png_byte *zdata[_IO_PNG_ARCH_NMODE * _IO_PNG_ARCH_NSTRAT + 2];
+    size_t zlen[_IO_PNG_ARCH_NMODE * _IO_PNG_ARCH_NSTRAT + 2];
+    int mode[2];
+    png_byte *filt;
+    size_t size;
+    double t0, budget;
+    long kk;
+    int ntrial, best, k;
+
+    t0 = _io_png_wall();
+    size = ny * (rowbytes + 1);
+    budget = (double) IO_PNG_ARCHIVE_BUDGET * (double) size / 1048576.;
+    ntrial = _IO_PNG_ARCH_NMODE * _IO_PNG_ARCH_NSTRAT;
+
+    /*
+     * zlib trials, the minimum sum and entropy choices first, the
+     * first one even without budget
+     */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(filt) \
+    _IO_PNG_COPYIN
+#endif
+    for (kk = 0; kk < (long) ntrial; kk++) {
+        zdata[kk] = NULL;
+        if (0 < kk && _io_png_wall() - t0 > budget)
+            continue;
+        filt = _IO_PNG_SAFE_MALLOC(size, png_byte);
+        _io_png_filter_mode(filt, png_data, rowbytes, ny, bpp,
+                            (_IO_PNG_FILTER_PAETH + 1
+                             + (int) (kk / _IO_PNG_ARCH_NSTRAT))
+                            % _IO_PNG_ARCH_NMODE);
+        zdata[kk] = _io_png_zlib_compress(filt, size, 9,
+                                          strategy[kk % _IO_PNG_ARCH_NSTRAT],
+                                          zlen + kk);
+        _io_png_free(filt);
+    }
+
+    /* the two best filter choices, for the optimal parser */
+    mode[0] = -1;
+    mode[1] = -1;
+    for (k = 0; k < ntrial; k++) {
+        if (NULL == zdata[k])
+            continue;
+        if (-1 == mode[0] || zlen[k] < zlen[mode[0]]) {
+            if (-1 == mode[0]
+                || k / _IO_PNG_ARCH_NSTRAT != mode[0] / _IO_PNG_ARCH_NSTRAT)
+                mode[1] = mode[0];
+            mode[0] = k;
+        }
+        else if (k / _IO_PNG_ARCH_NSTRAT != mode[0] / _IO_PNG_ARCH_NSTRAT
+                 && (-1 == mode[1] || zlen[k] < zlen[mode[1]]))
+            mode[1] = k;
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(filt) \
+    _IO_PNG_COPYIN
+#endif
+    for (kk = 0; kk < 2; kk++) {
+        zdata[ntrial + kk] = NULL;
+        if (-1 == mode[kk])
+            continue;
+        filt = _IO_PNG_SAFE_MALLOC(size, png_byte);
+        _io_png_filter_mode(filt, png_data, rowbytes, ny, bpp,
+                            (_IO_PNG_FILTER_PAETH + 1
+                             + mode[kk] / _IO_PNG_ARCH_NSTRAT)
+                            % _IO_PNG_ARCH_NMODE);
+        zdata[ntrial + kk] = _io_png_arch_deflate(filt, size, t0, budget,
+                                                  zlen + ntrial + kk);
+        _io_png_free(filt);
+    }
+
+    /* keep the smallest */
+    best = -1;
+    for (k = 0; k < ntrial + 2; k++)
+        if (NULL != zdata[k] && (-1 == best || zlen[k] < zlen[best]))
+            best = k;
+    _io_png_write_zdata(png_ptr, zdata[best], zlen[best]);
+    for (k = 0; k < ntrial + 2; k++)
+        _io_png_free(zdata[k]);
+    return;
+}
+
+/*
+ * AUTO ENCODER
+ */
+
+/*
+ * The automatic mode chooses the encoder settings for every image. A
+ * few bands of rows are sampled and filtered with every filter
+ * choice; the choices giving the lowest byte entropy are kept, and
+ * the samples are compressed with them and a few zlib levels and
+ * strategies, and with the fast encoder. The sizes and the CPU times
+ * of the calling thread measured on the samples are extrapolated to
+ * the whole image, and the settings meeting the target are used to
+ * compress it: the fastest with IO_PNG_OPT_ZMIN, the smallest with
+ * IO_PNG_OPT_ZMAX, otherwise the smallest within IO_PNG_AUTO_BUDGET
+ * seconds per megabyte of image data.
+ */
+
+/** @brief number of sample bands */
+#define _IO_PNG_AUTO_NBAND 4
+/** @brief sample band size, in bytes */
+#define _IO_PNG_AUTO_BAND 16384
+/** @brief number of filter choices tried with zlib */
+#define _IO_PNG_AUTO_NMODE 2
+/** @brief number of zlib settings */
+#define _IO_PNG_AUTO_NZ 6
+
+/** @brief encoder settings, and their estimated cost */
+typedef struct _io_png_auto_s {
+    int mode;                   /* filter choice, -1 for the fast encoder */
+    int level;                  /* zlib compression level */
+    int strategy;               /* zlib strategy */
+    double size;                /* compressed size, in bytes */
+    double time;                /* CPU time, in seconds */
+} _io_png_auto_t;
+
+/**
+ * @brief byte entropy
+ *
+ * @param data data
+ * @param size data size
+ * @return entropy of the data bytes, in bits
+ */
+static double _io_png_auto_entropy(const png_byte * data, size_t size)
+{
+    size_t hist[256];
+    double ent;
+    size_t i;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < size; i++)
+        hist[data[i]]++;
+    ent = 0.;
+    for (i = 0; i < 256; i++)
+        if (0 < hist[i])
+            ent -= (double) hist[i] * log((double) hist[i] / (double) size);
+    return ent / log(2.);
 }
 
 /**
- * @brief read a PNG file into an unsigned char array with some options
+ * @brief choose the encoder settings from some sample bands
  *
- * The image is read into an array with the deinterlaced channels,
- * with values in [0,UCHAR_MAX]. See  io_png_read_flt_opt() for
- * details.
+ * @param png_data packed PNG rows, non-interlaced
+ * @param rowbytes, ny row size and number of rows
+ * @param bpp bytes per pixel, at least one
+ * @param opt IO_PNG_OPT_ZMIN for the fastest settings,
+ *        IO_PNG_OPT_ZMAX for the smallest
+ * @return encoder settings
  */
-unsigned char *io_png_read_uchar_opt(const char *fname,
-                                     size_t * nxp, size_t * nyp, size_t * ncp,
-                                     io_png_opt_t opt)
+static _io_png_auto_t _io_png_auto_plan(const png_byte * png_data,
+                                        size_t rowbytes, size_t ny,
+                                        size_t bpp, io_png_opt_t opt)
 {
-    float *flt_data;
-    unsigned char *data;
-    size_t nx, ny, nc;
+    static const int zset[_IO_PNG_AUTO_NZ][2] = {
+        {1, Z_DEFAULT_STRATEGY}, {6, Z_DEFAULT_STRATEGY},
+        {9, Z_DEFAULT_STRATEGY}, {6, Z_FILTERED}, {9, Z_FILTERED},
+        {6, Z_RLE}
+    };
+    _io_png_auto_t trial[_IO_PNG_AUTO_NMODE * _IO_PNG_AUTO_NZ + 1];
+    _io_png_auto_t best;
+    double ent[_IO_PNG_ARCH_NMODE], ftime[_IO_PNG_ARCH_NMODE];
+    int mode[_IO_PNG_AUTO_NMODE];
+    png_byte *filt, *zdata;
+    size_t band, nband, bsize, zlen, k;
+    double t, scale, budget;
+    int m, i, j, ntrial, smaller;
 
-    if (NULL == fname)
-        _IO_PNG_ABORT("bad parameters");
+    /* evenly spaced bands of rows, or the whole image */
+    band = _IO_PNG_AUTO_BAND / (rowbytes + 1);
+    band = (0 == band ? 1 : band);
+    nband = _IO_PNG_AUTO_NBAND;
+    if (nband * band >= ny) {
+        band = ny;
+        nband = 1;
+    }
+    bsize = band * (rowbytes + 1);
+    scale = (double) ny / (double) (nband * band);
+    filt = _IO_PNG_SAFE_MALLOC(nband * bsize, png_byte);
 
-    flt_data = _io_png_read(fname, &nx, &ny, &nc, opt);
-    data = _io_png_flt2uchar(flt_data, nx * ny * nc);
-    free(flt_data);
+    /* the filter choices with the lowest entropy */
+    for (m = 0; m < _IO_PNG_ARCH_NMODE; m++) {
+        t = _io_png_thread_cpu();
+        for (k = 0; k < nband; k++)
+            _io_png_filter_mode(filt + k * bsize,
+                                png_data + (0 == k ? 0
+                                            : (ny - band) * k / (nband - 1))
+                                * rowbytes, rowbytes, band, bpp, m);
+        ftime[m] = (_io_png_thread_cpu() - t) * scale;
+        ent[m] = _io_png_auto_entropy(filt, nband * bsize);
+    }
+    for (i = 0; i < _IO_PNG_AUTO_NMODE; i++) {
+        mode[i] = -1;
+        for (m = 0; m < _IO_PNG_ARCH_NMODE; m++)
+            if ((-1 == mode[i] || ent[m] < ent[mode[i]])
+                && (0 == i || m != mode[0]))
+                mode[i] = m;
+    }
 
-    if (NULL != nxp)
-        *nxp = nx;
-    if (NULL != nyp)
-        *nyp = ny;
-    if (NULL != ncp)
-        *ncp = nc;
-    return data;
+    /* trial compression, each band as an image */
+    ntrial = 0;
+    for (i = 0; i <= _IO_PNG_AUTO_NMODE; i++) {
+        /* the fast encoder filters with Up */
+        m = (_IO_PNG_AUTO_NMODE == i ? _IO_PNG_FILTER_UP : mode[i]);
+        for (k = 0; k < nband; k++)
+            _io_png_filter_mode(filt + k * bsize,
+                                png_data + (0 == k ? 0
+                                            : (ny - band) * k / (nband - 1))
+                                * rowbytes, rowbytes, band, bpp, m);
+        for (j = 0; j < (_IO_PNG_AUTO_NMODE == i ? 1 : _IO_PNG_AUTO_NZ);
+             j++) {
+            trial[ntrial].mode = (_IO_PNG_AUTO_NMODE == i ? -1 : m);
+            trial[ntrial].level = zset[j][0];
+            trial[ntrial].strategy = zset[j][1];
+            trial[ntrial].size = 0.;
+            t = _io_png_thread_cpu();
+            for (k = 0; k < nband; k++) {
+                zdata = (_IO_PNG_AUTO_NMODE == i
+                         ? _io_png_fast_deflate(filt + k * bsize, bsize,
+                                                &zlen)
+                         : _io_png_zlib_compress(filt + k * bsize, bsize,
+                                                 zset[j][0], zset[j][1],
+                                                 &zlen));
+                trial[ntrial].size += (double) zlen;
+                _io_png_free(zdata);
+            }
+            trial[ntrial].time = ((_io_png_thread_cpu() - t) * scale
+                                  + ftime[m]);
+            trial[ntrial].size *= scale;
+            ntrial++;
+        }
+    }
+    _io_png_free(filt);
+
+    /*
+     * the fastest, the smallest, or the smallest within the budget,
+     * else the fastest; sizes within 0.5% are the same, the faster
+     * settings are better
+     */
+    budget = (double) IO_PNG_AUTO_BUDGET * (double) (ny * (rowbytes + 1))
+        / 1048576.;
+    best = trial[0];
+    for (i = 1; i < ntrial; i++) {
+        smaller = (trial[i].size < .995 * best.size
+                   || (trial[i].size < 1.005 * best.size
+                       && trial[i].time < best.time));
+        if (opt & IO_PNG_OPT_ZMIN ? trial[i].time < best.time
+            : opt & IO_PNG_OPT_ZMAX ? smaller
+            : (trial[i].time <= budget
+               ? best.time > budget || smaller
+               : best.time > budget && trial[i].time < best.time))
+            best = trial[i];
+    }
+    return best;
 }
 
 /**
- * @brief read a PNG file into an unsigned char array
+ * @brief write the image data with automatic settings
  *
- * The array contains the de-interlaced channels, with values in
- * [0,UCHAR_MAX].
+ * This replaces png_write_row() and png_write_end().
  *
- * @param fname PNG file name
- * @param nxp, nyp, ncp pointers to variables to be filled with the number of
- *        columns, lines and channels of the image
- * @return pointer to an array of pixels, abort() on error
+ * @param png_ptr libpng write structure, after png_write_info()
+ * @param png_data packed PNG rows, non-interlaced
+ * @param rowbytes, ny row size and number of rows
+ * @param bpp bytes per pixel, at least one
+ * @param opt IO_PNG_OPT_ZMIN for the fastest settings,
+ *        IO_PNG_OPT_ZMAX for the smallest
+ * @return void, abort() on error
  */
-unsigned char *io_png_read_uchar(const char *fname,
-                                 size_t * nxp, size_t * nyp, size_t * ncp)
+static void _io_png_write_auto(png_structp png_ptr, const png_byte * png_data,
+                               size_t rowbytes, size_t ny, size_t bpp,
+                               io_png_opt_t opt)
 {
-    return io_png_read_uchar_opt(fname, nxp, nyp, ncp, IO_PNG_OPT_NONE);
+    _io_png_auto_t plan;
+    png_byte *filt, *zdata;
+    size_t zlen;
+
+    plan = _io_png_auto_plan(png_data, rowbytes, ny, bpp, opt);
+    if (-1 == plan.mode) {
+        _io_png_write_fast(png_ptr, png_data, rowbytes, ny);
+        return;
+    }
+    filt = _IO_PNG_SAFE_MALLOC(ny * (rowbytes + 1), png_byte);
+    _io_png_filter_mode(filt, png_data, rowbytes, ny, bpp, plan.mode);
+    zdata = _io_png_zlib_compress(filt, ny * (rowbytes + 1), plan.level,
+                                  plan.strategy, &zlen);
+    _io_png_free(filt);
+    _io_png_write_zdata(png_ptr, zdata, zlen);
+    _io_png_free(zdata);
+    return;
+}
+
+/*
+ * DEADLINE ENCODER
+ */
+
+/*
+ * The deadline encoder compresses the rows as they come, with the
+ * best filter for every row and the zlib filtered strategy, like
+ * libpng, within a wall clock time budget. The throughput is
+ * measured after every step of about 1/32 of the image data; the
+ * remaining time and data give the throughput needed for the rest of
+ * the image, and the compression level is changed with
+ * deflateParams() to the highest level expected to reach it, from
+ * the measured throughputs and a model of the relative zlib speeds
+ * for the unmeasured levels. The first step uses the default level.
+ */
+
+/** @brief minimum step between two level changes, in bytes */
+#define _IO_PNG_DL_STEP 16384
+
+/** @brief zlib relative speed model, by level */
+static const double _io_png_dl_speed[10] = {
+    30., 3., 2.8, 2.5, 1.8, 1.4, 1., .8, .5, .35
+};
+
+/** @brief deadline encoder state */
+typedef struct _io_png_dl_s {
+    png_structp png_ptr;        /* libpng write structure */
+    z_stream z;                 /* zlib stream */
+    png_byte *out;              /* IDAT buffer */
+    png_byte *prev;             /* previous row */
+    png_byte *filt, *tmp;       /* filtered row, work space */
+    size_t rowbytes, bpp;       /* row and pixel sizes */
+    size_t size, done, step;    /* data sizes, in bytes */
+    size_t mark;                /* data size at the last level change */
+    double t0, deadline, tmark; /* times, in seconds */
+    double rate[10];            /* measured throughput, by level */
+    int level;                  /* current compression level */
+} _io_png_dl_t;
+
+/**
+ * @brief deadline encoder time budget
+ *
+ * @return IO_PNG_DEADLINE seconds, or the IO_PNG_DEADLINE environment
+ *         variable if set
+ */
+static double _io_png_dl_budget(void)
+{
+    const char *env;
+    double budget;
+
+    budget = (double) IO_PNG_DEADLINE;
+    if (NULL != (env = getenv("IO_PNG_DEADLINE")))
+        budget = atof(env);
+    return budget;
 }
 
 /**
- * @brief read a PNG file into an unsigned short array with some options
+ * @brief write the IDAT buffer when full, to make room for the
+ *        compressed data
  *
- * The image is read into an array with the deinterlaced channels,
- * with values in [0,USHRT_MAX]. See  io_png_read_uchar_opt() for
- * details.
+ * @param dl deadline encoder
+ * @param all write the partial buffer too
  */
-unsigned short *io_png_read_ushrt_opt(const char *fname,
-                                      size_t * nxp, size_t * nyp,
-                                      size_t * ncp, io_png_opt_t opt)
+static void _io_png_dl_flush(_io_png_dl_t * dl, int all)
 {
-    float *flt_data;
-    unsigned short *data;
-    size_t nx, ny, nc;
+    if (0 == dl->z.avail_out
+        || (all && _IO_PNG_IDAT_SIZE > dl->z.avail_out)) {
+        png_write_chunk(dl->png_ptr, (png_bytep) "IDAT", dl->out,
+                        _IO_PNG_IDAT_SIZE - dl->z.avail_out);
+        dl->z.next_out = dl->out;
+        dl->z.avail_out = _IO_PNG_IDAT_SIZE;
+    }
+    return;
+}
 
-    if (NULL == fname)
-        _IO_PNG_ABORT("bad parameters");
+/**
+ * @brief start the deadline encoder
+ *
+ * @param dl deadline encoder
+ * @param png_ptr libpng write structure, after png_write_info()
+ * @param rowbytes, ny row size and number of rows
+ * @param bpp bytes per pixel, at least one
+ * @param t0 start time, from _io_png_wall()
+ */
+static void _io_png_dl_open(_io_png_dl_t * dl, png_structp png_ptr,
+                            size_t rowbytes, size_t ny, size_t bpp,
+                            double t0)
+{
+    int l;
 
-    flt_data = _io_png_read(fname, &nx, &ny, &nc, opt);
-    data = _io_png_flt2ushrt(flt_data, nx * ny * nc);
-    free(flt_data);
+    dl->png_ptr = png_ptr;
+    dl->rowbytes = rowbytes;
+    dl->bpp = bpp;
+    dl->size = ny * (rowbytes + 1);
+    dl->done = 0;
+    dl->step = dl->size / 32;
+    dl->step = (_IO_PNG_DL_STEP > dl->step ? _IO_PNG_DL_STEP : dl->step);
+    dl->mark = 0;
+    dl->t0 = t0;
+    dl->deadline = _io_png_dl_budget();
+    dl->tmark = _io_png_wall();
+    for (l = 0; l < 10; l++)
+        dl->rate[l] = 0.;
+    dl->level = 6;
 
-    if (NULL != nxp)
-        *nxp = nx;
-    if (NULL != nyp)
-        *nyp = ny;
-    if (NULL != ncp)
-        *ncp = nc;
-    return data;
+    /* the previous row of the first row is filled with 0 */
+    dl->prev = _IO_PNG_SAFE_MALLOC(rowbytes, png_byte);
+    memset(dl->prev, 0, rowbytes);
+    dl->filt = _IO_PNG_SAFE_MALLOC(rowbytes + 1, png_byte);
+    dl->tmp = _IO_PNG_SAFE_MALLOC(rowbytes + 1, png_byte);
+    dl->out = _IO_PNG_SAFE_MALLOC(_IO_PNG_IDAT_SIZE, png_byte);
+
+    _io_png_zinit(&dl->z);
+    if (Z_OK != deflateInit2(&dl->z, dl->level, Z_DEFLATED, 15, 8,
+                             Z_FILTERED))
+        _IO_PNG_ABORT("zlib initialization error");
+    dl->z.next_out = dl->out;
+    dl->z.avail_out = _IO_PNG_IDAT_SIZE;
+    return;
 }
 
 /**
- * @brief read a PNG file into an unsigned short array
+ * @brief change the compression level for the deadline
  *
- * The array contains the de-interlaced channels, with values in
- * [0,USHRT_MAX].
+ * @param dl deadline encoder
+ */
+static void _io_png_dl_adjust(_io_png_dl_t * dl)
+{
+    double now, need, rate;
+    int l, level;
+
+    /* measured throughput of the current level */
+    now = _io_png_wall();
+    if (now > dl->tmark)
+        dl->rate[dl->level] = (double) (dl->done - dl->mark)
+            / (now - dl->tmark);
+    else if (0. == dl->rate[dl->level])
+        dl->rate[dl->level] = 1e12;
+
+    /* throughput needed, with a margin, then the best level for it */
+    need = (dl->t0 + dl->deadline > now
+            ? 1.1 * (double) (dl->size - dl->done)
+            / (dl->t0 + dl->deadline - now) : 1e30);
+    level = 0;
+    for (l = 9; 0 < l; l--) {
+        rate = (0. < dl->rate[l] ? dl->rate[l]
+                : dl->rate[dl->level] * _io_png_dl_speed[l]
+                / _io_png_dl_speed[dl->level]);
+        if (rate >= need) {
+            level = l;
+            break;
+        }
+    }
+
+    /* change the level, the data given so far is compressed first */
+    if (level != dl->level) {
+        while (Z_BUF_ERROR == deflateParams(&dl->z, level, Z_FILTERED))
+            _io_png_dl_flush(dl, 0);
+        dl->level = level;
+    }
+    dl->mark = dl->done;
+    dl->tmark = _io_png_wall();
+    return;
+}
+
+/**
+ * @brief compress a row with the deadline encoder
  *
- * @param fname PNG file name
- * @param nxp, nyp, ncp pointers to variables to be filled with the number of
- *        columns, lines and channels of the image
- * @return pointer to an array of pixels, abort() on error
+ * @param dl deadline encoder
+ * @param row packed PNG row
  */
-unsigned short *io_png_read_ushrt(const char *fname,
-                                  size_t * nxp, size_t * nyp, size_t * ncp)
+static void _io_png_dl_row(_io_png_dl_t * dl, const png_byte * row)
+{
+    _io_png_filter_best(dl->filt, dl->tmp, row, dl->prev, dl->rowbytes,
+                        dl->bpp, _IO_PNG_FILTER_PAETH + 1);
+    memcpy(dl->prev, row, dl->rowbytes);
+    dl->z.next_in = dl->filt;
+    dl->z.avail_in = (uInt) (dl->rowbytes + 1);
+    while (0 < dl->z.avail_in) {
+        _io_png_dl_flush(dl, 0);
+        if (Z_OK != deflate(&dl->z, Z_NO_FLUSH))
+            _IO_PNG_ABORT("zlib compression error");
+    }
+    dl->done += dl->rowbytes + 1;
+    if (dl->done - dl->mark >= dl->step && dl->done < dl->size)
+        _io_png_dl_adjust(dl);
+    return;
+}
+
+/**
+ * @brief end the deadline encoder, write the last IDAT chunks and
+ *        IEND
+ *
+ * This replaces png_write_end().
+ *
+ * @param dl deadline encoder
+ */
+static void _io_png_dl_close(_io_png_dl_t * dl)
 {
-    return io_png_read_ushrt_opt(fname, nxp, nyp, ncp, IO_PNG_OPT_NONE);
+    int ret;
+
+    do {
+        _io_png_dl_flush(dl, 0);
+        ret = deflate(&dl->z, Z_FINISH);
+        if (Z_OK != ret && Z_STREAM_END != ret)
+            _IO_PNG_ABORT("zlib compression error");
+    } while (Z_STREAM_END != ret);
+    _io_png_dl_flush(dl, 1);
+    (void) deflateEnd(&dl->z);
+    png_write_chunk(dl->png_ptr, (png_bytep) "IEND", NULL, 0);
+    _io_png_free(dl->prev);
+    _io_png_free(dl->filt);
+    _io_png_free(dl->tmp);
+    _io_png_free(dl->out);
+    return;
 }
 
-/*
- * WRITE
+/**
+ * @brief check the exclusive write options
+ *
+ * The IDAT index, the fast, archive, automatic and deadline encoders
+ * are for non-interlaced images, and exclusive: at most one of them
+ * and Adam7 can be set.
+ *
+ * @param opt processing option
+ * @return void, abort() on error
  */
+static void _io_png_wr_opt_check(io_png_opt_t opt)
+{
+    int enc;
+
+    enc = (int) opt & (IO_PNG_OPT_ADAM7 | IO_PNG_OPT_INDEX
+                       | IO_PNG_OPT_FAST | IO_PNG_OPT_ARCHIVE
+                       | IO_PNG_OPT_AUTO | IO_PNG_OPT_DEADLINE);
+    /* more than one bit set */
+    if (0 != (enc & (enc - 1)))
+        _IO_PNG_ABORT("bad parameters");
+    return;
+}
 
 /**
  * @brief internal function used to write a byte array as a PNG file
@@ -683,61 +4698,77 @@ unsigned short *io_png_read_ushrt(const char *fname,
  * gray, gray+alpha, rgb, rgb+alpha.
  *
  * @param fname PNG file name, "-" means stdout
- * @param data non interlaced (RRRGGGBBBAAA) float image array
+ * @param data non interlaced (RRRGGGBBBAAA) image array
  * @param nx, ny, nc number of columns, lines and channels
  * @param opt processing option, can be IO_PNG_OPT_ADAM7,
- *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
- *         IO_PNG_OPT_NONE to do nothing
+ *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX, IO_PNG_OPT_INDEX,
+ *         IO_PNG_OPT_FAST, IO_PNG_OPT_ARCHIVE, IO_PNG_OPT_AUTO,
+ *         IO_PNG_OPT_DEADLINE, IO_PNG_OPT_NONE to do nothing
+ * @param type input data type, _IO_PNG_FLT, _IO_PNG_UCHAR or
+ *        _IO_PNG_USHRT
  * @return void, abort() on error
  *
  * @todo handle 16bit
  */
-static void _io_png_write(const char *fname, const float *data,
-                          size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+static void _io_png_write(const char *fname, const void *data,
+                          size_t nx, size_t ny, size_t nc, io_png_opt_t opt,
+                          int type)
 {
     png_structp png_ptr;
     png_infop info_ptr;
-    png_bytep *row_pointers;
     png_byte *png_data;
+    /* stack buffer, for the small images */
+    png_byte png_small[IO_PNG_SMALL_SIZE];
     png_byte bit_depth;
-    float *tmp;
     /* volatile: because of setjmp/longjmp */
     FILE *volatile fp;
-    int color_type, interlace, compression, compression_level, filter;
-    size_t i;
+    int color_type, interlace, compression, filter;
+    int pass, npass;
+    _io_png_wr_kern_t kern;
+    size_t i, size, nrow;
+    int whole;
+    _io_png_dl_t dl;
+    double t0;
     /* error structure */
     _io_png_err_t err;
 
+    t0 = _io_png_wall();
     assert(NULL != fname && NULL != data && 0 < nx && 0 < ny && 0 < nc);
+    _IO_PNG_TM_BEGIN();
+    _IO_PNG_MEM_BEGIN();
+    if (4 < nc)
+        _IO_PNG_ABORT("bad parameters");
+    _io_png_wr_opt_check(opt);
 
-    /* interlace RRR GGG BBB AAA to RGBA RGBA RGBA */
-    tmp = _io_png_inter(data, nx * ny, nc, INTERLACE);
-    /* convert to png_byte */
-    png_data = _io_png_flt2byte(tmp, nx * ny * nc);
-    free(tmp);
+    /*
+     * the rows are interlaced RRR GGG BBB AAA to RGBA RGBA RGBA and
+     * converted to png_byte by a single kernel, into one row buffer
+     * when they are streamed to libpng, or into a whole image buffer
+     * for Adam7 and the built-in encoders, on the stack for the small
+     * images
+     */
+    whole = (0 != (opt & (IO_PNG_OPT_ADAM7 | IO_PNG_OPT_INDEX
+                          | IO_PNG_OPT_FAST | IO_PNG_OPT_ARCHIVE
+                          | IO_PNG_OPT_AUTO)));
+    nrow = (whole ? ny : 1);
+    png_data = (nx * nrow * nc <= IO_PNG_SMALL_SIZE ? png_small
+                : _IO_PNG_SAFE_MALLOC(nx * nrow * nc, png_byte));
+    kern = _io_png_kern()->wr[type][nc - 1];
+    size = _io_png_type_size[type];
+    _IO_PNG_TM_ENTER(_IO_PNG_TM_CONVERT);
+    if (whole)
+        for (i = 0; i < ny; i++)
+            kern(png_data + nc * nx * i,
+                 (const char *) data + nx * i * size, nx, nx * ny);
 
     /* open the PNG output file */
-    if (0 == strcmp(fname, "-")) {
-        fp = stdout;
-#ifdef WIN32                    /* set the stream to binary mode */
-        fflush(fp);
-        setmode(fileno(fp), O_BINARY);
-#endif
-    }
-    else {
-        if (NULL == (fp = fopen(fname, "wb")))
-            _IO_PNG_ABORT("failed to open file");
-    }
-    /* allocate the row pointers */
-    row_pointers = _IO_PNG_SAFE_MALLOC(ny, png_bytep);
-
+    _IO_PNG_TM_SWITCH(_IO_PNG_TM_OPEN);
+    fp = _io_png_fopen(fname, "wb");
     /*
      * create and initialize the png_struct and png_info structures
-     * with local error handling
+     * with local error handling and the current allocator
      */
-    if (NULL == (png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                                   &err, &_io_png_err_hdl,
-                                                   NULL)))
+    if (NULL == (png_ptr = _io_png_create_write(&err)))
         _IO_PNG_ABORT("libpng initialization error");
     if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
         _IO_PNG_ABORT("libpng initialization error");
@@ -747,26 +4778,11 @@ static void _io_png_write(const char *fname, const float *data,
         _IO_PNG_ABORT("libpng writing error");
 
     /* set up the input control using standard C streams */
-    png_init_io(png_ptr, fp);
+    _io_png_init_io(png_ptr, fp, 1);
 
     /* set image informations */
     bit_depth = 8;
-    switch (nc) {
-    case 1:
-        color_type = PNG_COLOR_TYPE_GRAY;
-        break;
-    case 2:
-        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
-        break;
-    case 3:
-        color_type = PNG_COLOR_TYPE_RGB;
-        break;
-    case 4:
-        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-        break;
-    default:
-        _IO_PNG_ABORT("bad parameters");
-    }
+    color_type = _io_png_color_type(nc);
 
     compression = PNG_COMPRESSION_TYPE_BASE;
     filter = PNG_FILTER_TYPE_BASE;
@@ -779,30 +4795,67 @@ static void _io_png_write(const char *fname, const float *data,
     png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
                  bit_depth, color_type, interlace, compression, filter);
 
-    compression_level = 5;
-    if (opt & IO_PNG_OPT_ZMIN)
-        compression_level = 0;
-    if (opt & IO_PNG_OPT_ZMAX)
-        compression_level = 9;
-    png_set_compression_level(png_ptr, compression_level);
+    png_set_compression_level(png_ptr, _io_png_zlevel(opt));
 
     /* TODO : significant bit (sBIT), gamma (gAMA) chunks */
     png_write_info(png_ptr, info_ptr);
 
-    /* set row pointers */
-    for (i = 0; i < ny; i++)
-        row_pointers[i] = (png_bytep) png_data + (size_t) (nc * nx * i);
-
-    /* write out the entire image and end it */
-    png_write_image(png_ptr, row_pointers);
-    png_write_end(png_ptr, info_ptr);
+    /* with an IDAT index, write the bands in parallel */
+    _IO_PNG_TM_SWITCH(_IO_PNG_TM_CODEC);
+    if (opt & IO_PNG_OPT_INDEX)
+        _io_png_write_idx(png_ptr, png_data, nx * nc, ny, nc,
+                          _io_png_zlevel(opt));
+    else if (opt & IO_PNG_OPT_FAST)
+        _io_png_write_fast(png_ptr, png_data, nx * nc, ny);
+    else if (opt & IO_PNG_OPT_ARCHIVE)
+        _io_png_write_arch(png_ptr, png_data, nx * nc, ny, nc);
+    else if (opt & IO_PNG_OPT_AUTO)
+        _io_png_write_auto(png_ptr, png_data, nx * nc, ny, nc, opt);
+    else if (whole) {
+        /* write out the entire image, one pass at a time, and end it */
+        npass = png_set_interlace_handling(png_ptr);
+        for (pass = 0; pass < npass; pass++)
+            for (i = 0; i < ny; i++)
+                png_write_row(png_ptr, png_data + nc * nx * i);
+        png_write_end(png_ptr, info_ptr);
+    }
+    else if (opt & IO_PNG_OPT_DEADLINE) {
+        /* convert and compress the rows, one at a time, and end it */
+        _io_png_dl_open(&dl, png_ptr, nx * nc, ny, nc, t0);
+        for (i = 0; i < ny; i++) {
+            _IO_PNG_TM_SWITCH(_IO_PNG_TM_CONVERT);
+            kern(png_data, (const char *) data + nx * i * size, nx,
+                 nx * ny);
+            _IO_PNG_TM_SWITCH(_IO_PNG_TM_CODEC);
+            _io_png_dl_row(&dl, png_data);
+        }
+        _io_png_dl_close(&dl);
+    }
+    else {
+        /* convert and write the rows, one at a time, and end it */
+        for (i = 0; i < ny; i++) {
+            _IO_PNG_TM_SWITCH(_IO_PNG_TM_CONVERT);
+            kern(png_data, (const char *) data + nx * i * size, nx,
+                 nx * ny);
+            _IO_PNG_TM_SWITCH(_IO_PNG_TM_CODEC);
+            png_write_row(png_ptr, png_data);
+        }
+        png_write_end(png_ptr, info_ptr);
+    }
 
-    /* clean up and free any memory allocated, close the file */
+    /*
+     * clean up and free any memory allocated, close the file, timed
+     * as I/O for the buffered data
+     */
+    _IO_PNG_TM_SWITCH(_IO_PNG_TM_CLOSE);
     png_destroy_write_struct(&png_ptr, &info_ptr);
-    free(row_pointers);
-    free(png_data);
-    if (stdout != fp)
-        (void) fclose(fp);
+    if (png_small != png_data)
+        _io_png_free(png_data);
+    _IO_PNG_TM_SWITCH(_IO_PNG_TM_IO);
+    _io_png_fclose(fp);
+    _IO_PNG_TM_LEAVE();
+    _IO_PNG_MEM_END(0);
+    _IO_PNG_TM_END(1);
 
     return;
 }
@@ -819,14 +4872,15 @@ static void _io_png_write(const char *fname, const float *data,
  * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
  * @param nx, ny, nc number of columns, lines and channels of the image
  * @param opt processing option, can be IO_PNG_OPT_ADAM7,
- *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
- *         IO_PNG_OPT_NONE to do nothing
+ *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX, IO_PNG_OPT_INDEX,
+ *         IO_PNG_OPT_FAST, IO_PNG_OPT_ARCHIVE, IO_PNG_OPT_AUTO,
+ *         IO_PNG_OPT_DEADLINE, IO_PNG_OPT_NONE to do nothing
  * @return void, abort() on error
  */
 void io_png_write_flt_opt(const char *fname, const float *data,
                           size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
 {
-    _io_png_write(fname, data, nx, ny, nc, opt);
+    _io_png_write(fname, data, nx, ny, nc, opt, _IO_PNG_FLT);
     return;
 }
 
@@ -857,11 +4911,7 @@ void io_png_write_flt(const char *fname, const float *data,
 void io_png_write_uchar_opt(const char *fname, const unsigned char *data,
                             size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
 {
-    float *flt_data;
-
-    flt_data = _io_png_uchar2flt(data, nx * ny * nc);
-    _io_png_write(fname, flt_data, nx, ny, nc, opt);
-    free(flt_data);
+    _io_png_write(fname, data, nx, ny, nc, opt, _IO_PNG_UCHAR);
     return;
 }
 
@@ -894,11 +4944,7 @@ void io_png_write_uchar(const char *fname, const unsigned char *data,
 void io_png_write_ushrt_opt(const char *fname, const unsigned short *data,
                             size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
 {
-    float *flt_data;
-
-    flt_data = _io_png_ushrt2flt(data, nx * ny * nc);
-    _io_png_write(fname, flt_data, nx, ny, nc, opt);
-    free(flt_data);
+    _io_png_write(fname, data, nx, ny, nc, opt, _IO_PNG_USHRT);
     return;
 }
 
@@ -922,3 +4968,552 @@ void io_png_write_ushrt(const char *fname, const unsigned short *data,
     io_png_write_ushrt_opt(fname, data, nx, ny, nc, IO_PNG_OPT_NONE);
     return;
 }
+
+/*
+ * TILED WRITE
+ */
+
+/**
+ * @brief tiled writer state
+ *
+ * The image is split in a grid of tiles, and the rows of tiles are
+ * the bands. Each band is buffered as interlaced png_byte rows from
+ * its first tile until it is complete and all the bands above it are
+ * written. The allocator current at the opening is used until the
+ * end.
+ */
+struct io_png_tiles_s {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    FILE *fp;
+    _io_png_err_t err;
+    size_t nx, ny, nc;          /* image size */
+    size_t tnx, tny;            /* tile size */
+    size_t ntx, nty;            /* number of tiles, per row and column */
+    png_byte **band;            /* band buffers, NULL when not needed */
+    size_t *count;              /* number of tiles received, per band */
+    unsigned char *done;        /* received flag, per tile */
+    size_t next;                /* next band to write */
+    const io_png_alloc_t *alloc;        /* allocator at the opening */
+};
+
+/**
+ * @brief open a PNG file to be written by tiles
+ *
+ * The image is split in tiles of tnx x tny pixels, except the last
+ * row and column of tiles which can be smaller. The tiles can be
+ * written in any order; memory is only used for the bands (rows of
+ * tiles) not yet complete or waiting for the bands above them.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @param tnx, tny number of columns and lines of the tiles
+ * @param opt processing option, can be IO_PNG_OPT_ZMIN or
+ *         IO_PNG_OPT_ZMAX, IO_PNG_OPT_NONE to do nothing; Adam7
+ *         interlacing, the IDAT index and the other encoders are not
+ *         available
+ * @return tiled writer, abort() on error
+ */
+io_png_tiles_t *io_png_tiles_open(const char *fname,
+                                  size_t nx, size_t ny, size_t nc,
+                                  size_t tnx, size_t tny, io_png_opt_t opt)
+{
+    io_png_tiles_t *tiles;
+    size_t i;
+
+    if (NULL == fname || 0 == nx || 0 == ny || 0 == nc
+        || 0 == tnx || 0 == tny)
+        _IO_PNG_ABORT("bad parameters");
+    /* the Adam7 passes need the whole image */
+    if (opt & IO_PNG_OPT_ADAM7)
+        _IO_PNG_ABORT("interlaced tiled write is not supported");
+    /* so do the IDAT index and the other encoders */
+    if (opt & (IO_PNG_OPT_INDEX | IO_PNG_OPT_FAST | IO_PNG_OPT_ARCHIVE
+               | IO_PNG_OPT_AUTO | IO_PNG_OPT_DEADLINE))
+        _IO_PNG_ABORT("encoder option not supported by the tiled write");
+
+    tiles = _IO_PNG_SAFE_MALLOC(1, io_png_tiles_t);
+    tiles->alloc = _io_png_cur_alloc;
+    tiles->nx = nx;
+    tiles->ny = ny;
+    tiles->nc = nc;
+    tiles->tnx = tnx;
+    tiles->tny = tny;
+    tiles->ntx = (nx + tnx - 1) / tnx;
+    tiles->nty = (ny + tny - 1) / tny;
+    tiles->band = _IO_PNG_SAFE_MALLOC(tiles->nty, png_byte *);
+    tiles->count = _IO_PNG_SAFE_MALLOC(tiles->nty, size_t);
+    for (i = 0; i < tiles->nty; i++) {
+        tiles->band[i] = NULL;
+        tiles->count[i] = 0;
+    }
+    tiles->done = _IO_PNG_SAFE_MALLOC(tiles->ntx * tiles->nty,
+                                      unsigned char);
+    memset(tiles->done, 0, tiles->ntx * tiles->nty);
+    tiles->next = 0;
+
+    /* open the PNG output file */
+    tiles->fp = _io_png_fopen(fname, "wb");
+
+    /*
+     * create and initialize the png_struct and png_info structures
+     * with local error handling and the current allocator
+     */
+    if (NULL == (tiles->png_ptr = _io_png_create_write(&tiles->err)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (tiles->info_ptr = png_create_info_struct(tiles->png_ptr)))
+        _IO_PNG_ABORT("libpng initialization error");
+
+    /* if we get here, we had a problem writing to the file */
+    if (0 != setjmp(tiles->err.jmpbuf))
+        _IO_PNG_ABORT("libpng writing error");
+
+    /* set up the output control, the header, and write it */
+    _io_png_init_io(tiles->png_ptr, tiles->fp, 1);
+    png_set_IHDR(tiles->png_ptr, tiles->info_ptr,
+                 (png_uint_32) nx, (png_uint_32) ny, 8,
+                 _io_png_color_type(nc), PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_set_compression_level(tiles->png_ptr, _io_png_zlevel(opt));
+    png_write_info(tiles->png_ptr, tiles->info_ptr);
+
+    return tiles;
+}
+
+/**
+ * @brief write a float tile
+ *
+ * The tile values are taken from the [0,1] interval and converted to
+ * 8bit data. When this tile completes the next bands to write, they
+ * are sent to the encoder and their buffers are released.
+ *
+ * @param tiles tiled writer
+ * @param data deinterlaced (RRR.GGG.BBB.AAA.) tile array, with
+ *        min(tnx, nx - tx * tnx) columns and min(tny, ny - ty * tny) lines
+ * @param tx, ty tile position, in the tile grid
+ * @return void, abort() on error
+ */
+void io_png_tiles_put_flt(io_png_tiles_t * tiles, const float *data,
+                          size_t tx, size_t ty)
+{
+    size_t x0, y0, w, h, i;
+    png_byte *band;
+    _io_png_wr_kern_t kern;
+    const io_png_alloc_t *prev;
+
+    if (NULL == tiles || NULL == data
+        || tx >= tiles->ntx || ty >= tiles->nty)
+        _IO_PNG_ABORT("bad parameters");
+    if (tiles->done[ty * tiles->ntx + tx])
+        _IO_PNG_ABORT("tile written twice");
+    tiles->done[ty * tiles->ntx + tx] = 1;
+    prev = io_png_set_alloc(tiles->alloc);
+
+    x0 = tx * tiles->tnx;
+    y0 = ty * tiles->tny;
+    w = (x0 + tiles->tnx <= tiles->nx ? tiles->tnx : tiles->nx - x0);
+    h = (y0 + tiles->tny <= tiles->ny ? tiles->tny : tiles->ny - y0);
+
+    /* copy the tile into its band, interlaced */
+    if (NULL == tiles->band[ty])
+        tiles->band[ty] = _IO_PNG_SAFE_MALLOC(tiles->nx * h * tiles->nc,
+                                              png_byte);
+    band = tiles->band[ty];
+    kern = _io_png_kern()->wr[_IO_PNG_FLT][tiles->nc - 1];
+    for (i = 0; i < h; i++)
+        kern(band + (tiles->nx * i + x0) * tiles->nc, data + w * i,
+             w, w * h);
+    tiles->count[ty] += 1;
+
+    /* if we get here, we had a problem writing to the file */
+    if (0 != setjmp(tiles->err.jmpbuf))
+        _IO_PNG_ABORT("libpng writing error");
+
+    /* stream the complete bands, in order */
+    while (tiles->next < tiles->nty
+           && tiles->ntx == tiles->count[tiles->next]) {
+        band = tiles->band[tiles->next];
+        h = (tiles->next + 1 < tiles->nty ? tiles->tny
+             : tiles->ny - tiles->next * tiles->tny);
+        for (i = 0; i < h; i++)
+            png_write_row(tiles->png_ptr,
+                          band + tiles->nx * tiles->nc * i);
+        _io_png_free(band);
+        tiles->band[tiles->next] = NULL;
+        tiles->next += 1;
+    }
+    (void) io_png_set_alloc(prev);
+    return;
+}
+
+/**
+ * @brief end the PNG file written by tiles
+ *
+ * All the tiles must have been written.
+ *
+ * @param tiles tiled writer, freed
+ * @return void, abort() on error
+ */
+void io_png_tiles_close(io_png_tiles_t * tiles)
+{
+    const io_png_alloc_t *prev;
+
+    if (NULL == tiles)
+        _IO_PNG_ABORT("bad parameters");
+    if (tiles->nty != tiles->next)
+        _IO_PNG_ABORT("missing tiles");
+    prev = io_png_set_alloc(tiles->alloc);
+
+    /* if we get here, we had a problem writing to the file */
+    if (0 != setjmp(tiles->err.jmpbuf))
+        _IO_PNG_ABORT("libpng writing error");
+
+    png_write_end(tiles->png_ptr, tiles->info_ptr);
+
+    /* clean up and free any memory allocated, close the file */
+    png_destroy_write_struct(&tiles->png_ptr, &tiles->info_ptr);
+    _io_png_fclose(tiles->fp);
+    _io_png_free(tiles->band);
+    _io_png_free(tiles->count);
+    _io_png_free(tiles->done);
+    _io_png_free(tiles);
+    (void) io_png_set_alloc(prev);
+    return;
+}
+
+/*
+ * ROW READ
+ */
+
+/**
+ * @brief row reader state
+ *
+ * The PNG reader, with the conversion kernels for every data type.
+ * The allocator current at the opening is used until the end.
+ */
+struct io_png_rows_s {
+    _io_png_rd_t rd;
+    _io_png_rd_kern_t kern[3];  /* by data type */
+    size_t nc;                  /* output channels */
+    const io_png_alloc_t *alloc;        /* allocator at the opening */
+};
+
+/**
+ * @brief open a PNG file to be read row by row
+ *
+ * Only the current row is kept in memory, except for the Adam7 files
+ * and the files with an IDAT index, decoded at once.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param nxp, nyp, ncp pointers to variables to be filled with the
+ *        number of columns, lines and channels of the image, if not NULL
+ * @param opt read option, IO_PNG_OPT_NONE, IO_PNG_OPT_RGB or
+ *        IO_PNG_OPT_GRAY
+ * @return row reader, abort() on error
+ */
+io_png_rows_t *io_png_rows_open(const char *fname,
+                                size_t * nxp, size_t * nyp, size_t * ncp,
+                                io_png_opt_t opt)
+{
+    io_png_rows_t *rows;
+    int o, t;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    o = _io_png_rd_opt(opt);
+    rows = _IO_PNG_SAFE_MALLOC(1, io_png_rows_t);
+    rows->alloc = _io_png_cur_alloc;
+    _io_png_rd_open(&rows->rd, fname);
+    for (t = 0; t < 3; t++)
+        rows->kern[t] = _io_png_kern()->rd[t][o][rows->rd.nc - 1];
+    rows->nc = _io_png_rd_nc[o][rows->rd.nc - 1];
+
+    if (NULL != nxp)
+        *nxp = rows->rd.nx;
+    if (NULL != nyp)
+        *nyp = rows->rd.ny;
+    if (NULL != ncp)
+        *ncp = rows->nc;
+    return rows;
+}
+
+/**
+ * @brief internal function used to read the next row
+ *
+ * @param rows row reader
+ * @param data output array, nc channels of nx values
+ * @param stride distance between the channels, in values
+ * @param type output data type, _IO_PNG_FLT, _IO_PNG_UCHAR or
+ *        _IO_PNG_USHRT
+ * @return void, abort() on error
+ */
+static void _io_png_rows_get(io_png_rows_t * rows, void *data,
+                             size_t stride, int type)
+{
+    const io_png_alloc_t *prev;
+
+    if (NULL == rows || NULL == data || stride < rows->rd.nx)
+        _IO_PNG_ABORT("bad parameters");
+    if (rows->rd.y == rows->rd.ny)
+        _IO_PNG_ABORT("no more rows");
+
+    prev = io_png_set_alloc(rows->alloc);
+    rows->kern[type] (data, _io_png_rd_row(&rows->rd), rows->rd.nx, stride);
+    (void) io_png_set_alloc(prev);
+    return;
+}
+
+/**
+ * @brief read the next row into a float array
+ *
+ * The row is deinterlaced, with values in [0,1]. With stride = nx,
+ * the row array is RRR.GGG.BBB.AAA.; with stride = nx * ny, the rows
+ * can be read in place into a whole image array.
+ *
+ * @param rows row reader
+ * @param data output array, nc channels of nx values
+ * @param stride distance between the channels, in values
+ * @return void, abort() on error
+ */
+void io_png_rows_get_flt(io_png_rows_t * rows, float *data, size_t stride)
+{
+    _io_png_rows_get(rows, (void *) data, stride, _IO_PNG_FLT);
+    return;
+}
+
+/**
+ * @brief read the next row into an unsigned char array
+ *
+ * @param rows row reader
+ * @param data output array, nc channels of nx values
+ * @param stride distance between the channels, in values
+ * @return void, abort() on error
+ */
+void io_png_rows_get_uchar(io_png_rows_t * rows, unsigned char *data,
+                           size_t stride)
+{
+    _io_png_rows_get(rows, (void *) data, stride, _IO_PNG_UCHAR);
+    return;
+}
+
+/**
+ * @brief read the next row into an unsigned short array
+ *
+ * @param rows row reader
+ * @param data output array, nc channels of nx values
+ * @param stride distance between the channels, in values
+ * @return void, abort() on error
+ */
+void io_png_rows_get_ushrt(io_png_rows_t * rows, unsigned short *data,
+                           size_t stride)
+{
+    _io_png_rows_get(rows, (void *) data, stride, _IO_PNG_USHRT);
+    return;
+}
+
+/**
+ * @brief end the row reading
+ *
+ * The reading can stop before the last row; the rest of the file is
+ * then ignored.
+ *
+ * @param rows row reader, freed
+ * @return void, abort() on error
+ */
+void io_png_rows_close(io_png_rows_t * rows)
+{
+    const io_png_alloc_t *prev;
+
+    if (NULL == rows)
+        _IO_PNG_ABORT("bad parameters");
+
+    prev = io_png_set_alloc(rows->alloc);
+    _io_png_rd_close(&rows->rd);
+    _io_png_free(rows);
+    (void) io_png_set_alloc(prev);
+    return;
+}
+
+/*
+ * TRANSCODE
+ */
+
+/**
+ * @brief re-encode a PNG file into another PNG file
+ *
+ * The rows are copied from the decoder to the encoder without any
+ * transform, in their native bit depth and color type, so the pixel
+ * values are unchanged. Only the IHDR, PLTE, tRNS, IDAT and IEND
+ * chunks are written, all the other chunks are stripped.
+ *
+ * Only one row is in memory at a time, unless the input or the output
+ * is Adam7 interlaced or indexed, or the fast encoder is used; then
+ * the whole image is buffered.
+ *
+ * @param fname_in input PNG file name, "-" means stdin
+ * @param fname_out output PNG file name, "-" means stdout
+ * @param opt processing option, can be IO_PNG_OPT_ADAM7,
+ *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX, IO_PNG_OPT_INDEX,
+ *         IO_PNG_OPT_FAST, IO_PNG_OPT_ARCHIVE, IO_PNG_OPT_AUTO,
+ *         IO_PNG_OPT_DEADLINE, IO_PNG_OPT_NONE to do nothing
+ * @return void, abort() on error
+ */
+void io_png_transcode(const char *fname_in, const char *fname_out,
+                      io_png_opt_t opt)
+{
+    png_byte png_sig[PNG_SIG_LEN];
+    png_structp png_rd, png_wr;
+    png_infop info_rd, info_wr;
+    png_uint_32 nx, ny;
+    int bit_depth, color_type, interlace_rd, interlace_wr;
+    png_colorp palette;
+    int num_palette;
+    png_bytep trans_alpha;
+    int num_trans;
+    png_color_16p trans_color;
+    png_byte *png_data;
+    size_t rowbytes, bpp;
+    int pass, npass;
+    png_uint_32 i;
+    _io_png_dl_t dl;
+    double t0;
+    /* volatile: because of setjmp/longjmp */
+    FILE *volatile fp_in;
+    FILE *volatile fp_out;
+    /* local error structure */
+    _io_png_err_t err;
+
+    t0 = _io_png_wall();
+    if (NULL == fname_in || NULL == fname_out)
+        _IO_PNG_ABORT("bad parameters");
+    /* streaming into the file being read would corrupt it */
+    if (0 != strcmp(fname_in, "-") && 0 == strcmp(fname_in, fname_out))
+        _IO_PNG_ABORT("input and output must be different files");
+    _io_png_wr_opt_check(opt);
+
+    /* open the PNG input file and check the signature */
+    fp_in = _io_png_fopen(fname_in, "rb");
+    if ((PNG_SIG_LEN != fread(png_sig, 1, PNG_SIG_LEN, fp_in))
+        || 0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN))
+        _IO_PNG_ABORT("the file is not a PNG image");
+    fp_out = _io_png_fopen(fname_out, "wb");
+
+    /*
+     * create and initialize the png_struct and png_info structures
+     * with local error handling and the current allocator, for
+     * both sides
+     */
+    if (NULL == (png_rd = _io_png_create_read(&err)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (info_rd = png_create_info_struct(png_rd)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (png_wr = _io_png_create_write(&err)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (info_wr = png_create_info_struct(png_wr)))
+        _IO_PNG_ABORT("libpng initialization error");
+
+    /* if we get here, we had a problem reading or writing a file */
+    if (0 != setjmp(err.jmpbuf))
+        _IO_PNG_ABORT("libpng transcoding error");
+
+    _io_png_init_io(png_rd, fp_in, 0);
+    png_set_sig_bytes(png_rd, PNG_SIG_LEN);
+    _io_png_init_io(png_wr, fp_out, 1);
+
+    /* read the header, no transform except the Adam7 rows */
+    png_read_info(png_rd, info_rd);
+    (void) png_get_IHDR(png_rd, info_rd, &nx, &ny, &bit_depth, &color_type,
+                        &interlace_rd, NULL, NULL);
+    npass = png_set_interlace_handling(png_rd);
+    png_read_update_info(png_rd, info_rd);
+    rowbytes = (size_t) png_get_rowbytes(png_rd, info_rd);
+    /* filter on whole bytes, at least one */
+    bpp = ((size_t) png_get_channels(png_rd, info_rd) * bit_depth + 7) / 8;
+
+    /* same header, with the new options */
+    interlace_wr = PNG_INTERLACE_NONE;
+    if (opt & IO_PNG_OPT_ADAM7)
+        interlace_wr = PNG_INTERLACE_ADAM7;
+    png_set_IHDR(png_wr, info_wr, nx, ny, bit_depth, color_type,
+                 interlace_wr, PNG_COMPRESSION_TYPE_BASE,
+                 PNG_FILTER_TYPE_BASE);
+    png_set_compression_level(png_wr, _io_png_zlevel(opt));
+
+    /* keep the chunks needed to interpret the pixel values */
+    if (png_get_valid(png_rd, info_rd, PNG_INFO_PLTE)) {
+        (void) png_get_PLTE(png_rd, info_rd, &palette, &num_palette);
+        png_set_PLTE(png_wr, info_wr, palette, num_palette);
+    }
+    if (png_get_valid(png_rd, info_rd, PNG_INFO_tRNS)) {
+        (void) png_get_tRNS(png_rd, info_rd, &trans_alpha, &num_trans,
+                            &trans_color);
+        png_set_tRNS(png_wr, info_wr, trans_alpha, num_trans, trans_color);
+    }
+    png_write_info(png_wr, info_wr);
+
+    if (PNG_INTERLACE_NONE == interlace_rd
+        && PNG_INTERLACE_NONE == interlace_wr
+        && !(opt & (IO_PNG_OPT_INDEX | IO_PNG_OPT_FAST
+                    | IO_PNG_OPT_ARCHIVE | IO_PNG_OPT_AUTO))) {
+        /* stream the rows, one at a time */
+        png_data = _IO_PNG_SAFE_MALLOC(rowbytes, png_byte);
+        if (opt & IO_PNG_OPT_DEADLINE)
+            _io_png_dl_open(&dl, png_wr, rowbytes, (size_t) ny, bpp, t0);
+        for (i = 0; i < ny; i++) {
+            png_read_row(png_rd, png_data, NULL);
+            if (opt & IO_PNG_OPT_DEADLINE)
+                _io_png_dl_row(&dl, png_data);
+            else
+                png_write_row(png_wr, png_data);
+        }
+        if (opt & IO_PNG_OPT_DEADLINE)
+            _io_png_dl_close(&dl);
+    }
+    else {
+        /*
+         * Adam7 passes, the IDAT index, the fast, archive and
+         * automatic encoders need the whole image
+         */
+        png_data = _IO_PNG_SAFE_MALLOC(rowbytes * ny, png_byte);
+        for (pass = 0; pass < npass; pass++)
+            for (i = 0; i < ny; i++)
+                png_read_row(png_rd, png_data + rowbytes * i, NULL);
+        if (opt & IO_PNG_OPT_INDEX)
+            _io_png_write_idx(png_wr, png_data, rowbytes, (size_t) ny, bpp,
+                              _io_png_zlevel(opt));
+        else if (opt & IO_PNG_OPT_FAST)
+            _io_png_write_fast(png_wr, png_data, rowbytes, (size_t) ny);
+        else if (opt & IO_PNG_OPT_ARCHIVE)
+            _io_png_write_arch(png_wr, png_data, rowbytes, (size_t) ny,
+                               bpp);
+        else if (opt & IO_PNG_OPT_AUTO)
+            _io_png_write_auto(png_wr, png_data, rowbytes, (size_t) ny,
+                               bpp, opt);
+        else if (opt & IO_PNG_OPT_DEADLINE) {
+            _io_png_dl_open(&dl, png_wr, rowbytes, (size_t) ny, bpp, t0);
+            for (i = 0; i < ny; i++)
+                _io_png_dl_row(&dl, png_data + rowbytes * i);
+            _io_png_dl_close(&dl);
+        }
+        else {
+            npass = png_set_interlace_handling(png_wr);
+            for (pass = 0; pass < npass; pass++)
+                for (i = 0; i < ny; i++)
+                    png_write_row(png_wr, png_data + rowbytes * i);
+        }
+    }
+    png_read_end(png_rd, NULL);
+    if (!(opt & (IO_PNG_OPT_INDEX | IO_PNG_OPT_FAST | IO_PNG_OPT_ARCHIVE
+                 | IO_PNG_OPT_AUTO | IO_PNG_OPT_DEADLINE)))
+        png_write_end(png_wr, info_wr);
+
+    /* clean up and free any memory allocated, close the files */
+    png_destroy_read_struct(&png_rd, &info_rd, NULL);
+    png_destroy_write_struct(&png_wr, &info_wr);
+    _io_png_free(png_data);
+    _io_png_fclose(fp_in);
+    _io_png_fclose(fp_out);
+
+    return;
+}
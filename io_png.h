@@ -15,20 +15,73 @@ typedef enum io_png_opt_e {
     IO_PNG_OPT_GRAY = 0x02,
     IO_PNG_OPT_ADAM7 = 0x10,
     IO_PNG_OPT_ZMIN = 0x20,
-    IO_PNG_OPT_ZMAX = 0x40
+    IO_PNG_OPT_ZMAX = 0x40,
+    IO_PNG_OPT_INDEX = 0x80,
+    IO_PNG_OPT_FAST = 0x100,
+    IO_PNG_OPT_ARCHIVE = 0x200,
+    IO_PNG_OPT_AUTO = 0x400,
+    IO_PNG_OPT_DEADLINE = 0x800
 } io_png_opt_t;
 
+/** @brief tiled writer, see io_png_tiles_open() */
+typedef struct io_png_tiles_s io_png_tiles_t;
+/** @brief row reader, see io_png_rows_open() */
+typedef struct io_png_rows_s io_png_rows_t;
+
+/** @brief memory allocator, see io_png_set_alloc() */
+typedef struct io_png_alloc_s {
+    void *(*alloc_fn) (void *ctx, size_t size);
+    void *(*realloc_fn) (void *ctx, void *ptr, size_t size);
+    void (*free_fn) (void *ctx, void *ptr);
+    void *ctx;
+} io_png_alloc_t;
+
+/** @brief time by stage of the read and write calls, see io_png_timing() */
+typedef struct io_png_timing_s {
+    double open, io, codec, convert, close, other;
+    double total;
+    unsigned long calls;
+} io_png_timing_t;
+
+/** @brief memory counters, see io_png_mem() */
+typedef struct io_png_mem_s {
+    unsigned long allocs, lib_allocs;
+    size_t bytes, lib_bytes;
+    size_t live, peak;
+} io_png_mem_t;
+
 /* io_png.c */
 char *io_png_info(void);
+const io_png_alloc_t *io_png_set_alloc(const io_png_alloc_t *alloc);
+const io_png_alloc_t *io_png_get_alloc(void);
+void io_png_free(void *data);
+int io_png_timing(io_png_timing_t *last, io_png_timing_t *rd, io_png_timing_t *wr);
+void io_png_timing_reset(void);
+int io_png_mem(io_png_mem_t *last, io_png_mem_t *all);
+void io_png_mem_reset(void);
 float *io_png_read_flt_opt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp, io_png_opt_t opt);
 float *io_png_read_flt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
 unsigned char *io_png_read_uchar_opt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp, io_png_opt_t opt);
 unsigned char *io_png_read_uchar(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
 unsigned short *io_png_read_ushrt_opt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp, io_png_opt_t opt);
 unsigned short *io_png_read_ushrt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
+float *io_png_read_flt_mmap(const char *fname, const char *dir, size_t *nxp, size_t *nyp, size_t *ncp);
+void io_png_munmap_flt(float *data, size_t nx, size_t ny, size_t nc);
+void io_png_write_flt_opt(const char *fname, const float *data, size_t nx, size_t ny, size_t nc, io_png_opt_t opt);
 void io_png_write_flt(const char *fname, const float *data, size_t nx, size_t ny, size_t nc);
+void io_png_write_uchar_opt(const char *fname, const unsigned char *data, size_t nx, size_t ny, size_t nc, io_png_opt_t opt);
 void io_png_write_uchar(const char *fname, const unsigned char *data, size_t nx, size_t ny, size_t nc);
+void io_png_write_ushrt_opt(const char *fname, const unsigned short *data, size_t nx, size_t ny, size_t nc, io_png_opt_t opt);
 void io_png_write_ushrt(const char *fname, const unsigned short *data, size_t nx, size_t ny, size_t nc);
+io_png_tiles_t *io_png_tiles_open(const char *fname, size_t nx, size_t ny, size_t nc, size_t tnx, size_t tny, io_png_opt_t opt);
+void io_png_tiles_put_flt(io_png_tiles_t *tiles, const float *data, size_t tx, size_t ty);
+void io_png_tiles_close(io_png_tiles_t *tiles);
+io_png_rows_t *io_png_rows_open(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp, io_png_opt_t opt);
+void io_png_rows_get_flt(io_png_rows_t *rows, float *data, size_t stride);
+void io_png_rows_get_uchar(io_png_rows_t *rows, unsigned char *data, size_t stride);
+void io_png_rows_get_ushrt(io_png_rows_t *rows, unsigned short *data, size_t stride);
+void io_png_rows_close(io_png_rows_t *rows);
+void io_png_transcode(const char *fname_in, const char *fname_out, io_png_opt_t opt);
 
 #ifdef __cplusplus
 }
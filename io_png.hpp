@@ -0,0 +1,1255 @@
+/*
+ * Copyright (c) 2010-2011, Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under, at your option, the terms of the GNU General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version, or
+ * the terms of the simplified BSD license.
+ *
+ * You should have received a copy of these licenses along this
+ * program. If not, see <http://www.gnu.org/licenses/> and
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+/**
+ * @file io_png.hpp
+ * @brief C++ wrapper for io_png.c, header only
+ *
+ * The images read by io_png.c are owned by a move-only image type,
+ * without any copy of the arrays allocated by the C functions, and
+ * released when the image is destroyed. Non-owning strided views
+ * give access to these arrays and to the arrays of other libraries,
+ * planar or interleaved, and are compatible with std::mdspan. With
+ * C++20 coroutines, the rows are also available from a generator.
+ * With C++17, the memory can come from a std::pmr::memory_resource.
+ * Pointwise expressions are evaluated lazily, row by row, while they
+ * are written.
+ *
+ * This needs C++11.
+ */
+
+#ifndef _IO_PNG_HPP
+#define _IO_PNG_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+#if defined(__cpp_lib_mdspan)
+#include <array>
+#include <mdspan>
+#endif
+#if defined(__cpp_lib_memory_resource)
+#define IO_PNG_HPP_PMR
+#include <cstring>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#endif
+#if defined(__cpp_impl_coroutine) && defined(__cpp_lib_coroutine)
+#define IO_PNG_HPP_COROUTINE
+#include <coroutine>
+#include <iterator>
+#include <memory>
+#endif
+
+#include "io_png.h"
+
+namespace io_png {
+
+/**
+ * @brief non-owning image view, with strides
+ *
+ * The value at column x, row y, channel c is at data[x * sx + y * sy +
+ * c * sc]. The io_png.c arrays are planar, with the strides (1, nx, nx
+ * * ny); interleaved arrays have the strides (nc, nx * nc, 1). The
+ * view is copied by value.
+ */
+template <typename T> class image_view {
+  public:
+    typedef T value_type;
+
+    /** @brief empty view */
+    image_view() noexcept
+    : data_(nullptr), nx_(0), ny_(0), nc_(0), sx_(0), sy_(0), sc_(0) {
+    }
+
+    /**
+     * @brief view of an array
+     *
+     * @param data array
+     * @param nx, ny, nc image size
+     * @param sx, sy, sc column, row and channel strides, in values
+     */
+    image_view(T * data, std::size_t nx, std::size_t ny, std::size_t nc,
+               std::ptrdiff_t sx, std::ptrdiff_t sy,
+               std::ptrdiff_t sc) noexcept
+    : data_(data), nx_(nx), ny_(ny), nc_(nc), sx_(sx), sy_(sy), sc_(sc) {
+    }
+
+    /** @brief const view of a mutable view */
+    template <typename U, typename = typename std::enable_if <
+        std::is_convertible<U *, T *>::value >::type>
+        image_view(const image_view<U> & other) noexcept
+    : data_(other.data()), nx_(other.nx()), ny_(other.ny()),
+        nc_(other.nc()), sx_(other.stride_x()), sy_(other.stride_y()),
+        sc_(other.stride_c()) {
+    }
+
+    /** @name size and layout */
+    /** @{ */
+    std::size_t nx() const noexcept {
+        return nx_;
+    }
+    std::size_t ny() const noexcept {
+        return ny_;
+    }
+    std::size_t nc() const noexcept {
+        return nc_;
+    }
+    std::size_t size() const noexcept {
+        return nx_ * ny_ * nc_;
+    }
+    std::ptrdiff_t stride_x() const noexcept {
+        return sx_;
+    }
+    std::ptrdiff_t stride_y() const noexcept {
+        return sy_;
+    }
+    std::ptrdiff_t stride_c() const noexcept {
+        return sc_;
+    }
+    /** @brief contiguous planar layout, the io_png.c one */
+    bool is_planar() const noexcept {
+        return (1 == sx_ && (std::ptrdiff_t) nx_ == sy_
+                && (std::ptrdiff_t) (nx_ * ny_) == sc_);
+    }
+    /** @} */
+
+    /** @name data access */
+    /** @{ */
+    T *data() const noexcept {
+        return data_;
+    }
+    /** @brief value at column x, row y, channel c */
+    T & operator() (std::size_t x, std::size_t y, std::size_t c = 0) const
+        noexcept {
+        return data_[(std::ptrdiff_t) x * sx_ + (std::ptrdiff_t) y * sy_
+                     + (std::ptrdiff_t) c * sc_];
+    }
+    /** @brief first value of row y, channel c, then every stride_x() */
+    T *row(std::size_t y, std::size_t c = 0) const noexcept {
+        return data_ + (std::ptrdiff_t) y * sy_ + (std::ptrdiff_t) c * sc_;
+    }
+    /** @brief view of channel c */
+    image_view plane(std::size_t c) const noexcept {
+        return image_view(data_ + (std::ptrdiff_t) c * sc_, nx_, ny_, 1,
+                          sx_, sy_, sc_);
+    }
+#if defined(__cpp_lib_mdspan)
+    /** @brief std::mdspan, indexed by (c, y, x) */
+    std::mdspan<T, std::dextents<std::size_t, 3>, std::layout_stride>
+        to_mdspan() const {
+        typedef std::dextents<std::size_t, 3> ext_t;
+        std::array<std::size_t, 3> strides = {
+            (std::size_t) sc_, (std::size_t) sy_, (std::size_t) sx_
+        };
+        return std::mdspan<T, ext_t, std::layout_stride>
+            (data_, std::layout_stride::mapping<ext_t>
+             (ext_t(nc_, ny_, nx_), strides));
+    }
+#endif
+    /** @} */
+
+  private:
+    T *data_;
+    std::size_t nx_, ny_, nc_;
+    std::ptrdiff_t sx_, sy_, sc_;
+};
+
+/** @brief view of a planar array, the io_png.c layout */
+template <typename T>
+inline image_view<T> planar_view(T * data, std::size_t nx, std::size_t ny,
+                                 std::size_t nc) noexcept
+{
+    return image_view<T>(data, nx, ny, nc, 1, (std::ptrdiff_t) nx,
+                         (std::ptrdiff_t) (nx * ny));
+}
+
+/** @brief view of an interleaved array, RGBRGB... */
+template <typename T>
+inline image_view<T> interleaved_view(T * data, std::size_t nx,
+                                      std::size_t ny,
+                                      std::size_t nc) noexcept
+{
+    return image_view<T>(data, nx, ny, nc, (std::ptrdiff_t) nc,
+                         (std::ptrdiff_t) (nx * nc), 1);
+}
+
+/**
+ * @brief image array, with its size, owner of the array
+ *
+ * The array has the io_png.c layout: nc planes of ny rows of nx
+ * values. The image can be moved, not copied, and releases the array
+ * with free(), or with the function or the io_png.c allocator given
+ * to the constructor.
+ */
+template <typename T> class image {
+  public:
+    typedef T value_type;
+    /** @brief array release function */
+    typedef void (*release_t) (T *, std::size_t, std::size_t, std::size_t);
+
+    /** @brief empty image */
+    image() noexcept
+    : data_(nullptr), nx_(0), ny_(0), nc_(0), release_(&free_array),
+        alloc_(nullptr) {
+    }
+
+    /**
+     * @brief take the ownership of an array
+     *
+     * @param data array allocated by malloc(), or released by release
+     * @param nx, ny, nc image size
+     * @param release array release function
+     */
+    image(T * data, std::size_t nx, std::size_t ny, std::size_t nc,
+          release_t release = &free_array) noexcept
+    : data_(data), nx_(nx), ny_(ny), nc_(nc), release_(release),
+        alloc_(nullptr) {
+    }
+
+    /**
+     * @brief take the ownership of an array allocated by an io_png.c
+     * allocator
+     *
+     * @param data array allocated by alloc
+     * @param nx, ny, nc image size
+     * @param alloc allocator, see io_png_set_alloc(), must outlive the
+     *        image; NULL for free()
+     */
+    image(T * data, std::size_t nx, std::size_t ny, std::size_t nc,
+          const io_png_alloc_t * alloc) noexcept
+    : data_(data), nx_(nx), ny_(ny), nc_(nc), release_(&free_array),
+        alloc_(alloc) {
+    }
+
+    image(const image &) = delete;
+    image & operator=(const image &) = delete;
+
+    /** @brief move, the other image is left empty */
+    image(image && other) noexcept
+    : data_(other.data_), nx_(other.nx_), ny_(other.ny_), nc_(other.nc_),
+        release_(other.release_), alloc_(other.alloc_) {
+        other.data_ = nullptr;
+        other.nx_ = other.ny_ = other.nc_ = 0;
+    }
+
+    /** @brief move, the previous array is released */
+    image & operator=(image && other) noexcept {
+        if (this != &other) {
+            reset();
+            data_ = other.data_;
+            nx_ = other.nx_;
+            ny_ = other.ny_;
+            nc_ = other.nc_;
+            release_ = other.release_;
+            alloc_ = other.alloc_;
+            other.data_ = nullptr;
+            other.nx_ = other.ny_ = other.nc_ = 0;
+        }
+        return *this;
+    }
+
+    ~image() {
+        reset();
+    }
+
+    /** @brief release the array, the image is empty */
+    void reset() noexcept {
+        if (nullptr != data_ && nullptr != alloc_)
+            alloc_->free_fn(alloc_->ctx, data_);
+        else if (nullptr != data_)
+            release_(data_, nx_, ny_, nc_);
+        data_ = nullptr;
+        nx_ = ny_ = nc_ = 0;
+    }
+
+    /**
+     * @brief give up the ownership of the array, the image is empty
+     *
+     * @return array, to release with free(), the release function or
+     *         the allocator
+     */
+    T *release() noexcept {
+        T *data = data_;
+        data_ = nullptr;
+        nx_ = ny_ = nc_ = 0;
+        return data;
+    }
+
+    /** @brief the image has an array */
+    explicit operator  bool() const noexcept {
+        return nullptr != data_;
+    }
+
+    /** @name size */
+    /** @{ */
+    std::size_t nx() const noexcept {
+        return nx_;
+    }
+    std::size_t ny() const noexcept {
+        return ny_;
+    }
+    std::size_t nc() const noexcept {
+        return nc_;
+    }
+    /** @brief number of values */
+    std::size_t size() const noexcept {
+        return nx_ * ny_ * nc_;
+    }
+    /** @} */
+
+    /** @name data access */
+    /** @{ */
+    T *data() noexcept {
+        return data_;
+    }
+    const T *data() const noexcept {
+        return data_;
+    }
+    /** @brief view of the whole image */
+    image_view<T> view() noexcept {
+        return planar_view(data_, nx_, ny_, nc_);
+    }
+    image_view<const T> view() const noexcept {
+        return planar_view((const T *) data_, nx_, ny_, nc_);
+    }
+    /** @brief channel c, ny rows of nx values */
+    T *plane(std::size_t c) noexcept {
+        return data_ + c * nx_ * ny_;
+    }
+    const T *plane(std::size_t c) const noexcept {
+        return data_ + c * nx_ * ny_;
+    }
+    /** @brief value at column x, row y, channel c */
+    T & operator() (std::size_t x, std::size_t y, std::size_t c = 0)
+        noexcept {
+        return data_[(c * ny_ + y) * nx_ + x];
+    }
+    const T & operator() (std::size_t x, std::size_t y,
+                          std::size_t c = 0) const noexcept {
+        return data_[(c * ny_ + y) * nx_ + x];
+    }
+    T *begin() noexcept {
+        return data_;
+    }
+    T *end() noexcept {
+        return data_ + size();
+    }
+    const T *begin() const noexcept {
+        return data_;
+    }
+    const T *end() const noexcept {
+        return data_ + size();
+    }
+    /** @} */
+
+  private:
+    /** @brief default release function */
+    static void free_array(T * data, std::size_t, std::size_t, std::size_t) {
+        std::free(data);
+    }
+
+    T *data_;
+    std::size_t nx_, ny_, nc_;
+    release_t release_;
+    const io_png_alloc_t *alloc_;
+};
+
+/** @brief io_png.c functions, by data type */
+namespace detail {
+template <typename T> struct io;
+
+template <> struct io<float> {
+    static float *read(const char *fname, std::size_t * nx,
+                       std::size_t * ny, std::size_t * nc,
+                       io_png_opt_t opt) {
+        return io_png_read_flt_opt(fname, nx, ny, nc, opt);
+    }
+    static void get(io_png_rows_t * rows, float *data, std::size_t stride) {
+        io_png_rows_get_flt(rows, data, stride);
+    }
+    static void write(const char *fname, const float *data, std::size_t nx,
+                      std::size_t ny, std::size_t nc, io_png_opt_t opt) {
+        io_png_write_flt_opt(fname, data, nx, ny, nc, opt);
+    }
+};
+
+template <> struct io<unsigned char> {
+    static unsigned char *read(const char *fname, std::size_t * nx,
+                               std::size_t * ny, std::size_t * nc,
+                               io_png_opt_t opt) {
+        return io_png_read_uchar_opt(fname, nx, ny, nc, opt);
+    }
+    static void get(io_png_rows_t * rows, unsigned char *data,
+                    std::size_t stride) {
+        io_png_rows_get_uchar(rows, data, stride);
+    }
+    static void write(const char *fname, const unsigned char *data,
+                      std::size_t nx, std::size_t ny, std::size_t nc,
+                      io_png_opt_t opt) {
+        io_png_write_uchar_opt(fname, data, nx, ny, nc, opt);
+    }
+};
+
+template <> struct io<unsigned short> {
+    static unsigned short *read(const char *fname, std::size_t * nx,
+                                std::size_t * ny, std::size_t * nc,
+                                io_png_opt_t opt) {
+        return io_png_read_ushrt_opt(fname, nx, ny, nc, opt);
+    }
+    static void get(io_png_rows_t * rows, unsigned short *data,
+                    std::size_t stride) {
+        io_png_rows_get_ushrt(rows, data, stride);
+    }
+    static void write(const char *fname, const unsigned short *data,
+                      std::size_t nx, std::size_t ny, std::size_t nc,
+                      io_png_opt_t opt) {
+        io_png_write_ushrt_opt(fname, data, nx, ny, nc, opt);
+    }
+};
+}                               /* namespace detail */
+
+/**
+ * @brief read a PNG file into an image
+ *
+ * T is float ([0,1] values), unsigned char or unsigned short. The
+ * array comes from the allocator of the calling thread, see
+ * io_png_set_alloc(), and goes back to it when the image is
+ * destroyed; the allocator must outlive the image.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param opt read option, IO_PNG_OPT_NONE, IO_PNG_OPT_RGB or
+ *        IO_PNG_OPT_GRAY
+ * @return image, owner of the array allocated by io_png.c
+ */
+template <typename T>
+inline image<T> read(const char *fname, io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    std::size_t nx = 0, ny = 0, nc = 0;
+    const io_png_alloc_t *alloc = io_png_get_alloc();
+    T *data = detail::io<T>::read(fname, &nx, &ny, &nc, opt);
+    return image<T>(data, nx, ny, nc, alloc);
+}
+
+template <typename T>
+inline image<T> read(const std::string & fname,
+                     io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    return read<T>(fname.c_str(), opt);
+}
+
+#if defined(IO_PNG_HPP_PMR)
+namespace detail {
+/**
+ * @brief io_png.c allocator on a std::pmr::memory_resource
+ *
+ * Each block starts with a header keeping its resource and size,
+ * for the deallocation. The resource is locked, for the OpenMP worker
+ * threads.
+ */
+class pmr_alloc {
+  public:
+    explicit pmr_alloc(std::pmr::memory_resource * mr) noexcept : mr_(mr) {
+        alloc_.alloc_fn = &alloc_fn;
+        alloc_.realloc_fn = &realloc_fn;
+        alloc_.free_fn = &free_fn;
+        alloc_.ctx = this;
+    }
+    pmr_alloc(const pmr_alloc &) = delete;
+    pmr_alloc & operator=(const pmr_alloc &) = delete;
+
+    const io_png_alloc_t *get() const noexcept {
+        return &alloc_;
+    }
+
+    /** @brief release a block, without io_png */
+    static void release(void *ptr) noexcept {
+        if (nullptr == ptr)
+            return;
+        head_t *h = head(ptr);
+        h->mr->deallocate(h, h->size, align);
+    }
+
+  private:
+    struct head_t {
+        std::pmr::memory_resource *mr;
+        std::size_t size;
+    };
+    static constexpr std::size_t align = alignof(std::max_align_t);
+    static constexpr std::size_t head_size =
+        (sizeof(head_t) + align - 1) / align * align;
+
+    static head_t *head(void *ptr) noexcept {
+        return (head_t *) ((char *) ptr - head_size);
+    }
+
+    static void *alloc_fn(void *ctx, std::size_t size) noexcept {
+        pmr_alloc *a = (pmr_alloc *) ctx;
+        std::lock_guard<std::mutex> lock(a->mutex_);
+        void *p;
+        try {
+            p = a->mr_->allocate(head_size + size, align);
+        } catch (const std::bad_alloc &) {
+            return nullptr;     /* io_png.c aborts */
+        }
+        head_t *h = (head_t *) p;
+        h->mr = a->mr_;
+        h->size = head_size + size;
+        return (char *) p + head_size;
+    }
+
+    static void *realloc_fn(void *ctx, void *ptr, std::size_t size) noexcept {
+        void *p = alloc_fn(ctx, size);
+        if (nullptr != p && nullptr != ptr) {
+            std::size_t old = head(ptr)->size - head_size;
+            std::memcpy(p, ptr, old < size ? old : size);
+            free_fn(ctx, ptr);
+        }
+        return p;
+    }
+
+    static void free_fn(void *ctx, void *ptr) noexcept {
+        pmr_alloc *a = (pmr_alloc *) ctx;
+        std::lock_guard<std::mutex> lock(a->mutex_);
+        release(ptr);
+    }
+
+    std::pmr::memory_resource *mr_;
+    std::mutex mutex_;
+    io_png_alloc_t alloc_;
+};
+}                               /* namespace detail */
+
+/**
+ * @brief allocate the io_png.c memory from a memory resource
+ *
+ * While the scope is alive, all the memory allocated by io_png.c in
+ * this thread, output arrays and temporary buffers, comes from the
+ * resource. The row readers and tiled writers opened in the scope
+ * must be closed before its end. The output arrays are released with
+ * io_png::pmr_release().
+ */
+class memory_scope {
+  public:
+    explicit memory_scope(std::pmr::memory_resource * mr)
+    : alloc_(mr), prev_(io_png_set_alloc(alloc_.get())) {
+    }
+    memory_scope(const memory_scope &) = delete;
+    memory_scope & operator=(const memory_scope &) = delete;
+    ~memory_scope() {
+        (void) io_png_set_alloc(prev_);
+    }
+
+  private:
+    detail::pmr_alloc alloc_;
+    const io_png_alloc_t *prev_;
+};
+
+/** @brief release an array allocated in a memory_scope */
+template <typename T>
+inline void pmr_release(T * data, std::size_t, std::size_t, std::size_t)
+{
+    detail::pmr_alloc::release((void *) data);
+}
+
+/**
+ * @brief read a PNG file into an image, with a memory resource
+ *
+ * The output array and all the temporary buffers come from the
+ * resource, and the array goes back to the resource when the image
+ * is destroyed.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param opt read option, IO_PNG_OPT_NONE, IO_PNG_OPT_RGB or
+ *        IO_PNG_OPT_GRAY
+ * @param mr memory resource, must outlive the image
+ * @return image, owner of the array
+ */
+template <typename T>
+inline image<T> read(const char *fname, io_png_opt_t opt,
+                     std::pmr::memory_resource * mr)
+{
+    std::size_t nx = 0, ny = 0, nc = 0;
+    T *data;
+    {
+        memory_scope scope(mr);
+        data = detail::io<T>::read(fname, &nx, &ny, &nc, opt);
+    }
+    return image<T>(data, nx, ny, nc, &pmr_release<T>);
+}
+
+template <typename T>
+inline image<T> read(const std::string & fname, io_png_opt_t opt,
+                     std::pmr::memory_resource * mr)
+{
+    return read<T>(fname.c_str(), opt, mr);
+}
+#endif                          /* IO_PNG_HPP_PMR */
+
+/**
+ * @brief read a PNG file into a float image mapped to a scratch file
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param dir scratch file folder
+ * @return image, released by io_png_munmap_flt()
+ */
+inline image<float> read_mmap(const char *fname, const char *dir)
+{
+    std::size_t nx = 0, ny = 0, nc = 0;
+    float *data = io_png_read_flt_mmap(fname, dir, &nx, &ny, &nc);
+    return image<float>(data, nx, ny, nc, &io_png_munmap_flt);
+}
+
+/**
+ * @brief write an image into a PNG file
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param img image
+ * @param opt write options, see io_png_write_flt_opt()
+ */
+template <typename T>
+inline void write(const char *fname, const image<T> & img,
+                  io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    detail::io<T>::write(fname, img.data(), img.nx(), img.ny(), img.nc(),
+                         opt);
+}
+
+template <typename T>
+inline void write(const std::string & fname, const image<T> & img,
+                  io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    write(fname.c_str(), img, opt);
+}
+
+/**
+ * @brief write an image view into a PNG file
+ *
+ * A contiguous planar view is written without copy; other layouts are
+ * copied to a planar array first.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param v image view
+ * @param opt write options, see io_png_write_flt_opt()
+ */
+template <typename T>
+inline void write(const char *fname, const image_view<T> & v,
+                  io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    typedef typename std::remove_const<T>::type U;
+
+    if (v.is_planar()) {
+        detail::io<U>::write(fname, v.data(), v.nx(), v.ny(), v.nc(), opt);
+        return;
+    }
+    std::vector<U> tmp(v.size());
+    image_view<U> p = planar_view(tmp.data(), v.nx(), v.ny(), v.nc());
+    for (std::size_t c = 0; c < v.nc(); c++)
+        for (std::size_t y = 0; y < v.ny(); y++)
+            for (std::size_t x = 0; x < v.nx(); x++)
+                p(x, y, c) = v(x, y, c);
+    detail::io<U>::write(fname, tmp.data(), v.nx(), v.ny(), v.nc(), opt);
+}
+
+template <typename T>
+inline void write(const std::string & fname, const image_view<T> & v,
+                  io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    write(fname.c_str(), v, opt);
+}
+
+/**
+ * @brief lazy pointwise expression, base of the expression types
+ *
+ * An expression E has a size, nx(), ny() and nc(), and a float value
+ * e(x, y, c) at each pixel and channel, computed only when needed.
+ * The values are in [0,1] like the float arrays of io_png.c. The
+ * operands of an expression must have the same size, or abort().
+ */
+template <typename E> struct expr {
+    const E & self() const noexcept {
+        return static_cast<const E &>(*this);
+    }
+};
+
+namespace detail {
+/** @brief value to [0,1] float, like the io_png.c conversions */
+inline float to_flt(float v) noexcept
+{
+    return v;
+}
+inline float to_flt(unsigned char v) noexcept
+{
+    return (float) v / (float) 255;
+}
+inline float to_flt(unsigned short v) noexcept
+{
+    return (float) v / (float) 65535;
+}
+
+/** @brief abort() on bad expression parameters, like io_png.c */
+[[noreturn]] inline void bad_expr(const char *msg)
+{
+    std::fprintf(stderr, "io_png.hpp : %s\n", msg);
+    std::fflush(stderr);
+    std::abort();
+}
+
+/** @name pointwise functions */
+/** @{ */
+struct affine_fn {
+    float a, b;
+    float operator() (float v) const noexcept {
+        return a * v + b;
+    }
+};
+struct clamp_fn {
+    float lo, hi;
+    float operator() (float v) const noexcept {
+        return (v < lo ? lo : (v > hi ? hi : v));
+    }
+};
+struct gamma_fn {
+    float g;
+    float operator() (float v) const noexcept {
+        return (v > 0.f ? std::pow(v, g) : 0.f);
+    }
+};
+struct plus_fn {
+    float operator() (float u, float v) const noexcept {
+        return u + v;
+    }
+};
+struct minus_fn {
+    float operator() (float u, float v) const noexcept {
+        return u - v;
+    }
+};
+struct times_fn {
+    float operator() (float u, float v) const noexcept {
+        return u * v;
+    }
+};
+/** @} */
+}                               /* namespace detail */
+
+/** @brief image view as an expression */
+template <typename T> class view_expr : public expr<view_expr<T>> {
+  public:
+    explicit view_expr(const image_view<const T> & v) noexcept : v_(v) {
+    }
+    std::size_t nx() const noexcept {
+        return v_.nx();
+    }
+    std::size_t ny() const noexcept {
+        return v_.ny();
+    }
+    std::size_t nc() const noexcept {
+        return v_.nc();
+    }
+    float operator() (std::size_t x, std::size_t y, std::size_t c) const
+        noexcept {
+        return detail::to_flt(v_(x, y, c));
+    }
+
+  private:
+    image_view<const T> v_;
+};
+
+/** @brief pointwise function of an expression */
+template <typename E, typename F>
+class map_expr : public expr<map_expr<E, F>> {
+  public:
+    map_expr(const E & e, const F & f) : e_(e), f_(f) {
+    }
+    std::size_t nx() const noexcept {
+        return e_.nx();
+    }
+    std::size_t ny() const noexcept {
+        return e_.ny();
+    }
+    std::size_t nc() const noexcept {
+        return e_.nc();
+    }
+    float operator() (std::size_t x, std::size_t y, std::size_t c) const {
+        return f_(e_(x, y, c));
+    }
+
+  private:
+    E e_;
+    F f_;
+};
+
+/** @brief pointwise function of two expressions */
+template <typename E1, typename E2, typename F>
+class zip_expr : public expr<zip_expr<E1, E2, F>> {
+  public:
+    zip_expr(const E1 & e1, const E2 & e2) : e1_(e1), e2_(e2) {
+        if (e1.nx() != e2.nx() || e1.ny() != e2.ny() || e1.nc() != e2.nc())
+            detail::bad_expr("expression sizes");
+    }
+    std::size_t nx() const noexcept {
+        return e1_.nx();
+    }
+    std::size_t ny() const noexcept {
+        return e1_.ny();
+    }
+    std::size_t nc() const noexcept {
+        return e1_.nc();
+    }
+    float operator() (std::size_t x, std::size_t y, std::size_t c) const {
+        return F()(e1_(x, y, c), e2_(x, y, c));
+    }
+
+  private:
+    E1 e1_;
+    E2 e2_;
+};
+
+/**
+ * @brief lookup table, per channel
+ *
+ * The value v of channel c is replaced by the table entry round(v * (n
+ * - 1)), clamped to [0, n - 1]; the table has n entries for all the
+ * channels, or nc * n entries, channel after channel. Other table
+ * sizes abort().
+ */
+template <typename E> class lut_expr : public expr<lut_expr<E>> {
+  public:
+    lut_expr(const E & e, const std::vector<float> & table, std::size_t n)
+    : e_(e), table_(table), n_(n) {
+        if (0 == n || (table.size() != n && table.size() != e.nc() * n))
+            detail::bad_expr("lookup table size");
+    }
+    std::size_t nx() const noexcept {
+        return e_.nx();
+    }
+    std::size_t ny() const noexcept {
+        return e_.ny();
+    }
+    std::size_t nc() const noexcept {
+        return e_.nc();
+    }
+    float operator() (std::size_t x, std::size_t y, std::size_t c) const {
+        float v = e_(x, y, c) * (float) (n_ - 1) + .5f;
+        std::size_t i = (v > 0.f ? (std::size_t) v : 0);
+        i = (i < n_ ? i : n_ - 1);
+        return table_[(table_.size() > n_ ? c * n_ : 0) + i];
+    }
+
+  private:
+    E e_;
+    std::vector<float> table_;
+    std::size_t n_;
+};
+
+/**
+ * @brief channel mix, out(k) = sum_c m[k * nc + c] * in(c) + b[k]
+ *
+ * The input has nc channels, the output b.size() channels, at least
+ * one; m has b.size() * nc entries. Other sizes abort().
+ */
+template <typename E> class mix_expr : public expr<mix_expr<E>> {
+  public:
+    mix_expr(const E & e, const std::vector<float> & m,
+             const std::vector<float> & b)
+    : e_(e), m_(m), b_(b) {
+        if (0 == b.size() || m.size() != b.size() * e.nc())
+            detail::bad_expr("channel mix size");
+    }
+    std::size_t nx() const noexcept {
+        return e_.nx();
+    }
+    std::size_t ny() const noexcept {
+        return e_.ny();
+    }
+    std::size_t nc() const noexcept {
+        return b_.size();
+    }
+    float operator() (std::size_t x, std::size_t y, std::size_t k) const {
+        std::size_t nc = e_.nc();
+        float v = b_[k];
+        for (std::size_t c = 0; c < nc; c++)
+            v += m_[k * nc + c] * e_(x, y, c);
+        return v;
+    }
+
+  private:
+    E e_;
+    std::vector<float> m_, b_;
+};
+
+/** @name expression constructors */
+/** @{ */
+template <typename T>
+inline view_expr<typename std::remove_const<T>::type>
+lazy(const image_view<T> & v) noexcept
+{
+    return view_expr<typename std::remove_const<T>::type>(v);
+}
+template <typename T> inline view_expr<T> lazy(const image<T> & img) noexcept
+{
+    return view_expr<T>(img.view());
+}
+/** @brief a * e + b */
+template <typename E>
+inline map_expr<E, detail::affine_fn> affine(const expr<E> & e, float a,
+                                             float b)
+{
+    detail::affine_fn f = { a, b };
+    return map_expr<E, detail::affine_fn>(e.self(), f);
+}
+/** @brief e clamped to [lo, hi] */
+template <typename E>
+inline map_expr<E, detail::clamp_fn> clamp(const expr<E> & e,
+                                           float lo = 0.f, float hi = 1.f)
+{
+    detail::clamp_fn f = { lo, hi };
+    return map_expr<E, detail::clamp_fn>(e.self(), f);
+}
+/** @brief e to the power g, 0 for the values <= 0 */
+template <typename E>
+inline map_expr<E, detail::gamma_fn> gamma(const expr<E> & e, float g)
+{
+    detail::gamma_fn f = { g };
+    return map_expr<E, detail::gamma_fn>(e.self(), f);
+}
+/** @brief lookup table, see lut_expr */
+template <typename E>
+inline lut_expr<E> lut(const expr<E> & e, const std::vector<float> & table,
+                       std::size_t n)
+{
+    return lut_expr<E>(e.self(), table, n);
+}
+/** @brief channel mix, see mix_expr */
+template <typename E>
+inline mix_expr<E> mix(const expr<E> & e, const std::vector<float> & m,
+                       const std::vector<float> & b)
+{
+    return mix_expr<E>(e.self(), m, b);
+}
+/** @} */
+
+/** @name expression operators */
+/** @{ */
+template <typename E>
+inline map_expr<E, detail::affine_fn> operator*(const expr<E> & e, float a)
+{
+    return affine(e, a, 0.f);
+}
+template <typename E>
+inline map_expr<E, detail::affine_fn> operator*(float a, const expr<E> & e)
+{
+    return affine(e, a, 0.f);
+}
+template <typename E>
+inline map_expr<E, detail::affine_fn> operator+(const expr<E> & e, float b)
+{
+    return affine(e, 1.f, b);
+}
+template <typename E>
+inline map_expr<E, detail::affine_fn> operator+(float b, const expr<E> & e)
+{
+    return affine(e, 1.f, b);
+}
+template <typename E>
+inline map_expr<E, detail::affine_fn> operator-(const expr<E> & e, float b)
+{
+    return affine(e, 1.f, -b);
+}
+template <typename E>
+inline map_expr<E, detail::affine_fn> operator-(float b, const expr<E> & e)
+{
+    return affine(e, -1.f, b);
+}
+template <typename E>
+inline map_expr<E, detail::affine_fn> operator-(const expr<E> & e)
+{
+    return affine(e, -1.f, 0.f);
+}
+template <typename E1, typename E2>
+inline zip_expr<E1, E2, detail::plus_fn> operator+(const expr<E1> & e1,
+                                                   const expr<E2> & e2)
+{
+    return zip_expr<E1, E2, detail::plus_fn>(e1.self(), e2.self());
+}
+template <typename E1, typename E2>
+inline zip_expr<E1, E2, detail::minus_fn> operator-(const expr<E1> & e1,
+                                                    const expr<E2> & e2)
+{
+    return zip_expr<E1, E2, detail::minus_fn>(e1.self(), e2.self());
+}
+template <typename E1, typename E2>
+inline zip_expr<E1, E2, detail::times_fn> operator*(const expr<E1> & e1,
+                                                    const expr<E2> & e2)
+{
+    return zip_expr<E1, E2, detail::times_fn>(e1.self(), e2.self());
+}
+/** @} */
+
+/**
+ * @brief write an expression into a PNG file
+ *
+ * The expression is evaluated by bands of a few rows, into a small
+ * buffer sent to the tiled writer, which converts and interlaces the
+ * rows and encodes them at once; the whole result is never stored.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param e expression
+ * @param opt write option, IO_PNG_OPT_NONE, IO_PNG_OPT_ZMIN or
+ *        IO_PNG_OPT_ZMAX, the other options abort(), see
+ *        io_png_tiles_open()
+ */
+template <typename E>
+inline void write(const char *fname, const expr<E> & e,
+                  io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    const E & x = e.self();
+    std::size_t nx = x.nx(), ny = x.ny(), nc = x.nc();
+    if (0 == nx * ny * nc)
+        detail::bad_expr("empty expression");
+    /* about 64KB per band */
+    std::size_t band = (16384 + nx * nc - 1) / (nx * nc);
+    band = (band < ny ? band : ny);
+    std::vector<float> buf(nx * band * nc);
+
+    io_png_tiles_t *tiles = io_png_tiles_open(fname, nx, ny, nc,
+                                              nx, band, opt);
+    for (std::size_t ty = 0; ty * band < ny; ty++) {
+        std::size_t y0 = ty * band;
+        std::size_t h = (ny - y0 < band ? ny - y0 : band);
+        float *out = buf.data();
+        for (std::size_t c = 0; c < nc; c++)
+            for (std::size_t y = y0; y < y0 + h; y++)
+                for (std::size_t i = 0; i < nx; i++)
+                    *out++ = x(i, y, c);
+        io_png_tiles_put_flt(tiles, buf.data(), 0, ty);
+    }
+    io_png_tiles_close(tiles);
+}
+
+template <typename E>
+inline void write(const std::string & fname, const expr<E> & e,
+                  io_png_opt_t opt = IO_PNG_OPT_NONE)
+{
+    write(fname.c_str(), e, opt);
+}
+
+/**
+ * @brief PNG file read row by row, owner of an io_png.c row reader
+ *
+ * T is float ([0,1] values), unsigned char or unsigned short. The
+ * reader can be moved, not copied, and is closed when destroyed, even
+ * before the last row.
+ */
+template <typename T> class row_reader {
+  public:
+    /**
+     * @brief open a PNG file
+     *
+     * @param fname PNG file name, "-" means stdin
+     * @param opt read option, IO_PNG_OPT_NONE, IO_PNG_OPT_RGB or
+     *        IO_PNG_OPT_GRAY
+     */
+    explicit row_reader(const char *fname,
+                        io_png_opt_t opt = IO_PNG_OPT_NONE)
+    : rows_(nullptr), nx_(0), ny_(0), nc_(0), y_(0) {
+        rows_ = io_png_rows_open(fname, &nx_, &ny_, &nc_, opt);
+    }
+
+    row_reader(const row_reader &) = delete;
+    row_reader & operator=(const row_reader &) = delete;
+
+    /** @brief move, the other reader is left closed */
+    row_reader(row_reader && other) noexcept
+    : rows_(other.rows_), nx_(other.nx_), ny_(other.ny_), nc_(other.nc_),
+        y_(other.y_) {
+        other.rows_ = nullptr;
+    }
+
+    ~row_reader() {
+        if (nullptr != rows_)
+            io_png_rows_close(rows_);
+    }
+
+    /** @name size */
+    /** @{ */
+    std::size_t nx() const noexcept {
+        return nx_;
+    }
+    std::size_t ny() const noexcept {
+        return ny_;
+    }
+    std::size_t nc() const noexcept {
+        return nc_;
+    }
+    /** @brief next row */
+    std::size_t y() const noexcept {
+        return y_;
+    }
+    /** @} */
+
+    /**
+     * @brief read the next row
+     *
+     * @param data output array, nc channels of nx values
+     * @param stride distance between the channels, in values
+     */
+    void get(T * data, std::size_t stride) {
+        detail::io<T>::get(rows_, data, stride);
+        y_ += 1;
+    }
+
+  private:
+    io_png_rows_t *rows_;
+    std::size_t nx_, ny_, nc_;
+    std::size_t y_;
+};
+
+#if defined(IO_PNG_HPP_COROUTINE)
+/**
+ * @brief minimal C++20 generator, an input range of the yielded values
+ *
+ * The coroutine runs until the next co_yield at each iterator
+ * increment; the yielded value is valid until then.
+ */
+template <typename V> class generator {
+  public:
+    struct promise_type {
+        const V *value = nullptr;
+
+        generator get_return_object() noexcept {
+            return generator(handle_t::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() const noexcept {
+            return {};
+        }
+        std::suspend_always final_suspend() const noexcept {
+            return {};
+        }
+        std::suspend_always yield_value(const V & v) noexcept {
+            value = std::addressof(v);
+            return {};
+        }
+        void return_void() const noexcept {
+        }
+        void unhandled_exception() {
+            throw;
+        }
+    };
+    typedef std::coroutine_handle<promise_type> handle_t;
+
+    class iterator {
+      public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::ptrdiff_t difference_type;
+        typedef V value_type;
+
+        iterator() noexcept = default;
+        explicit iterator(handle_t h) noexcept : h_(h) {
+        }
+        const V & operator*() const noexcept {
+            return *h_.promise().value;
+        }
+        iterator & operator++() {
+            h_.resume();
+            return *this;
+        }
+        void operator++(int) {
+            ++*this;
+        }
+        bool operator==(std::default_sentinel_t) const noexcept {
+            return !h_ || h_.done();
+        }
+
+      private:
+        handle_t h_ = nullptr;
+    };
+
+    generator(const generator &) = delete;
+    generator & operator=(const generator &) = delete;
+    generator(generator && other) noexcept : h_(other.h_) {
+        other.h_ = nullptr;
+    }
+    ~generator() {
+        if (h_)
+            h_.destroy();
+    }
+
+    /** @brief run until the first value */
+    iterator begin() {
+        h_.resume();
+        return iterator(h_);
+    }
+    std::default_sentinel_t end() const noexcept {
+        return {};
+    }
+
+  private:
+    explicit generator(handle_t h) noexcept : h_(h) {
+    }
+
+    handle_t h_;
+};
+
+/**
+ * @brief read a PNG file by bands of rows, with a generator
+ *
+ * Each band of rows is yielded as a view of band x nx values per
+ * channel, less for the last band; the decoder state is kept between
+ * the bands, and only one band is in memory. Stopping before the end
+ * closes the file.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param opt read option, IO_PNG_OPT_NONE, IO_PNG_OPT_RGB or
+ *        IO_PNG_OPT_GRAY
+ * @param band number of rows per band
+ * @return generator of image_view<const T>
+ */
+template <typename T>
+generator<image_view<const T>> rows(std::string fname,
+                                    io_png_opt_t opt = IO_PNG_OPT_NONE,
+                                    std::size_t band = 1)
+{
+    row_reader<T> rd(fname.c_str(), opt);
+    std::size_t nx = rd.nx(), nc = rd.nc();
+    band = (0 == band ? 1 : band);
+    std::vector<T> buf(nx * band * nc);
+
+    while (rd.y() < rd.ny()) {
+        std::size_t h = (rd.ny() - rd.y() < band ? rd.ny() - rd.y() : band);
+        for (std::size_t i = 0; i < h; i++)
+            rd.get(buf.data() + i * nx, nx * band);
+        co_yield image_view<const T>(buf.data(), nx, h, nc, 1,
+                                     (std::ptrdiff_t) nx,
+                                     (std::ptrdiff_t) (nx * band));
+    }
+}
+#endif                          /* IO_PNG_HPP_COROUTINE */
+
+}                               /* namespace io_png */
+
+#endif                          /* !_IO_PNG_HPP */
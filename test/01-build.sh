@@ -2,6 +2,165 @@
 #
 # Test the code compilation and execution.
 
+# Copy the PNG file $1 to $2 with the second offset of the IDAT index
+# moved by one byte, and a valid chunk CRC.
+_test_bad_index() {
+    P=$(grep -obUa ioIX $1 | head -n 1 | cut -d: -f1)
+    B=$(od -A n -t u1 -j $((P + 23)) -N 1 $1)
+    head -c $((P + 23)) $1 > $2
+    C=
+    printf "\\$(printf %o $(((B + 1) % 256)))" >> $2
+    tail -c +$((P + 25)) $1 | head -c 8 >> $2
+    # gzip ends with the little-endian CRC32 of the data
+    for B in $(tail -c +$((P + 1)) $2 | head -c 32 | gzip -c \
+	| tail -c 8 | head -c 4 | od -A n -t o1); do
+	C="\\$B$C"
+    done
+    printf "$C" >> $2
+    tail -c +$((P + 37)) $1 >> $2
+}
+
+# Copy the PNG file $1 to $2 with the last 4 bytes of the zlib stream,
+# its checksum, cut from the last IDAT chunk, and a valid chunk CRC.
+_test_cut_stream() {
+    P=$(grep -obUa IDAT $1 | tail -n 1 | cut -d: -f1)
+    L=0
+    for B in $(od -A n -t u1 -j $((P - 4)) -N 4 $1); do
+	L=$((L * 256 + B))
+    done
+    L=$((L - 4))
+    head -c $((P - 4)) $1 > $2
+    for S in 24 16 8 0; do
+	printf "\\$(printf %o $(((L >> S) % 256)))" >> $2
+    done
+    tail -c +$((P + 1)) $1 | head -c $((L + 4)) >> $2
+    C=
+    # gzip ends with the little-endian CRC32 of the data
+    for B in $(tail -c +$((P + 1)) $2 | gzip -c \
+	| tail -c 8 | head -c 4 | od -A n -t o1); do
+	C="\\$B$C"
+    done
+    printf "$C" >> $2
+    tail -c +$((P + L + 13)) $1 >> $2
+}
+
+# Compare the pixels of the PNG files $1 and $2, exactly.
+_test_same_pixels() {
+    test "$(./example/axpb 1 $1 0 - | md5sum)" \
+	= "$(./example/axpb 1 $2 0 - | md5sum)"
+}
+
+# Check the moves of the C++ wrapper images: the array changes hands,
+# the moved-from images are empty, and the images cannot be copied.
+_test_move() {
+    BIN=$(tempfile)
+    c++ -I. -o $BIN -x c++ - -x none io_png.o -pthread -lpng -lz -lm <<'EOF'
+#include <type_traits>
+#include <utility>
+#include "io_png.hpp"
+typedef io_png::image<unsigned char> img_t;
+static_assert(!std::is_copy_constructible<img_t>::value, "copy");
+static_assert(!std::is_copy_assignable<img_t>::value, "copy");
+static_assert(std::is_nothrow_move_constructible<img_t>::value, "move");
+static_assert(std::is_nothrow_move_assignable<img_t>::value, "move");
+int main()
+{
+    img_t a = io_png::read<unsigned char>("data/lena_rgb.png");
+    const unsigned char *p = a.data();
+    img_t b(std::move(a));
+    img_t c = io_png::read<unsigned char>("data/lena_g.png");
+    c = std::move(b);
+    return (a || b || !c || p != c.data() || 3 != c.nc());
+}
+EOF
+    $BIN
+    rm -f $BIN
+}
+
+# Check that the C++ wrapper images release their arrays with the
+# allocator set when they were read, even after it was replaced.
+_test_alloc() {
+    BIN=$(tempfile)
+    c++ -I. -o $BIN -x c++ - -x none io_png.o -pthread -lpng -lz -lm <<'EOF'
+#include <cstdlib>
+#include "io_png.hpp"
+static int live = 0;
+static void *alloc_fn(void *, std::size_t size)
+{
+    live++;
+    return std::malloc(size);
+}
+static void *realloc_fn(void *, void *ptr, std::size_t size)
+{
+    live += (nullptr == ptr);
+    return std::realloc(ptr, size);
+}
+static void free_fn(void *, void *ptr)
+{
+    live -= (nullptr != ptr);
+    std::free(ptr);
+}
+int main()
+{
+    io_png_alloc_t alloc = { &alloc_fn, &realloc_fn, &free_fn, nullptr };
+    {
+        io_png::image<float> img;
+        io_png_set_alloc(&alloc);
+        img = io_png::read<float>("data/lena_rgb.png");
+        io_png_set_alloc(nullptr);
+        if (1 != live)
+            return 1;
+    }
+    return (0 != live);
+}
+EOF
+    $BIN
+    rm -f $BIN
+}
+
+# Check that the C++ wrapper expressions of bad sizes abort(): operands
+# of different sizes, lookup table and channel mix not matching the
+# channels, empty image. The same expressions of good sizes work.
+_test_bad_expr() {
+    BIN=$(tempfile)
+    c++ -I. -o $BIN -x c++ - -x none io_png.o -pthread -lpng -lz -lm <<'EOF'
+#include <cstring>
+#include <vector>
+#include "io_png.hpp"
+int main(int argc, char **argv)
+{
+    std::vector<float> a(64 * 64 * 3, .5f), b(8 * 8 * 3, .5f), t(5);
+    io_png::image_view<float> va = io_png::planar_view(a.data(), 64, 64, 3);
+    io_png::image_view<float> vb = io_png::planar_view(b.data(), 8, 8, 3);
+    if (3 != argc)
+        return 1;
+    if (0 == std::strcmp("sizes", argv[1]))
+        io_png::write(argv[2], io_png::lazy(va) + io_png::lazy(vb));
+    else if (0 == std::strcmp("lut", argv[1]))
+        io_png::write(argv[2], io_png::lut(io_png::lazy(va), t, 2));
+    else if (0 == std::strcmp("mix", argv[1]))
+        io_png::write(argv[2], io_png::mix(io_png::lazy(va), t,
+                                           std::vector<float>(2)));
+    else if (0 == std::strcmp("empty", argv[1]))
+        io_png::write(argv[2], io_png::lazy(io_png::image_view<float>()));
+    else
+        io_png::write(argv[2],
+                      io_png::mix(io_png::lut(io_png::lazy(va)
+                                              - io_png::lazy(va), t, 5),
+                                  std::vector<float>(6, .5f),
+                                  std::vector<float>(2)));
+    return 0;
+}
+EOF
+    for EXPR in sizes lut mix empty; do
+	if $BIN $EXPR $BIN.png 2> /dev/null; then
+	    return 1
+	fi
+    done
+    $BIN good $BIN.png
+    rm -f $BIN $BIN.png
+}
+
 # Test the code correctness by computing the min/max/mean/std of a
 # known image, lena. The expected output is in the data folder.
 _test_run() {
@@ -16,9 +175,31 @@ _test_run() {
     ./example/axpb 1 - 0 - < data/lena_g.png > $TEMPFILE
     test "b8a0502abf9127666aa093eb346288b7  $TEMPFILE" \
 	= "$(md5sum $TEMPFILE)"
+    # the encoder options must not change the pixels
+    for OPT in "-i -z9 rgba" "-x rgb" "-f ga" "-p rgba" "-d rgb" "-a g"; do
+	IMG=data/lena_${OPT##* }.png
+	IO_PNG_DEADLINE=0.1 ./example/transcode ${OPT% *} $IMG $TEMPFILE
+	_test_same_pixels $IMG $TEMPFILE
+    done
+    # a wrong IDAT index must give the same pixels
+    ./example/transcode -x data/lena_rgb.png $TEMPFILE
+    _test_bad_index $TEMPFILE $TEMPFILE.png
+    _test_same_pixels data/lena_rgb.png $TEMPFILE.png
+    # a zlib stream cut before its checksum must be rejected
+    _test_cut_stream data/lena_rgb.png $TEMPFILE.png
+    if ./example/mmms $TEMPFILE.png 2> /dev/null; then
+	return 1
+    fi
+    # the C++ wrapper, negated twice
+    ./example/negate -s -e data/lena_rgba.png $TEMPFILE
+    ./example/negate -i -m $TEMPFILE $TEMPFILE.png
+    _test_same_pixels data/lena_rgba.png $TEMPFILE.png
+    rm -f $TEMPFILE.png
     rm -f $TEMPFILE
     # test all the read-write code variants
     ./example/readpng data/lena_g.png
+    # the tiled writer must give the same image
+    _test_same_pixels float_rgb.png tiles_rgb.png
 }
 
 ################################################
@@ -28,12 +209,30 @@ _log_init
 echo "* default build, test, clean, rebuild"
 _log make -B debug
 _log _test_run
+_log _test_move
+_log _test_alloc
+_log _test_bad_expr
 _log make -B
 _log _test_run
 _log make
 _log make clean
 _log make
 
+echo "* conversion kernels, for every instruction set"
+for IO_PNG_ISA in generic sse2 avx2 avx512; do
+    export IO_PNG_ISA
+    _log _test_run
+done
+unset IO_PNG_ISA
+
+echo "* libpng decoder only"
+_log make -B CPPFLAGS="-I. -DNDEBUG -DIO_PNG_NO_FAST_READ"
+_log _test_run
+
+echo "* C++20, row generator of the C++ wrapper"
+_log make -B CXXFLAGS="-O2 -std=c++20"
+_log _test_run
+
 echo "* compiler support"
 for CC in cc c++ c89 c99 gcc g++ tcc clang; do
     which $CC || continue
@@ -19,7 +19,9 @@ _log _test_memcheck example/mmms data/lena_rgb.png
 _log _test_memcheck example/mmms data/lena_rgba.png
 _log _test_memcheck example/readpng data/lena_g.png
 _log _test_memcheck example/readpng data/lena_rgba.png
-_log rm -f float*.png from*.png
+_log _test_memcheck example/negate data/lena_rgba.png negate.png
+_log _test_memcheck example/negate -s data/lena_rgba.png negate.png
+_log rm -f float*.png from*.png tiles*.png negate.png
 _log make distclean
 
 _log_clean